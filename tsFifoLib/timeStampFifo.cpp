@@ -5,11 +5,12 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sstream>
+#include <new>
 
 #include <iocsh.h>
 #include <registryFunction.h>
 #include <epicsExport.h>
-// #include <epicsThread.h>
+#include <epicsThread.h>
 #include <dbFldTypes.h>
 #include <aSubRecord.h>
 #include <dbAddr.h>
@@ -21,25 +22,140 @@
 #include "evrTime.h"
 #include "mrfCommon.h"
 #include "timeStampFifo.h"
+#include "tsFifoAutoDelay.h"
+#include "tsFifoEngine.h"
+#include "tsFifoIndex.h"
+#include "tsFifoScan.h"
+#include "tsFifoRead.h"
+#include "tsFifoSched.h"
+#include "tsFifoStats.h"
+#include "tsFifoPersist.h"
 #include "HiResTime.h"
 
 using namespace		std;
 
 int					DEBUG_TS_FIFO	= 1;
 
+/// Max consecutive frames we'll coast on the last known fidDiff while
+/// holding over, or keep searching from the prior FIFO cursor after a
+/// generation change, before giving up and resyncing from scratch.
+int					TS_FIFO_HOLDOVER_MAX	= 3;
+
+/// Min consecutive FIFO_NEXT matches before a miss can hold over
+int					TS_FIFO_SYNC_COUNT_MIN	= 1;
+
+/// When non-zero, step back through up to this many earlier FIFO entries
+/// in one pass w/ TSFifoScanWindow instead of one entry at a time.
+/// Capped at TSFIFO_SCAN_MAX.
+int					TS_FIFO_SCAN_DEPTH		= 0;
+
+/// When non-zero, callers reuse the port's last result if it's for the
+/// same frame, instead of running the sync state machine again.  Callers
+/// that find the port busy wait for the caller holding the lock first.
+int					TS_FIFO_TRYLOCK			= 0;
+
 #ifndef NULL
 #define NULL    0
 #endif
 
-using namespace		std;
+/// Max time in seconds to wait for the pulse id index to confirm a
+/// match for a frame queued for re-stamping
+static const double	TSFifoRestampTimeout	= 2.0;
+
+/// Period in sec of the restamp thread's sweep of queued frames
+static const double	TSFifoRestampPollPeriod	= 0.1;
+
+/// Default pulse id index depth created for re-stamping
+static const double	TSFifoRestampIndexDepth	= 1.0;
+
+/// Max TSC difference in sec between callers reusing one result,
+/// half a 360Hz fiducial, so they're timestamping the same frame
+static const double	TSFifoReuseWindow		= 0.5 / 360.0;
+
+/// Max change in expected delay, sec, for a warm start's diffVsExp range to apply
+static const double	TSFifoPersistDelayTol	= 1e-6;
+
+/// Min change in sec before a learned delay is written to ExpectedDelay
+static const double	TSFifoAutoDelayMinChange	= 0.1e-3;
+
+/// Max number of threads per TSFifo w/ their own applied CPU list and priority
+#define	TSFIFO_SCHED_THREADS_MAX	8
+
+/// CPU list and priority as applied to one thread calling GetTimeStamp
+struct	TSFifoSchedThread
+{
+	epicsThreadId		thread;
+	epicsUInt32			genApplied;		/// schedGen last applied to this thread
+	int					status;			/// 0, or errno from the last apply
+	int					cpuLast;		/// Core of this thread's last GetTimeStamp call
+	TSFifoSchedSaved	saved;			/// This thread's own scheduling
+};
+
+///
+/// TSFifoPvt
+/// TSFifo state whose types timeStampFifo.h doesn't need to know.
+/// One per pool slot, allocated w/ the pool.
+///
+struct	TSFifoPvt
+{
+	TSFifoPvt( )
+		:	schedPriority(	0	),
+			schedGen(		0	),
+			nSchedThreads(	0	),
+			iSchedReplace(	0	),
+			cpuLast(		-1	),
+			nMigrations(	0	)
+	{
+		cpuList[0]	= '\0';
+		memset( &sched, 0, sizeof(sched) );
+		memset( schedThreads, 0, sizeof(schedThreads) );
+		memset( &persist, 0, sizeof(persist) );
+	}
+
+	TSFifoStats				delayStats;		/// Actual delay statistics for synced frames (sec)
+	TSFifoAutoDelay			autoDelay;		/// ExpectedDelay auto-tuning
+
+	/// Guarded by TSFifo::m_schedLock
+	char					cpuList[TSFIFO_CPU_LIST_MAX];
+	int						schedPriority;
+	TSFifoSched				sched;			/// cpuList and schedPriority, parsed
+	epicsUInt32				schedGen;		/// Increments on each SetSched
+	unsigned int			nSchedThreads;
+	unsigned int			iSchedReplace;	/// Next entry to reuse when the table is full
+	TSFifoSchedThread		schedThreads[TSFIFO_SCHED_THREADS_MAX];
+	int						cpuLast;		/// Core of the last GetTimeStamp call
+	epicsUInt32				nMigrations;	/// Core changes between a thread's GetTimeStamp calls
+
+	TSFifoPersistData		persist;		/// Warm start file loaded by Create
+};
+
+/// Sync quality of the last frame timestamped by this thread, so
+/// TSFifoGetSyncInfo gets the caller's own frame when threads share a port
+static thread_local const TSFifo	*	s_pThreadSyncPort	= NULL;
+static thread_local TSFifoSyncInfo		s_threadSyncInfo;
+
+/// Static TSFifo pool
+TSFifo			*	TSFifo::ms_pPool		= NULL;
+TSFifoPvt		*	TSFifo::ms_pPvtPool		= NULL;
+bool			*	TSFifo::ms_pPoolInUse	= NULL;
+unsigned int		TSFifo::ms_poolSize		= 0;
+
+/// Serializes pool allocation, Create and Destroy
+static epicsMutexId			s_poolLock	= 0;
+static epicsThreadOnceId	s_poolOnce	= EPICS_THREAD_ONCE_INIT;
+
+static void PoolLockInit( void * )
+{
+	s_poolLock	= epicsMutexMustCreate( );
+}
 
-/// Static TSFifo map by port name
-map<string, TSFifo *>   TSFifo::ms_TSFifoMap;
+/// The restamp thread is started w/ the first restamp callback
+static epicsThreadOnceId	s_restampOnce	= EPICS_THREAD_ONCE_INIT;
 
 
 // TimeStampFifo is the function that gets registered
 // with asynDriver as the timeStampSource
-static void TimeStampFifo(
+extern "C" void TimeStampFifo(
 	void					*	userPvt,
 	epicsTimeStamp			*	pTimeStamp )
 {
@@ -74,7 +190,8 @@ static void TimeStampFifo(
 TSFifo::TSFifo(
 	const char	*	pPortName,
 	aSubRecord	*	pSubRecord,
-	TSPolicy		tsPolicy	)
+	TSPolicy		tsPolicy,
+	TSFifoPvt	*	pPvt	)
 	:	m_eventCode(	0				),
 		m_genCount(		0				),
 		m_genPrior(		0				),
@@ -84,24 +201,56 @@ TSFifo::TSFifo(
 		m_diffVsExp(	0.0				),
 		m_diffVsExpMin(	0.0				),
 		m_diffVsExpMax(	0.0				),
+		m_fifoDelayMin(	0.0				),
+		m_fifoDelayMax(	0.0				),
 		m_pSubRecord(	pSubRecord		),
-		m_portName(		pPortName		),
 		m_idx(			0LL				),
 		m_idxIncr(		MAX_TS_QUEUE	),
 		m_fidPrior(		PULSEID_INVALID	),
 		m_fidDiffPrior(	0				),
 		m_syncCount(	0				),
-		m_syncCountMin(	1				),
+		m_syncState(	TS_SEARCHING	),
+		m_fidDiffLock(	PULSEID_INVALID	),
+		m_holdoverCount(0				),
+		m_relockCount(	0				),
 		m_tscNow(		0LL				),
 		m_fifoDelay(	0.0				),
 		m_fidFifo(		PULSEID_INVALID	),
 		m_TSPolicy(		tsPolicy		),
-		m_TSLock(		0				)
+		m_TSLock(		0				),
+		m_pPvt(			pPvt			),
+		m_pEngine(		NULL			),
+		m_pSim(			NULL			),
+		m_pRestampCallback(	NULL		),
+		m_pRestampPvt(	NULL			),
+		m_restampToken(	0				),
+		m_nRestamp(		0				),
+		m_schedLock(	0				),
+		m_lastSynced(	false			),
+		m_lastTscNow(	0LL				),
+		m_lastDiffVsExp(	0.0			),
+		m_lastGen(		0				),
+		m_nContended(	0				),
+		m_nReused(		0				),
+		m_nFifoReads(	0				),
+		m_persistPending(	false		),
+		m_persistApplied(	false		),
+		m_fidDiffWarm(		false		),
+		m_nPersistSaves(	0			),
+		m_persistStatus(	0			)
 {
+	m_syncInfo.pulseId		= PULSEID_INVALID;
+	m_syncInfo.syncType		= TSFIFO_SYNC_FAILED;
+	m_syncInfo.diffVsExp	= 0;
+	m_syncInfo.nFifoReads	= 0;
+	m_syncInfo.generation	= 0;
+	strncpy( m_portName, pPortName, TSFIFO_PORT_NAME_MAX - 1 );
+	m_portName[TSFIFO_PORT_NAME_MAX - 1]	= '\0';
 	m_TSLock	= epicsMutexCreate( );
-	if ( m_TSLock )
-		AddTSFifo( this );
-	else
+	if ( m_TSLock == 0 )
+		printf( "TSFifo: Unable to register TSFifo due to epicsMutexCreate error!\n" );
+	m_schedLock	= epicsMutexCreate( );
+	if ( m_schedLock == 0 )
 		printf( "TSFifo: Unable to register TSFifo due to epicsMutexCreate error!\n" );
 }
 
@@ -111,62 +260,205 @@ TSFifo::~TSFifo( )
 	if ( m_TSLock )
 	{
 		epicsMutexLock( m_TSLock );
-		DelTSFifo( this );
 		epicsMutexDestroy( m_TSLock );
 		m_TSLock = 0;
 	}
+	if ( m_schedLock )
+	{
+		epicsMutexDestroy( m_schedLock );
+		m_schedLock = 0;
+	}
+	TSFifoEngine::Unsubscribe( m_pEngine );
+	m_pEngine	= NULL;
+	m_pPvt->~TSFifoPvt( );
 }
  
 
-void TSFifo::AddTSFifo( TSFifo	*	pTSFifo )
+/// PoolInit:  Allocate the TSFifo pool
+/// This is the only allocation for TSFifo ports, so after iocInit
+/// nothing on the timestamp path touches the heap.
+int TSFifo::PoolInit( unsigned int nPorts )
 {
-	assert( FindByPortName( pTSFifo->m_portName ) == NULL );
-	ms_TSFifoMap[ pTSFifo->m_portName ]	= pTSFifo;
+	epicsThreadOnce( &s_poolOnce, PoolLockInit, NULL );
+	epicsMutexLock( s_poolLock );
+	if ( ms_pPool != NULL )
+	{
+		epicsMutexUnlock( s_poolLock );
+		printf( "TSFifo: Pool already allocated for %u ports\n", ms_poolSize );
+		return -1;
+	}
+	int		status	= PoolAlloc( nPorts );
+	epicsMutexUnlock( s_poolLock );
+	return status;
+}
+
+
+/// PoolAlloc:  Allocate the TSFifo pool w/ room for nPorts
+/// Returns 0 on success, -1 if the allocation failed
+/// Must be called w/ s_poolLock locked!
+int TSFifo::PoolAlloc( unsigned int nPorts )
+{
+	if ( nPorts == 0 )
+		nPorts	= TSFIFO_POOL_DEFAULT;
+
+	ms_pPool		= static_cast<TSFifo *>( operator new( nPorts * sizeof(TSFifo), nothrow ) );
+	ms_pPvtPool		= static_cast<TSFifoPvt *>( operator new( nPorts * sizeof(TSFifoPvt), nothrow ) );
+	ms_pPoolInUse	= new (nothrow) bool[nPorts];
+	if ( ms_pPool == NULL || ms_pPvtPool == NULL || ms_pPoolInUse == NULL )
+	{
+		operator delete( ms_pPool );
+		operator delete( ms_pPvtPool );
+		delete [] ms_pPoolInUse;
+		ms_pPool		= NULL;
+		ms_pPvtPool		= NULL;
+		ms_pPoolInUse	= NULL;
+		printf( "TSFifo: Unable to allocate pool for %u ports\n", nPorts );
+		return -1;
+	}
+	for ( unsigned int i = 0; i < nPorts; i++ )
+		ms_pPoolInUse[i]	= false;
+	ms_poolSize	= nPorts;
+
+	if ( DEBUG_TS_FIFO >= 2 )
+		printf( "TSFifo: Allocated pool for %u ports, %zu bytes\n", nPorts,
+				nPorts * ( sizeof(TSFifo) + sizeof(TSFifoPvt) ) );
+	return 0;
+}
+
+
+TSFifo	*	TSFifo::Create(
+	const char	*	pPortName,
+	aSubRecord	*	pSubRecord,
+	TSPolicy		tsPolicy	)
+{
+	if ( pPortName == NULL || strlen(pPortName) == 0 )
+		return NULL;
+	if ( strlen(pPortName) >= TSFIFO_PORT_NAME_MAX )
+	{
+		printf( "TSFifo: Port name %s is longer than %d chars\n", pPortName, TSFIFO_PORT_NAME_MAX - 1 );
+		return NULL;
+	}
+
+	// Load any warm start file before taking the pool lock, so the file
+	// I/O doesn't hold up other ports.  It's applied once we know our
+	// event code and generation.
+	TSFifoPersistData	persist;
+	bool				fPersist	= ( TSFifoPersistLoad( pPortName, persist ) == 0 );
+
+	epicsThreadOnce( &s_poolOnce, PoolLockInit, NULL );
+	epicsMutexLock( s_poolLock );
+	if ( ms_pPool == NULL && PoolAlloc( TSFIFO_POOL_DEFAULT ) != 0 )
+	{
+		epicsMutexUnlock( s_poolLock );
+		printf( "TSFifo: Unable to create port %s w/o a pool\n", pPortName );
+		return NULL;
+	}
+	if ( FindByPortName( pPortName ) != NULL )
+	{
+		epicsMutexUnlock( s_poolLock );
+		printf( "TSFifo: Port %s already exists\n", pPortName );
+		return NULL;
+	}
+	unsigned int	iSlot	= 0;
+	while ( iSlot < ms_poolSize && ms_pPoolInUse[iSlot] )
+		iSlot++;
+	if ( iSlot >= ms_poolSize )
+	{
+		epicsMutexUnlock( s_poolLock );
+		printf( "TSFifo: Pool is full, increase TSFifoPoolInit from %u ports\n", ms_poolSize );
+		return NULL;
+	}
+
+	TSFifoPvt	*	pPvt	= new ( &ms_pPvtPool[iSlot] ) TSFifoPvt( );
+	TSFifo		*	pTSFifo	= new ( &ms_pPool[iSlot] ) TSFifo( pPortName, pSubRecord, tsPolicy, pPvt );
+	if ( pTSFifo->m_TSLock == 0 || pTSFifo->m_schedLock == 0 )
+	{
+		pTSFifo->~TSFifo( );
+		epicsMutexUnlock( s_poolLock );
+		return NULL;
+	}
+	if ( fPersist )
+	{
+		pPvt->persist				= persist;
+		pTSFifo->m_persistPending	= true;
+	}
+	ms_pPoolInUse[iSlot]	= true;
+	epicsMutexUnlock( s_poolLock );
+	return pTSFifo;
 }
 
 
-void TSFifo::DelTSFifo( TSFifo	*	pTSFifo )
+void TSFifo::Destroy( TSFifo * pTSFifo )
 {
-	ms_TSFifoMap.erase( pTSFifo->m_portName );
+	if ( pTSFifo == NULL )
+		return;
+	epicsThreadOnce( &s_poolOnce, PoolLockInit, NULL );
+	epicsMutexLock( s_poolLock );
+	if ( pTSFifo < ms_pPool || pTSFifo >= ms_pPool + ms_poolSize )
+	{
+		epicsMutexUnlock( s_poolLock );
+		return;
+	}
+	unsigned int	iSlot	= pTSFifo - ms_pPool;
+	if ( ms_pPoolInUse[iSlot] )
+	{
+		ms_pPoolInUse[iSlot]	= false;
+		pTSFifo->~TSFifo( );
+	}
+	epicsMutexUnlock( s_poolLock );
 }
  
 
-TSFifo	*	TSFifo::FindByPortName( const string & portName )
+/// FindByPortName:  Find a port in the pool
+/// The pool lock keeps Create and Destroy from changing a slot mid compare.
+/// The pool lock is recursive, so Create can call this w/ it held.
+TSFifo	*	TSFifo::FindByPortName( const char * pPortName )
 {
-	map<string, TSFifo *>::iterator   it  = ms_TSFifoMap.find( portName );
-	if ( it == ms_TSFifoMap.end() )
+	if ( pPortName == NULL )
 		return NULL;
-	return it->second;
+	epicsThreadOnce( &s_poolOnce, PoolLockInit, NULL );
+	epicsMutexLock( s_poolLock );
+	TSFifo	*	pTSFifo	= NULL;
+	for ( unsigned int iSlot = 0; iSlot < ms_poolSize; iSlot++ )
+	{
+		if (	ms_pPoolInUse[iSlot]
+			&&	strncmp( ms_pPool[iSlot].m_portName, pPortName, TSFIFO_PORT_NAME_MAX ) == 0 )
+		{
+			pTSFifo	= &ms_pPool[iSlot];
+			break;
+		}
+	}
+	epicsMutexUnlock( s_poolLock );
+	return pTSFifo;
 }
 
 
-asynStatus TSFifo::RegisterTimeStampSource( )
+int TSFifo::RegisterTimeStampSource( )
 {
 	const char		*	functionName	= "TSFifo::RegisterTimeStampFifo";
 	asynUser		*   pasynUser = pasynManager->createAsynUser( 0, 0 );
-	asynStatus			status    = pasynManager->connectDevice( pasynUser, m_portName.c_str(), 0 );
+	asynStatus			status    = pasynManager->connectDevice( pasynUser, m_portName, 0 );
 	if ( status != asynSuccess )
 	{
 		printf( "Error %s: cannot connect to asyn port %s\n",
-				functionName, m_portName.c_str() );
+				functionName, m_portName );
 		return status;
 	}
 	status = pasynManager->registerTimeStampSource( pasynUser, this, TimeStampFifo );
 	if ( status != asynSuccess )
 	{
 		printf( "Error %s: cannot register TimeStampSource for port %s\n",
-				functionName, m_portName.c_str() );
+				functionName, m_portName );
 		return status;
 	}
 	double	secPerTick	= HiResTicksToSeconds( 1LL );
 	if ( DEBUG_TS_FIFO >= 2 )
 		printf( "TimeStampSource: Registered %s.  TimerResolution = %.3esec per tick\n",
-				m_portName.c_str(), secPerTick );
+				m_portName, secPerTick );
 	return asynSuccess;
 }
 
-enum SyncType		{ FIFO_NEXT, FIFO_DLY, FID_DIFF, TOO_LATE, FAILED };
-const char * SyncTypeToStr( SyncType tySync )
+const char * TSFifo::SyncTypeToStr( SyncType tySync )
 {
 	const char	*	pStr	= "Invalid";
 	switch ( tySync )
@@ -176,6 +468,21 @@ const char * SyncTypeToStr( SyncType tySync )
 	case FID_DIFF:		pStr	= "FID_DIFF";	break;
 	case TOO_LATE:		pStr	= "TOO_LATE";	break;
 	case FAILED:		pStr	= "FAILED";		break;
+	case LAST_EC:		pStr	= "LAST_EC";	break;
+	case TOD:			pStr	= "TOD";		break;
+	}
+	return pStr;
+}
+
+const char * TSFifo::SyncStateToStr( TSSyncState syncState )
+{
+	const char	*	pStr	= "Invalid";
+	switch ( syncState )
+	{
+	case TS_LOCKED:		pStr	= "LOCKED";		break;
+	case TS_HOLDOVER:	pStr	= "HOLDOVER";	break;
+	case TS_SEARCHING:	pStr	= "SEARCHING";	break;
+	case TS_RELOCKING:	pStr	= "RELOCKING";	break;
 	}
 	return pStr;
 }
@@ -190,8 +497,11 @@ const char * SyncTypeToStr( SyncType tySync )
 ///   TS_TOD    - Provides a synced, pulse id'd timestamp for the specified event code
 ///				  if available.  If not, it provides the current time w/ the most recent
 ///				  fiducial pulse id.
-int TSFifo::GetTimeStamp(
-	epicsTimeStamp	*	pTimeStampRet )
+/// If pSyncInfo is provided, it's filled in w/ the sync quality of this frame.
+int TSFifo::GetTimeStampEx(
+	epicsTimeStamp	*	pTimeStampRet,
+	SyncInfo		*	pSyncInfo,
+	epicsUInt32		*	pRestampToken )
 {
 	const char		*	functionName	= "TSFifo::GetTimeStamp";
 	int					evrTimeStatus	= 0;
@@ -199,25 +509,108 @@ int TSFifo::GetTimeStamp(
 	bool				fFirstUpdate	= true;
 	unsigned int		nStepBacks		= 0;
 	enum SyncType		tySync			= FAILED;
-
+	bool				fCaughtUp		= false;
+	bool				fLate			= false;
+	bool				fExhausted		= false;
+	epicsUInt32			restampToken	= 0;
+	epicsTimeStamp		restampTimeStamp;
+
+	if ( pRestampToken != NULL )
+		*pRestampToken	= 0;
 	if ( pTimeStampRet == NULL )
 		return -1;
 
+	// Pin this thread to our cores before we read the TSC
+	ApplySched( );
+
 	// Update the 64bit timestamp counter
-	m_tscNow	= GetHiResTicks();
+	t_HiResTime		tscNow	= GetHiResTicks();
+
+	// If another port on our engine matched, or is matching, this frame,
+	// fetch its FIFO entry.  Otherwise we claim the frame and publish our
+	// match for the others once it's done.  This can wait for the other
+	// port, so it's done before we take our own lock.  Engines are never
+	// deleted, and BeginMatch checks the engine still fits the criteria we
+	// read here w/o our lock, so a stale engine just means a private match.
+	TSFifoEngine	*	pEngine		= m_pEngine;
+	TSFifoEngine::MatchStatus	matchStatus	= TSFifoEngine::MATCH_OWN;
+	epicsUInt32			genShared	= m_genCount;
+	uint64_t			idxShared	= 0;
+	EventTimingData		fifoInfoShared;
+	if ( pEngine != NULL && m_TSPolicy == TS_SYNCED )
+		matchStatus	= pEngine->BeginMatch(	tscNow, genShared, m_eventCode, m_expDelay, m_pSim,
+											idxShared, fifoInfoShared );
+	bool				fClaimed	= ( matchStatus == TSFifoEngine::MATCH_CLAIMED );
 
 	//	Lock mutex
-	epicsMutexLock( m_TSLock );
+	if ( TS_FIFO_TRYLOCK == 0 )
+		epicsMutexLock( m_TSLock );
+	else
+	{
+		if ( epicsMutexTryLock( m_TSLock ) != epicsMutexLockOK )
+		{
+			// Another caller is busy, most likely w/ the same frame
+			epicsMutexLock( m_TSLock );
+			m_nContended++;
+		}
+
+		// Reuse the last result if it's for our frame, whether we waited
+		// for its caller or it finished just before we got here
+		double	secSinceLast	= (	tscNow >= m_lastTscNow
+								?	 HiResTicksToSeconds( tscNow - m_lastTscNow )
+								:	-HiResTicksToSeconds( m_lastTscNow - tscNow ) );
+		double	diffVsExp		= m_lastDiffVsExp + secSinceLast;
+		if (	m_TSPolicy	== TS_SYNCED
+			&&	m_lastSynced
+			&&	m_lastGen	== m_genCount
+			&&	fabs( secSinceLast ) < TSFifoReuseWindow
+			&&	InSyncWindow( diffVsExp, m_expDelay ) )
+		{
+			*pTimeStampRet	= m_fifoTimeStamp;
+			m_nReused++;
+			m_nFifoReads	= 0;
+			if ( fClaimed )
+				pEngine->EndMatch( true, m_idx, m_fifoInfo );
+			UpdateSyncInfo( static_cast<SyncType>( m_syncInfo.syncType ), PULSEID(m_fifoTimeStamp), diffVsExp );
+			if ( pSyncInfo != NULL )
+				*pSyncInfo	= m_syncInfo;
+			epicsMutexUnlock( m_TSLock );
+
+			if ( m_pSubRecord != NULL )
+			{
+				dbCommon	*	pDbCommon	= reinterpret_cast<dbCommon *>( m_pSubRecord );
+				scanOnce( pDbCommon );
+			}
+			if ( DEBUG_TS_FIFO >= 5 )
+				printf( "%s: Reused result for the same frame, fid 0x%X\n",
+						functionName, PULSEID(*pTimeStampRet) );
+			return 0;
+		}
+	}
+	m_tscNow		= tscNow;
+	m_lastSynced	= false;
+	m_nFifoReads	= 0;
 
 	// Fetch the most recent timestamp for this event code
 	evrTimeStatus	= evrTimeGet( &curTimeStamp, m_eventCode); 
 
 	// Get the last 360hz Fiducial seen by the driver
-	epicsUInt32	fid360	= timingGetLastFiducial();
+	epicsUInt32	fid360	= TSFifoGetLastFiducial( m_pSim );
+
+	// Sample this frame if we're learning the expected delay.  The FIFO
+	// reads for it are done once we've released our lock.
+	bool	fAutoDelaySample	= m_pPvt->autoDelay.SampleDue( m_tscNow );
 
 	bool	syncedPrior	= m_synced;
 	m_synced	= false;
 
+	// Our policy changed since we claimed the frame, nothing to publish
+	if ( fClaimed && m_TSPolicy != TS_SYNCED )
+	{
+		pEngine->EndMatch( false, m_idx, m_fifoInfo );
+		fClaimed	= false;
+	}
+
 	if ( m_TSPolicy == TS_LAST_EC )
 	{
 		// If evrTimeGet is happy and we were synced before, assume we're still synced
@@ -227,7 +620,12 @@ int TSFifo::GetTimeStamp(
 		*pTimeStampRet = curTimeStamp;
 		evrTimeStatus = UpdateFifoInfo( fFirstUpdate );
 		fFirstUpdate = false;
+		UpdateSyncInfo( LAST_EC, PULSEID(curTimeStamp), m_diffVsExp );
+		if ( pSyncInfo != NULL )
+			*pSyncInfo	= m_syncInfo;
 		epicsMutexUnlock( m_TSLock );
+		if ( fAutoDelaySample )
+			SampleAutoDelay( tscNow );
 
 		if ( DEBUG_TS_FIFO >= 5 )
 			printf( "%s: LAST_EC, expectedDelay=%.2fms, fifoDelay=%.2fms, fid 0x%X\n",
@@ -242,6 +640,12 @@ int TSFifo::GetTimeStamp(
 		epicsTimeStamp		todTimeStamp;
 		evrTimeStatus	= epicsTimeGetCurrent( &todTimeStamp ); 
 		*pTimeStampRet	= todTimeStamp;
+		UpdateSyncInfo( TOD, PULSEID_INVALID, 0.0 );
+		if ( pSyncInfo != NULL )
+			*pSyncInfo	= m_syncInfo;
+		epicsMutexUnlock( m_TSLock );
+		if ( fAutoDelaySample )
+			SampleAutoDelay( tscNow );
 
 		if ( DEBUG_TS_FIFO >= 5 )
 		{
@@ -252,15 +656,35 @@ int TSFifo::GetTimeStamp(
 		return 0;
 	}
 
+	// Adopt the FIFO entry another port matched for this frame if it's
+	// still for our generation and in our own sync window
+	bool				fShared	= false;
+	if (	matchStatus == TSFifoEngine::MATCH_SHARED
+		&&	genShared	== m_genCount
+		&&	InSyncWindow(	HiResTicksToSeconds( m_tscNow - fifoInfoShared.fifo_tsc ) - m_expDelay,
+							m_expDelay ) )
+	{
+		m_idx		= idxShared;
+		m_fifoInfo	= fifoInfoShared;
+		ApplyFifoInfo( fFirstUpdate );
+		fFirstUpdate	= false;
+		evrTimeStatus	= 0;
+		fShared			= true;
+		pEngine->AddShared( );
+	}
+
 	bool	fifoReset	= false;
-	if ( m_idxIncr == MAX_TS_QUEUE )
+	if ( m_idxIncr == MAX_TS_QUEUE && !fShared )
 		fifoReset	= true;
 
 	// First time or unsynced, m_idxIncr is MAX_TS_QUEUE, which
 	// just gets the most recent FIFO timestamp for that eventCode
-	evrTimeStatus = UpdateFifoInfo( fFirstUpdate );
-	fFirstUpdate = false;
-	if ( evrTimeStatus == 0 && m_diffVsExp > 60e-3 )
+	if ( !fShared )
+	{
+		evrTimeStatus = UpdateFifoInfo( fFirstUpdate );
+		fFirstUpdate = false;
+	}
+	if ( !fShared && evrTimeStatus == 0 && m_diffVsExp > 60e-3 )
 	{
 		if ( m_idxIncr != MAX_TS_QUEUE )
 		{
@@ -285,6 +709,12 @@ int TSFifo::GetTimeStamp(
 	{
 		// Nothing available, reset the FIFO increment and give up
 		m_idxIncr     = MAX_TS_QUEUE;
+		m_syncState   = TS_SEARCHING;
+		if ( fClaimed )
+			pEngine->EndMatch( false, m_idx, m_fifoInfo );
+		UpdateSyncInfo( FAILED, PULSEID_INVALID, m_diffVsExp );
+		if ( pSyncInfo != NULL )
+			*pSyncInfo	= m_syncInfo;
 		epicsMutexUnlock( m_TSLock );
 		if ( DEBUG_TS_FIFO >= 5 )
 		{
@@ -333,92 +763,189 @@ int TSFifo::GetTimeStamp(
 	// time for gigE cameras.
 	// Allow 40% early for sloppy estimated delay and 80% late
 	double	diffVsExpPercent = m_diffVsExp * 100.0 / m_expDelay; 
+	fLate	= ( diffVsExpPercent > 80.0 );
 	if ( -40.0 < diffVsExpPercent && diffVsExpPercent <= 80.0 )
 	{
 		// We're synced!
 		m_synced	= true;
 		m_syncCount++;
 		tySync	= FIFO_NEXT;
-		if( m_diffVsExpMax < m_diffVsExp )
-			m_diffVsExpMax = m_diffVsExp;
-		if( m_diffVsExpMin > m_diffVsExp )
-			m_diffVsExpMin = m_diffVsExp;
 	}
-	else
-	{	// See if we have a consistent fidDiff w/ prior samples
-		double	diffVsExpPercent = m_diffVsExp * 100.0 / m_expDelay; 
-		if (	m_fidPrior     != PULSEID_INVALID
-			&&	m_fidDiffPrior != PULSEID_INVALID
-			&&	m_fidDiffPrior == fidDiff
-			&&	m_fidDiffPrior != 0
-			&&	m_syncCount	   >= m_syncCountMin
-			&&	( -40.0 < diffVsExpPercent && diffVsExpPercent <= 80.0 )
-			&&  syncedPrior )
-		{
-			tySync		= FID_DIFF;
-			if( m_syncCount > m_syncCountMin )
-				m_syncCount = m_syncCountMin;
-			else
-				m_syncCount = 0;
-			m_synced	= true;
-
-			if( m_diffVsExpMax < m_diffVsExp )
-				m_diffVsExpMax = m_diffVsExp;
-			if( m_diffVsExpMin > m_diffVsExp )
-				m_diffVsExpMin = m_diffVsExp;
+	else if ( !fifoReset && diffVsExpPercent > 80.0 && CatchUpFifoInfo( ) == 0 )
+	{
+		// Late entry, but a newer one is in the window
+		// We must have missed a trigger, so catch up
+		m_synced	= true;
+		m_syncCount++;
+		tySync		= FIFO_NEXT;
+		fCaughtUp	= true;
+	}
+	else if (	( m_syncState == TS_LOCKED || m_syncState == TS_HOLDOVER )
+			&&	syncedPrior
+			&&	m_fidDiffLock  != PULSEID_INVALID
+			&&	m_fidDiffLock  != 0
+			&&	m_fidDiffLock  == fidDiff
+			&&	m_syncCount	   >= TS_FIFO_SYNC_COUNT_MIN
+			&&	m_holdoverCount < TS_FIFO_HOLDOVER_MAX
+			&&	InHoldoverWindow( m_diffVsExp, m_expDelay ) )
+	{
+		// Brief miss, but the fidDiff matches our locked cadence
+		// Holdover on the last known fidDiff
+		tySync		= FID_DIFF;
+		m_holdoverCount++;
+		m_synced	= true;
+	}
+	else if ( TS_FIFO_SCAN_DEPTH > 0 )
+	{
+		// Check a window of earlier entries in one pass
+		if ( m_diffVsExp <= (2*m_expDelay) && m_fifoDelay > -1e-3 )
+		{
+			nStepBacks++;
+			if ( StepBackScan( TS_FIFO_SCAN_DEPTH, fExhausted ) == 0 )
+			{
+				// Found a match!
+				tySync		= FIFO_DLY;
+				m_idxIncr	= 1;
+				m_syncCount	= 0;
+				m_synced	= true;
+			}
 		}
-		else
+	}
+	else
+	{
+		// Check earlier entries in the FIFO
+		unsigned int	iStepBuf	= 0;
+		unsigned int	nStepBuf	= 0;
+		while ( m_diffVsExp <= (2*m_expDelay) && m_fifoDelay > -1e-3 )
 		{
-			// Check earlier entries in the FIFO
-			while ( m_diffVsExp <= (2*m_expDelay) && m_fifoDelay > -1e-3 )
+			nStepBacks++;
+			m_idxIncr     = -1;
+			evrTimeStatus = StepBackFifoInfo( iStepBuf, nStepBuf );
+			if ( evrTimeStatus != 0 )
 			{
-				nStepBacks++;
-				m_idxIncr     = -1;
-				evrTimeStatus = UpdateFifoInfo( fFirstUpdate );
-				fFirstUpdate = false;
-				if ( evrTimeStatus != 0 )
-				{
-					// FIFO is empty
-					// Reset FIFO so we get the most recent entry next time
-					m_idxIncr	= MAX_TS_QUEUE;
-					tySync		= FAILED;
-					m_synced	= false;
-					m_syncCount	= 0;
-					break;
-				}
+				// FIFO is empty, our entry has aged out
+				// Reset FIFO so we get the most recent entry next time
+				fExhausted	= true;
+				m_idxIncr	= MAX_TS_QUEUE;
+				tySync		= FAILED;
+				m_synced	= false;
+				m_syncCount	= 0;
+				break;
+			}
 
-				if ( DEBUG_TS_FIFO >= 5 )
-					printf( "%s FIFO incr %2d: expectedDelay=%.3fms, fifoDelay=%.3fms, diffVsExp=%.3f\n",
-							functionName, m_idxIncr, m_expDelay*1000, m_fifoDelay*1000, m_diffVsExp*1000 );
+			if ( DEBUG_TS_FIFO >= 5 )
+				printf( "%s FIFO incr %2d: expectedDelay=%.3fms, fifoDelay=%.3fms, diffVsExp=%.3f\n",
+						functionName, m_idxIncr, m_expDelay*1000, m_fifoDelay*1000, m_diffVsExp*1000 );
 
-				double	diffVsExpPercent = m_diffVsExp * 100.0 / m_expDelay; 
-				if ( -40.0 < diffVsExpPercent && diffVsExpPercent <= 80.0 )
-				{
-					// Found a match!
-					tySync		= FIFO_DLY;
-					m_idxIncr	= 1;
-					m_syncCount	= 0;
-					m_synced	= true;	// not yet?
-					break;
-				}
+			double	diffVsExpPercent = m_diffVsExp * 100.0 / m_expDelay; 
+			if ( -40.0 < diffVsExpPercent && diffVsExpPercent <= 80.0 )
+			{
+				// Found a match!
+				tySync		= FIFO_DLY;
+				m_idxIncr	= 1;
+				m_syncCount	= 0;
+				m_synced	= true;	// not yet?
+				break;
 			}
 		}
 	}
 
+	// Holdover frames keep an entry outside our window, so leave them
+	// out of the delay range and statistics
+	if ( m_synced && tySync != FID_DIFF )
+	{
+		if( m_diffVsExpMax < m_diffVsExp )
+			m_diffVsExpMax = m_diffVsExp;
+		if( m_diffVsExpMin > m_diffVsExp )
+			m_diffVsExpMin = m_diffVsExp;
+		m_pPvt->delayStats.Add( m_fifoDelay, m_tscNow );
+	}
+
+	// Remember the cadence between matched FIFO entries for holdover
+	if ( tySync == FIFO_NEXT || tySync == FIFO_DLY )
+	{
+		if ( fCaughtUp )
+			;	// Skipped entries, so this fidDiff isn't our cadence
+		else if ( m_fidFifo != PULSEID_INVALID && m_fidPrior != PULSEID_INVALID )
+		{
+			m_fidDiffLock	= FID_DIFF( m_fidFifo, m_fidPrior );
+			m_fidDiffWarm	= false;
+		}
+		else if ( !m_fidDiffWarm )
+			m_fidDiffLock	= PULSEID_INVALID;
+		m_holdoverCount	= 0;
+	}
+
 	// Remember prior values
 	m_fidPrior		= m_fidFifo;
 	m_fidDiffPrior	= fidDiff;
 
+	// Advance the sync state machine
+	if ( m_synced )
+	{
+		m_syncState	= ( tySync == FID_DIFF ? TS_HOLDOVER : TS_LOCKED );
+	}
+	else if (	m_syncState		== TS_RELOCKING
+			&&	evrTimeStatus	== 0
+			&&	m_relockCount	 < TS_FIFO_HOLDOVER_MAX )
+	{
+		// Keep searching from the prior FIFO cursor for a few more frames
+		m_relockCount++;
+	}
+	else
+	{
+		m_syncState	= TS_SEARCHING;
+	}
+
 	// Check for a generation change
-	if( m_genPrior != m_genCount )
-		m_synced	= false;
+	// Timing changed under us, so this frame can't be trusted, but the
+	// current FIFO cursor is still a good hint for where to relock.
+	bool	fGenChange	= ( m_genPrior != m_genCount );
+	if( fGenChange )
+	{
+		m_synced		= false;
+		m_syncCount		= 0;
+		m_holdoverCount	= 0;
+		m_relockCount	= 0;
+		m_fidDiffLock	= PULSEID_INVALID;
+		m_fidDiffWarm	= false;
+		if ( evrTimeStatus == 0 )
+			m_syncState	= TS_RELOCKING;
+	}
 	m_genPrior		= m_genCount;
 
+	// Publish our match for the other ports on our engine
+	if ( fClaimed )
+		pEngine->EndMatch(	m_synced && ( tySync == FIFO_NEXT || tySync == FIFO_DLY ),
+							m_idx, m_fifoInfo );
+
 	if ( !m_synced )
 	{
-		//	Mark unsynced and reset FIFO selector
-		m_idxIncr			  = MAX_TS_QUEUE;
+		m_syncCount			  = 0;
 		m_fifoTimeStamp.nsec |= PULSEID_INVALID;
+		if ( m_syncState == TS_RELOCKING )
+		{
+			// Resume from the current FIFO cursor
+			m_idxIncr		  = 1;
+		}
+		else
+		{
+			//	Mark unsynced and reset FIFO selector
+			m_idxIncr		  = MAX_TS_QUEUE;
+		}
+	}
+
+	// Queue frames that beat their FIFO entry, or whose entry aged out
+	// before we could step back to it, for re-stamping once the index can
+	// match them.  Frames from a generation change can't be matched later.
+	if (	!m_synced && !fGenChange
+		&&	( ( fLate && evrTimeStatus == 0 ) || fExhausted )
+		&&	pRestampToken != NULL && m_pRestampCallback != NULL )
+	{
+		restampToken	= QueueRestamp( restampTimeStamp );
+		*pRestampToken	= restampToken;
+		if ( restampToken != 0 )
+			tySync	= TOO_LATE;
 	}
 
 	if (	( DEBUG_TS_FIFO & 4 )
@@ -426,14 +953,29 @@ int TSFifo::GetTimeStamp(
 	{
 		char		acBuff[40];
 		epicsTimeToStrftime( acBuff, 40, "%H:%M:%S.%04f", &m_fifoTimeStamp );
-		printf( "%s: %-8s, %-8s, ts %s, fid 0x%X, fidFifo 0x%X, fid360 0x%X, fidDiff %d, fidDiffPrior %d\n",
+		printf( "%s: %-8s, %-10s, %-8s, ts %s, fid 0x%X, fidFifo 0x%X, fid360 0x%X, fidDiff %d, fidDiffPrior %d\n",
 				functionName,
 				( m_synced ? "Synced" : "Unsynced" ),
+				SyncStateToStr( m_syncState ),
 				SyncTypeToStr( tySync ),
 				acBuff, PULSEID(m_fifoTimeStamp), m_fidFifo, fid360,
 				fidDiff, m_fidDiffPrior	);
 	}
+
+	// Remember our result for contending callers, and take a copy for
+	// ourselves before another caller can change it
+	bool			synced			= m_synced;
+	epicsTimeStamp	fifoTimeStamp	= m_fifoTimeStamp;
+	m_lastSynced	= ( synced && PULSEID(fifoTimeStamp) != PULSEID_INVALID );
+	m_lastTscNow	= m_tscNow;
+	m_lastDiffVsExp	= m_diffVsExp;
+	m_lastGen		= m_genCount;
+	UpdateSyncInfo( tySync, PULSEID(fifoTimeStamp), m_diffVsExp );
+	if ( pSyncInfo != NULL )
+		*pSyncInfo	= m_syncInfo;
 	epicsMutexUnlock( m_TSLock );
+	if ( fAutoDelaySample )
+		SampleAutoDelay( tscNow );
 
 	if ( m_pSubRecord != NULL )
 	{
@@ -441,12 +983,16 @@ int TSFifo::GetTimeStamp(
 		scanOnce( pDbCommon );
 	}
 
-	if ( m_TSPolicy == TS_SYNCED && !m_synced )
+	// Queued frames get the provisional timestamp their restamp replaces
+	if ( restampToken != 0 )
+		*pTimeStampRet = restampTimeStamp;
+
+	if ( m_TSPolicy == TS_SYNCED && !synced )
 		return -1;
 
 	// If we have a pulse ID's timestamp, return it
-	if ( PULSEID(m_fifoTimeStamp) != PULSEID_INVALID )
-		*pTimeStampRet = m_fifoTimeStamp;
+	if ( PULSEID(fifoTimeStamp) != PULSEID_INVALID )
+		*pTimeStampRet = fifoTimeStamp;
 	return evrTimeStatus;
 }
 
@@ -466,8 +1012,9 @@ int TSFifo::UpdateFifoInfo( bool fFirstUpdate )
 #if 0
 	int evrTimeStatus = evrTimeGetFifoInfo( &m_fifoInfo, m_eventCode, &m_idx, m_idxIncr );
 #else
-	int evrTimeStatus = timingFifoRead( m_eventCode, m_idxIncr, &m_idx, &m_fifoInfo );
+	int evrTimeStatus = TSFifoRead( m_eventCode, m_idxIncr, &m_idx, &m_fifoInfo, m_pSim );
 #endif
+	m_nFifoReads++;
 	if ( evrTimeStatus != 0 )
 	{
 		// 5 possible failure modes for evrTimeGetFifoInfo()
@@ -496,8 +1043,9 @@ int TSFifo::UpdateFifoInfo( bool fFirstUpdate )
 #if 0
 			evrTimeStatus = evrTimeGetFifoInfo( &m_fifoInfo, m_eventCode, &m_idx, MAX_TS_QUEUE );
 #else
-			evrTimeStatus = timingFifoRead( m_eventCode, MAX_TS_QUEUE, &m_idx, &m_fifoInfo );
+			evrTimeStatus = TSFifoRead( m_eventCode, MAX_TS_QUEUE, &m_idx, &m_fifoInfo, m_pSim );
 #endif
+			m_nFifoReads++;
 			if ( evrTimeStatus != 0 && ( DEBUG_TS_FIFO >= 5 ) )
 			{
 				printf( "UpdateFifoInfo error on reset fetch of fifo info for eventCode %d: evrTimeStatus=%d\n", m_eventCode, evrTimeStatus );
@@ -506,30 +1054,627 @@ int TSFifo::UpdateFifoInfo( bool fFirstUpdate )
 	}
 
 	if ( evrTimeStatus == 0 )
+		ApplyFifoInfo( fFirstUpdate );
+	return evrTimeStatus;
+}
+
+
+/// ApplyFifoInfo:  Update our timestamp and delays from m_fifoInfo
+/// Must be called w/ m_TSLock mutex locked!
+void TSFifo::ApplyFifoInfo( bool fFirstUpdate )
+{
+	// Good timestamp from FIFO
+	m_fifoTimeStamp	= m_fifoInfo.fifo_time;
+	m_fidFifo		= PULSEID( m_fifoTimeStamp );
+
+	// Compute the delay in seconds since this m_fifoInfo event was collected
+	m_fifoDelay		= HiResTicksToSeconds( m_tscNow - m_fifoInfo.fifo_tsc );
+	if ( fFirstUpdate )
 	{
-		// Good timestamp from FIFO
-		m_fifoTimeStamp	= m_fifoInfo.fifo_time;
-		m_fidFifo		= PULSEID( m_fifoTimeStamp );
+		if( m_fifoDelayMin == 0 || m_fifoDelayMin > m_fifoDelay )
+			m_fifoDelayMin = m_fifoDelay;
+		if( m_fifoDelayMax < m_fifoDelay )
+			m_fifoDelayMax = m_fifoDelay;
+	}
+	m_diffVsExp		= m_fifoDelay - m_expDelay;
+	if ( DEBUG_TS_FIFO >= 7 )
+	{
+		t_HiResTime	tscNow	= GetHiResTicks();
+		double tscDelay	= HiResTicksToSeconds( tscNow - m_tscNow );
+		printf( "ApplyFifoInfo: EC=%d, incr=%u, fidFifo=%d, m_tscNow=%llu, fifoTsc=%zd, tscDelay=%0.3f\n",
+				m_eventCode, m_idxIncr, m_fidFifo, m_tscNow, m_fifoInfo.fifo_tsc, tscDelay*1000 );
+	}
+}
 
-		// Compute the delay in seconds since this m_fifoInfo event was collected
-		m_fifoDelay		= HiResTicksToSeconds( m_tscNow - m_fifoInfo.fifo_tsc );
-		if ( fFirstUpdate )
+
+/// StepBackFifoInfo:  Step back to the FIFO entry before m_idx
+/// When the driver supports bulk reads, earlier entries are read ahead
+/// into m_scanInfo, tracked by iBuf and nBuf, so each step back doesn't
+/// need its own driver call.  iBuf and nBuf must start at 0.
+/// Returns 0 on success, -1 if there are no earlier entries
+/// Must be called w/ m_TSLock mutex locked!
+int TSFifo::StepBackFifoInfo( unsigned int & iBuf, unsigned int & nBuf )
+{
+	if ( iBuf >= nBuf )
+	{
+		uint64_t	idx		= m_idx;
+		unsigned int	nMax	= 1;
+		if ( TSFifoHasBulkRead() )
+			nMax	= StepBackWindow( nBuf );
+		iBuf	= 0;
+		nBuf	= TSFifoReadRange(	m_eventCode, -1, &idx, m_scanInfo, m_scanIdx, nMax, m_pSim );
+		m_nFifoReads	+= nBuf;
+		if ( nBuf == 0 )
 		{
-			if( m_fifoDelayMin == 0 || m_fifoDelayMin > m_fifoDelay )
-				m_fifoDelayMin = m_fifoDelay;
-			if( m_fifoDelayMax < m_fifoDelay )
-				m_fifoDelayMax = m_fifoDelay;
+			m_fidFifo				 = PULSEID_INVALID;
+			m_fifoTimeStamp.nsec	|= PULSEID_INVALID;
+			if ( DEBUG_TS_FIFO >= 5 )
+				printf( "StepBackFifoInfo: no earlier fifo info for eventCode %d\n", m_eventCode );
+			return -1;
 		}
-		m_diffVsExp		= m_fifoDelay - m_expDelay;
-		if ( DEBUG_TS_FIFO >= 7 )
+	}
+
+	m_idx		= m_scanIdx[iBuf];
+	m_fifoInfo	= m_scanInfo[iBuf];
+	iBuf++;
+	ApplyFifoInfo( false );
+	return 0;
+}
+
+
+/// StepBackWindow:  Number of earlier entries to read ahead for StepBackFifoInfo
+/// We only need the entries between m_fifoInfo and the late edge of the
+/// step back window, 2 * m_expDelay late.  When we know the cadence of our
+/// event code from m_fidDiffLock, that's how many we read.  Otherwise we
+/// start w/ 2 and double on each refill, nBufPrior being the prior read.
+/// Must be called w/ m_TSLock mutex locked!
+unsigned int TSFifo::StepBackWindow( unsigned int nBufPrior ) const
+{
+	unsigned int	nMax	= ( nBufPrior == 0 ? 2 : 2 * nBufPrior );
+	if ( m_fidDiffLock != PULSEID_INVALID && m_fidDiffLock > 0 )
+	{
+		double	spacing	= m_fidDiffLock / 360.0;
+		double	span	= 3 * m_expDelay - m_fifoDelay;
+		nMax	= 1;
+		if ( span > 0 )
+			nMax	= static_cast<unsigned int>( span / spacing ) + 1;
+	}
+	if ( nMax > TSFIFO_SCAN_MAX )
+		nMax	= TSFIFO_SCAN_MAX;
+	return nMax;
+}
+
+
+/// StepBackScan:  Find the best earlier FIFO entry in one pass
+/// Copies up to nScanMax entries before m_idx, packs their
+/// fifo_tsc values and evaluates the sync window for all of them at once.
+/// On success, m_idx and m_fifoInfo are set to the selected entry.
+/// fExhausted is set if we ran out of earlier entries before reaching
+/// our expected delay.
+/// Returns 0 on success, -1 if no entry is in the window
+/// Must be called w/ m_TSLock mutex locked!
+int TSFifo::StepBackScan( unsigned int nScanMax, bool & fExhausted )
+{
+	unsigned int	nScan	= ReadScanInfo( -1, nScanMax, fExhausted );
+	if ( DEBUG_TS_FIFO >= 5 )
+		printf( "TSFifo::StepBackScan: EC=%d, scanned %u entries\n", m_eventCode, nScan );
+	return SelectScanInfo( nScan );
+}
+
+
+/// CatchUpFifoInfo:  Find the best newer FIFO entry
+/// Used when the next entry is late, as when a trigger was missed and
+/// our FIFO cursor is behind.
+/// On success, m_idx and m_fifoInfo are set to the selected entry.
+/// Returns 0 on success, -1 if no newer entry is in the window
+/// Must be called w/ m_TSLock mutex locked!
+int TSFifo::CatchUpFifoInfo( )
+{
+	bool			fExhausted;
+	unsigned int	nScan	= ReadScanInfo( 1, TSFIFO_SCAN_MAX, fExhausted );
+	if ( DEBUG_TS_FIFO >= 5 )
+		printf( "TSFifo::CatchUpFifoInfo: EC=%d, %u newer entries\n", m_eventCode, nScan );
+	return SelectScanInfo( nScan );
+}
+
+
+/// ReadScanInfo:  Read up to nScanMax entries after m_idx, stepping by incr,
+/// into m_scanInfo, m_scanIdx and m_scanTsc for SelectScanInfo
+/// A driver bulk reader gets the whole range in one call.  Otherwise each
+/// entry is its own driver read, so we stop at the first entry that's as
+/// close to our expected delay as any further one can be.  Stepping back,
+/// delays only get longer, and catching up, they only get shorter.
+/// Catching up also stops at entries newer than our frame.
+/// fExhausted is set if the FIFO ran out before that.
+/// Returns the number of entries read
+/// Must be called w/ m_TSLock mutex locked!
+unsigned int TSFifo::ReadScanInfo(
+	int				incr,
+	unsigned int	nScanMax,
+	bool		&	fExhausted	)
+{
+	if ( nScanMax > TSFIFO_SCAN_MAX )
+		nScanMax	= TSFIFO_SCAN_MAX;
+
+	uint64_t		idx		= m_idx;
+	unsigned int	nScan	= 0;
+	fExhausted	= false;
+	if ( TSFifoHasBulkRead() && m_pSim == NULL )
+	{
+		nScan		= TSFifoReadRange(	m_eventCode, incr, &idx,
+										m_scanInfo, m_scanIdx, nScanMax, m_pSim );
+		m_nFifoReads	+= nScan;
+		fExhausted	= ( nScan < nScanMax );
+		for ( unsigned int i = 0; i < nScan; i++ )
+			m_scanTsc[i]	= m_scanInfo[i].fifo_tsc;
+		return nScan;
+	}
+
+	fExhausted	= true;
+	while ( nScan < nScanMax )
+	{
+		if ( TSFifoRead( m_eventCode, incr, &idx, &m_scanInfo[nScan], m_pSim ) != 0 )
+			break;
+		m_nFifoReads++;
+		t_HiResTime		fifoTsc	= m_scanInfo[nScan].fifo_tsc;
+		if ( incr > 0 && fifoTsc > m_tscNow )
+		{
+			fExhausted	= false;
+			break;
+		}
+		m_scanIdx[nScan]	= idx;
+		m_scanTsc[nScan]	= fifoTsc;
+		nScan++;
+		double	fifoDelay	= HiResTicksToSeconds( m_tscNow - fifoTsc );
+		if ( incr < 0 ? fifoDelay >= m_expDelay : fifoDelay <= m_expDelay )
 		{
-			t_HiResTime	tscNow	= GetHiResTicks();
-			double tscDelay	= HiResTicksToSeconds( tscNow - m_tscNow );
-			printf( "UpdateFifoInfo: EC=%d, incr=%u, fidFifo=%d, m_tscNow=%llu, fifoTsc=%zd, tscDelay=%0.3f\n",
-					m_eventCode, m_idxIncr, m_fidFifo, m_tscNow, m_fifoInfo.fifo_tsc, tscDelay*1000 );
+			fExhausted	= false;
+			break;
 		}
 	}
-	return evrTimeStatus;
+	if ( nScan == nScanMax )
+		fExhausted	= false;
+	return nScan;
+}
+
+
+/// SelectScanInfo:  Select the best of the first nScan m_scanInfo entries
+/// On success, m_idx and m_fifoInfo are set to the selected entry.
+/// Returns 0 on success, -1 if no entry is in the window
+/// Must be called w/ m_TSLock mutex locked!
+int TSFifo::SelectScanInfo( unsigned int nScan )
+{
+	double		ticksPerSec	= 1.0 / HiResTicksToSeconds( 1LL );
+	int			iBest		= TSFifoScanWindow(	m_scanTsc, nScan, m_tscNow,
+												static_cast<epicsInt64>( 0.6 * m_expDelay * ticksPerSec ),
+												static_cast<epicsInt64>( 1.8 * m_expDelay * ticksPerSec ),
+												static_cast<epicsInt64>( m_expDelay * ticksPerSec ) );
+	if ( iBest < 0 )
+		return -1;
+
+	m_idx		= m_scanIdx[iBest];
+	m_fifoInfo	= m_scanInfo[iBest];
+	ApplyFifoInfo( false );
+	return 0;
+}
+
+
+/// UpdateSyncInfo:  Record the sync quality of the current frame
+/// Must be called w/ m_TSLock mutex locked!
+void TSFifo::UpdateSyncInfo(
+	SyncType		tySync,
+	epicsUInt32		pulseId,
+	double			diffVsExp	)
+{
+	double		ticksPerSec	= 1.0 / HiResTicksToSeconds( 1LL );
+	m_syncInfo.pulseId		= pulseId;
+	m_syncInfo.syncType		= static_cast<TSFifoSyncType>( tySync );
+	m_syncInfo.diffVsExp	= static_cast<epicsInt64>( diffVsExp * ticksPerSec );
+	m_syncInfo.nFifoReads	= m_nFifoReads;
+	m_syncInfo.generation	= m_genCount;
+
+	// Keep this frame's copy w/ the thread that stamped it
+	s_pThreadSyncPort	= this;
+	s_threadSyncInfo	= m_syncInfo;
+}
+
+void TSFifo::GetSyncInfo( SyncInfo & syncInfo ) const
+{
+	if ( s_pThreadSyncPort == this )
+	{
+		syncInfo	= s_threadSyncInfo;
+		return;
+	}
+	epicsMutexLock( m_TSLock );
+	syncInfo	= m_syncInfo;
+	epicsMutexUnlock( m_TSLock );
+}
+
+void TSFifo::SetRestampCallback(
+	TSFifoRestampCallback	pCallback,
+	void				*	pUserPvt	)
+{
+	if ( pCallback != NULL )
+		epicsThreadOnce( &s_restampOnce, RestampThreadStart, NULL );
+
+	epicsMutexLock( m_TSLock );
+	m_pRestampCallback	= pCallback;
+	m_pRestampPvt		= pUserPvt;
+	epicsMutexUnlock( m_TSLock );
+}
+
+
+void TSFifo::RestampThreadStart( void * )
+{
+	epicsThreadCreate(	"TSFifoRestamp", epicsThreadPriorityMedium,
+						epicsThreadGetStackSize( epicsThreadStackSmall ),
+						TSFifo::RestampThread, NULL );
+}
+
+
+/// RestampThread:  Sweeps all ports for queued frames to deliver
+/// Restamp callbacks are only called from this thread, so they never
+/// run on a driver thread in the middle of GetTimeStamp.
+/// Each port's resolved frames are copied out under the pool lock, so
+/// the port can't be destroyed meanwhile, and its callbacks are called
+/// after the lock is released, so they can't stall Create or Destroy.
+void TSFifo::RestampThread( void * )
+{
+	TSFifoRestamp			resolved[TSFIFO_RESTAMP_MAX];
+	epicsThreadOnce( &s_poolOnce, PoolLockInit, NULL );
+	while ( true )
+	{
+		epicsThreadSleep( TSFifoRestampPollPeriod );
+		for ( unsigned int iSlot = 0; ; iSlot++ )
+		{
+			TSFifoRestampCallback	pCallback	= NULL;
+			void				*	pUserPvt	= NULL;
+			unsigned int			nResolved	= 0;
+			epicsMutexLock( s_poolLock );
+			if ( iSlot >= ms_poolSize )
+			{
+				epicsMutexUnlock( s_poolLock );
+				break;
+			}
+			if ( ms_pPoolInUse[iSlot] )
+				nResolved	= ms_pPool[iSlot].ResolveRestamps( resolved, pCallback, pUserPvt );
+			epicsMutexUnlock( s_poolLock );
+
+			for ( unsigned int i = 0; i < nResolved && pCallback != NULL; i++ )
+				(*pCallback)( pUserPvt, resolved[i].token, &resolved[i].timeStamp );
+		}
+	}
+}
+
+
+/// QueueRestamp:  Queue the current frame for re-stamping
+/// Returns the restamp token, or 0 if the queue is full
+/// On success, timeStampRet is set to the frame's provisional timestamp
+/// Must be called w/ m_TSLock mutex locked!
+epicsUInt32 TSFifo::QueueRestamp( epicsTimeStamp & timeStampRet )
+{
+	if ( m_nRestamp >= TSFIFO_RESTAMP_MAX || m_expDelay <= 0 )
+		return 0;
+
+	if ( ++m_restampToken == 0 )
+		++m_restampToken;
+
+	TSFifoRestamp	&	restamp	= m_restamp[m_nRestamp++];
+	restamp.token		= m_restampToken;
+	restamp.eventCode	= m_eventCode;
+	restamp.tscFrame	= m_tscNow;
+	restamp.expDelay	= m_expDelay;
+	epicsTimeGetCurrent( &restamp.timeStamp );
+	restamp.timeStamp.nsec |= PULSEID_INVALID;
+	timeStampRet		= restamp.timeStamp;
+	return m_restampToken;
+}
+
+
+/// ResolveRestamps:  Look up queued frames in the pulse id index
+/// Called from the restamp thread w/ the pool lock held
+/// Copies the frames we're done with to pResolved, along w/ the callback
+/// to deliver them to, and returns how many.
+unsigned int TSFifo::ResolveRestamps(
+	TSFifoRestamp			*	pResolved,
+	TSFifoRestampCallback	&	pCallback,
+	void				*	&	pUserPvt	)
+{
+	unsigned int		nResolved	= 0;
+	t_HiResTime			tscNow		= GetHiResTicks();
+	double				ticksPerSec	= 1.0 / HiResTicksToSeconds( 1LL );
+
+	epicsMutexLock( m_TSLock );
+	pCallback	= m_pRestampCallback;
+	pUserPvt	= m_pRestampPvt;
+	for ( unsigned int i = 0; i < m_nRestamp; )
+	{
+		TSFifoRestamp	&	restamp	= m_restamp[i];
+		bool				fDone	= false;
+		TSFifoIndex		*	pIndex	= TSFifoIndex::FindByEventCode( restamp.eventCode );
+		if ( pIndex != NULL )
+		{
+			// Find the most recent event old enough to be in our sync window
+			t_HiResTime		tscEdge		= restamp.tscFrame
+										- static_cast<t_HiResTime>( 0.6 * restamp.expDelay * ticksPerSec );
+			t_HiResTime		tscEvent	= 0;
+			epicsTimeStamp	eventTimeStamp;
+			if ( pIndex->LookupByTsc( tscEdge, &eventTimeStamp, &tscEvent ) == 0 )
+			{
+				double	fifoDelay	= HiResTicksToSeconds( restamp.tscFrame - tscEvent );
+				if ( InSyncWindow( fifoDelay - restamp.expDelay, restamp.expDelay ) )
+				{
+					restamp.timeStamp	= eventTimeStamp;
+					fDone	= true;
+				}
+			}
+		}
+
+		// Give up on frames we can't match, keeping the provisional timestamp
+		if ( !fDone && HiResTicksToSeconds( tscNow - restamp.tscFrame ) > TSFifoRestampTimeout )
+			fDone	= true;
+
+		if ( fDone )
+		{
+			if ( DEBUG_TS_FIFO >= 5 )
+				printf( "TSFifo::ResolveRestamps: port %s, token %u, fid 0x%X\n",
+						m_portName, restamp.token, PULSEID(restamp.timeStamp) );
+			pResolved[nResolved++]	= restamp;
+			m_restamp[i]			= m_restamp[--m_nRestamp];
+		}
+		else
+			i++;
+	}
+	epicsMutexUnlock( m_TSLock );
+	return nResolved;
+}
+
+void TSFifo::SetTimingCriteria(
+	epicsUInt32		eventCode,
+	epicsUInt32		genCount,
+	double			delay		)
+{
+	epicsMutexLock( m_TSLock );
+	m_eventCode	= eventCode;
+	m_genCount	= genCount;
+	m_delay		= delay;
+	m_expDelay	= delay;
+	epicsMutexUnlock( m_TSLock );
+}
+
+void TSFifo::SetSim( const TSFifoSim * pSim )
+{
+	epicsMutexLock( m_TSLock );
+	m_pSim		= pSim;
+	m_synced	= false;
+	m_syncCount	= 0;
+	m_fidPrior	= PULSEID_INVALID;
+	m_idxIncr	= MAX_TS_QUEUE;
+	m_syncState	= TS_SEARCHING;
+	epicsMutexUnlock( m_TSLock );
+
+	// Engines are keyed by FIFO source, so move to one for the new source
+	UpdateEngine( );
+}
+
+void TSFifo::UpdateEngine( )
+{
+	TSFifoEngine	*	pEngine	= m_pEngine;
+	bool				fEngine	= ( TS_FIFO_ENGINE_DELAY_TOL > 0 && m_expDelay > 0 );
+	if ( pEngine != NULL && pEngine->Accepts( m_eventCode, m_expDelay, m_pSim ) )
+		return;
+	if ( pEngine == NULL && !fEngine )
+		return;
+
+	if ( fEngine )
+		pEngine	= TSFifoEngine::Subscribe( m_eventCode, m_expDelay, m_pSim );
+	else
+		pEngine	= NULL;
+
+	epicsMutexLock( m_TSLock );
+	TSFifoEngine	*	pEnginePrior	= m_pEngine;
+	m_pEngine	= pEngine;
+	epicsMutexUnlock( m_TSLock );
+	TSFifoEngine::Unsubscribe( pEnginePrior );
+
+	if ( DEBUG_TS_FIFO >= 2 )
+		printf( "TSFifo::UpdateEngine: port %s, %s\n", m_portName,
+				pEngine != NULL ? "shared engine" : "private matching" );
+}
+
+int TSFifo::SetSched(
+	const char	*	pCpuList,
+	int				priority	)
+{
+	if ( pCpuList == NULL )
+		pCpuList	= "";
+
+	// Parse here, so ApplySched never touches the file system
+	TSFifoSched	sched;
+	int	status	= TSFifoSchedParse( pCpuList, priority, &sched );
+	if ( status != 0 )
+		return status;
+
+	epicsMutexLock( m_schedLock );
+	strncpy( m_pPvt->cpuList, pCpuList, TSFIFO_CPU_LIST_MAX - 1 );
+	m_pPvt->cpuList[TSFIFO_CPU_LIST_MAX - 1]	= '\0';
+	m_pPvt->schedPriority	= priority;
+	m_pPvt->sched			= sched;
+	m_pPvt->schedGen++;
+	epicsMutexUnlock( m_schedLock );
+	return 0;
+}
+
+
+/// ApplySched:  Apply our CPU list and priority to the calling thread
+/// Only makes system calls the first time each thread calls us after
+/// SetSched, so it's cheap enough to check on every GetTimeStamp.
+/// Each thread keeps its own applied generation and saved scheduling,
+/// so threads taking turns on a port don't re-apply on every call.
+/// Ports that never had SetSched return before taking any lock, and
+/// core migrations are only tracked once scheduling is configured.
+void TSFifo::ApplySched( )
+{
+	TSFifoPvt	&	pvt			= *m_pPvt;
+
+	// Unlocked check.  A SetSched racing w/ this call is applied next time.
+	if ( *static_cast<volatile epicsUInt32 *>( &pvt.schedGen ) == 0 )
+		return;
+
+	epicsThreadId	threadSelf	= epicsThreadGetIdSelf( );
+	int				cpu			= TSFifoSchedGetCpu( );
+
+	epicsMutexLock( m_schedLock );
+	unsigned int	iThread	= 0;
+	while ( iThread < pvt.nSchedThreads && pvt.schedThreads[iThread].thread != threadSelf )
+		iThread++;
+	if ( iThread >= pvt.nSchedThreads )
+	{
+		if ( pvt.nSchedThreads < TSFIFO_SCHED_THREADS_MAX )
+			iThread	= pvt.nSchedThreads++;
+		else
+		{
+			iThread				= pvt.iSchedReplace;
+			pvt.iSchedReplace	= ( pvt.iSchedReplace + 1 ) % TSFIFO_SCHED_THREADS_MAX;
+		}
+		memset( &pvt.schedThreads[iThread], 0, sizeof(pvt.schedThreads[iThread]) );
+		pvt.schedThreads[iThread].thread	= threadSelf;
+		pvt.schedThreads[iThread].cpuLast	= -1;
+	}
+
+	TSFifoSchedThread	&	schedThread	= pvt.schedThreads[iThread];
+	if ( schedThread.genApplied != pvt.schedGen )
+	{
+		schedThread.genApplied	= pvt.schedGen;
+		schedThread.status		= TSFifoSchedApply( &pvt.sched, &schedThread.saved );
+		if ( schedThread.status != 0 || DEBUG_TS_FIFO >= 2 )
+			printf( "TSFifo::ApplySched: port %s, cpus %s, priority %d: %s\n",
+					m_portName, ( pvt.cpuList[0] != '\0' ? pvt.cpuList : "original" ),
+					pvt.schedPriority, ( schedThread.status == 0 ? "OK" : strerror( schedThread.status ) ) );
+		// We may have moved
+		cpu	= TSFifoSchedGetCpu( );
+	}
+
+	if ( cpu >= 0 )
+	{
+		if ( schedThread.cpuLast >= 0 && cpu != schedThread.cpuLast )
+			pvt.nMigrations++;
+		schedThread.cpuLast	= cpu;
+		pvt.cpuLast			= cpu;
+	}
+	epicsMutexUnlock( m_schedLock );
+}
+
+
+void TSFifo::GetPersistData( TSFifoPersistData & data ) const
+{
+	memset( &data, 0, sizeof(data) );
+	data.magic			= TSFIFO_PERSIST_MAGIC;
+	data.version		= TSFIFO_PERSIST_VERSION;
+	data.size			= sizeof(TSFifoPersistData);
+	data.secPerTick		= HiResTicksToSeconds( 1LL );
+
+	epicsMutexLock( m_TSLock );
+	data.eventCode		= m_eventCode;
+	data.generation		= m_genCount;
+	data.fidDiffLock	= m_fidDiffLock;
+	data.expDelay		= m_expDelay;
+	data.learnedDelay	= m_pPvt->autoDelay.GetLearnedDelay();
+	data.diffVsExpMin	= m_diffVsExpMin;
+	data.diffVsExpMax	= m_diffVsExpMax;
+	data.fifoDelayMin	= m_fifoDelayMin;
+	data.fifoDelayMax	= m_fifoDelayMax;
+	data.delayCount		= m_pPvt->delayStats.GetCount();
+	data.delayMean		= m_pPvt->delayStats.GetMean();
+	data.delayStdDev	= m_pPvt->delayStats.GetStdDev();
+	data.delayP50		= m_pPvt->delayStats.GetP50();
+	data.delayP95		= m_pPvt->delayStats.GetP95();
+	data.delayP99		= m_pPvt->delayStats.GetP99();
+	epicsMutexUnlock( m_TSLock );
+}
+
+void TSFifo::ApplyPersistPending( )
+{
+	if ( m_eventCode == 0 )
+		return;
+	m_persistPending	= false;
+	if ( m_pPvt->persist.eventCode != m_eventCode || m_pPvt->persist.generation != m_genCount )
+	{
+		if ( DEBUG_TS_FIFO )
+			printf( "TSFifo %s: Warm start is for EC %u gen %u, not EC %u gen %u, ignored\n",
+					m_portName, m_pPvt->persist.eventCode, m_pPvt->persist.generation, m_eventCode, m_genCount );
+		return;
+	}
+
+	epicsMutexLock( m_TSLock );
+	if ( m_pPvt->persist.fidDiffLock != PULSEID_INVALID )
+	{
+		m_fidDiffLock	= m_pPvt->persist.fidDiffLock;
+		m_fidDiffWarm	= true;
+	}
+	m_fifoDelayMin	= m_pPvt->persist.fifoDelayMin;
+	m_fifoDelayMax	= m_pPvt->persist.fifoDelayMax;
+	if ( fabs( m_pPvt->persist.expDelay - m_expDelay ) < TSFifoPersistDelayTol )
+	{
+		// Only meaningful vs the same expected delay
+		m_diffVsExpMin	= m_pPvt->persist.diffVsExpMin;
+		m_diffVsExpMax	= m_pPvt->persist.diffVsExpMax;
+	}
+	m_pPvt->autoDelay.Restore( m_pPvt->persist.learnedDelay );
+	if ( m_pPvt->delayStats.GetCount() == 0 )
+		m_pPvt->delayStats.Seed(	m_pPvt->persist.delayCount,	m_pPvt->persist.delayMean,
+									m_pPvt->persist.delayStdDev,	m_pPvt->persist.delayP50,
+									m_pPvt->persist.delayP95,	m_pPvt->persist.delayP99	);
+	m_persistApplied	= true;
+	epicsMutexUnlock( m_TSLock );
+
+	if ( DEBUG_TS_FIFO )
+		printf( "TSFifo %s: Applied warm start, fidDiffLock %d, learned delay %.3fms\n",
+				m_portName, m_pPvt->persist.fidDiffLock, m_pPvt->persist.learnedDelay * 1000 );
+}
+
+/// SavePersistAll:  Save the warm start file for each port w/ an event code
+/// Each port's state is copied under its own lock, and the file written
+/// w/o holding any lock, so slow file I/O never blocks GetTimeStamp,
+/// Create or Destroy.
+void TSFifo::SavePersistAll( )
+{
+	if ( ms_pPool == NULL )
+		return;
+	epicsThreadOnce( &s_poolOnce, PoolLockInit, NULL );
+	for ( unsigned int iSlot = 0; iSlot < ms_poolSize; iSlot++ )
+	{
+		TSFifo	*			pTSFifo	= &ms_pPool[iSlot];
+		char				portName[TSFIFO_PORT_NAME_MAX];
+		TSFifoPersistData	data;
+		epicsMutexLock( s_poolLock );
+		if ( !ms_pPoolInUse[iSlot] )
+		{
+			epicsMutexUnlock( s_poolLock );
+			continue;
+		}
+		strcpy( portName, pTSFifo->m_portName );
+		pTSFifo->GetPersistData( data );
+		epicsMutexUnlock( s_poolLock );
+		if ( data.eventCode == 0 )
+			continue;
+
+		int		status	= TSFifoPersistSave( portName, data );
+
+		// Record the result if the port wasn't destroyed meanwhile
+		epicsMutexLock( s_poolLock );
+		if (	ms_pPoolInUse[iSlot]
+			&&	strcmp( pTSFifo->m_portName, portName ) == 0 )
+		{
+			if ( status != 0 && status != pTSFifo->m_persistStatus )
+				printf( "TSFifo %s: Unable to save warm start file: %s\n",
+						portName, strerror( status ) );
+			pTSFifo->m_persistStatus	= status;
+			if ( status == 0 )
+				pTSFifo->m_nPersistSaves++;
+		}
+		epicsMutexUnlock( s_poolLock );
+	}
 }
 
 void TSFifo::ResetExpectedDelay()
@@ -539,15 +1684,74 @@ void TSFifo::ResetExpectedDelay()
 		printf( "expDelay=%.2fms, earliest=expDelay%.3fms, latest=expDelay+%.3fms\n",
 				m_expDelay * 1000, m_diffVsExpMin * 1000, m_diffVsExpMax * 1000 );
 	}
+	epicsMutexLock( m_TSLock );
 	m_diffVsExpMin	= 0.0;
 	m_diffVsExpMax	= 0.0;
 	m_fifoDelayMin	= 0.0;
 	m_fifoDelayMax	= 0.0;
+	m_pPvt->delayStats.Reset( );
+	epicsMutexUnlock( m_TSLock );
+}
+
+void TSFifo::SetAutoDelay(
+	int				mode,
+	double			period	)
+{
+	epicsMutexLock( m_TSLock );
+	m_pPvt->autoDelay.Configure( static_cast<TSFifoAutoDelay::Mode>( mode ), period );
+	epicsMutexUnlock( m_TSLock );
+}
+
+int TSFifo::GetAutoDelayStatus( ) const
+{
+	return m_pPvt->autoDelay.GetStatus();
+}
+
+double TSFifo::GetAutoDelayLearned( ) const
+{
+	return m_pPvt->autoDelay.GetLearnedDelay();
+}
+
+/// SampleAutoDelay:  Read the FIFO for an auto-tuning sample of the frame at tscNow
+/// Called w/o m_TSLock, which is only taken to add the sample
+void TSFifo::SampleAutoDelay( t_HiResTime tscNow )
+{
+	EventTimingData		scanInfo[TSFIFO_AUTO_DELAY_SCAN_MAX];
+
+	epicsMutexLock( m_TSLock );
+	epicsUInt32			eventCode	= m_eventCode;
+	double				expDelay	= m_expDelay;
+	const TSFifoSim	*	pSim		= m_pSim;
+	epicsMutexUnlock( m_TSLock );
+
+	unsigned int	nScan	= TSFifoAutoDelay::ReadSample( eventCode, scanInfo, pSim );
+	if ( nScan == 0 )
+		return;
+
+	epicsMutexLock( m_TSLock );
+	if ( eventCode == m_eventCode )
+		m_pPvt->autoDelay.AddSample( tscNow, expDelay, scanInfo, nScan );
+	epicsMutexUnlock( m_TSLock );
+}
+
+bool TSFifo::PollAutoDelay( double & delay )
+{
+	epicsMutexLock( m_TSLock );
+	bool	fLearned	= m_pPvt->autoDelay.Poll( delay );
+	epicsMutexUnlock( m_TSLock );
+	return fLearned;
+}
+
+void TSFifo::GetDelayStats( TSFifoStats & stats ) const
+{
+	epicsMutexLock( m_TSLock );
+	stats	= m_pPvt->delayStats;
+	epicsMutexUnlock( m_TSLock );
 }
 
 epicsUInt32	TSFifo::Show( int level ) const
 {
-	printf( "TSFifo for port %s\n",	m_portName.c_str() );
+	printf( "TSFifo for port %s\n",	m_portName );
 	printf( "\tEventCode:\t%d\n",	m_eventCode );
 	printf( "\tGeneration:\t%d\n",	m_genCount );
 	printf( "\tExpDelay:\t%.2fms,\tearliest=%.3fms,\tlatest=%.3fms\n",
@@ -557,14 +1761,75 @@ epicsUInt32	TSFifo::Show( int level ) const
 									:	(	m_TSPolicy == TS_TOD
 										?	"TOD" : "SYNCED" ) ) );
 	printf( "\tSync Status:\t%s\n",	m_synced ? "Synced" : "Unsynced" );
+	printf( "\tSync State:\t%s\n",	SyncStateToStr( m_syncState ) );
+	if ( level >= 1 )
+	{
+		printf( "\tfidDiffLock:\t%d\n",	m_fidDiffLock );
+		printf( "\tHoldover:\t%d of %d, after %d synced\n",	m_holdoverCount, TS_FIFO_HOLDOVER_MAX,
+				TS_FIFO_SYNC_COUNT_MIN );
+		printf( "\tRelock:\t\t%d of %d\n",	m_relockCount, TS_FIFO_HOLDOVER_MAX );
+		printf( "\tScan Depth:\t%d, %s\n",	TS_FIFO_SCAN_DEPTH,
+				TSFifoScanIsVectorized() ? "AVX2" : "scalar" );
+		printf( "\tRestamps:\t%u pending, %s\n",	m_nRestamp,
+				m_pRestampCallback != NULL ? "enabled" : "disabled" );
+		epicsMutexLock( m_schedLock );
+		if ( m_pPvt->schedGen != 0 )
+		{
+			unsigned int	nApplied	= 0;
+			int				status		= 0;
+			for ( unsigned int iThread = 0; iThread < m_pPvt->nSchedThreads; iThread++ )
+			{
+				if ( m_pPvt->schedThreads[iThread].genApplied != m_pPvt->schedGen )
+					continue;
+				nApplied++;
+				if ( m_pPvt->schedThreads[iThread].status != 0 )
+					status	= m_pPvt->schedThreads[iThread].status;
+			}
+			printf( "\tSched:\t\tcpus %s, priority %d%s, %u thread(s) %s\n",
+					( m_pPvt->cpuList[0] != '\0' ? m_pPvt->cpuList : "original" ), m_pPvt->schedPriority,
+					( m_pPvt->schedPriority > 0 ? " SCHED_FIFO" : "" ), nApplied,
+					( nApplied == 0 ? "pending" : ( status == 0 ? "applied" : strerror( status ) ) ) );
+			printf( "\tCPU:\t\t%d, %u migrations, %u thread(s)\n",	m_pPvt->cpuLast, m_pPvt->nMigrations, m_pPvt->nSchedThreads );
+		}
+		else
+			printf( "\tSched:\t\tdefault\n" );
+		epicsMutexUnlock( m_schedLock );
+		printf( "\tContention:\t%u contended, %u reused, trylock %s\n",
+				m_nContended, m_nReused, TS_FIFO_TRYLOCK ? "on" : "off" );
+		printf( "\tLast Frame:\t%s, fid 0x%X, diffVsExp %.3fms, %u FIFO reads\n",
+				SyncTypeToStr( static_cast<SyncType>( m_syncInfo.syncType ) ), m_syncInfo.pulseId,
+				HiResTicksToSeconds( 1LL ) * m_syncInfo.diffVsExp * 1000, m_syncInfo.nFifoReads );
+		m_pPvt->autoDelay.Show( level );
+		printf( "\tWarm Start:\t%s, %u saves%s%s\n",
+				( m_persistApplied ? "applied" : ( m_persistPending ? "pending" : "none" ) ),
+				m_nPersistSaves, ( m_persistStatus != 0 ? ", last failed: " : "" ),
+				( m_persistStatus != 0 ? strerror( m_persistStatus ) : "" ) );
+		printf( "\tDelay Stats:\t%u frames, mean %.3fms, stddev %.3fms, drift %.4fms/min\n",
+				m_pPvt->delayStats.GetCount(), m_pPvt->delayStats.GetMean() * 1000,
+				m_pPvt->delayStats.GetStdDev() * 1000, m_pPvt->delayStats.GetDrift() * 1000 * 60 );
+		printf( "\t\t\tp50 %.3fms, p95 %.3fms, p99 %.3fms\n",
+				m_pPvt->delayStats.GetP50() * 1000, m_pPvt->delayStats.GetP95() * 1000,
+				m_pPvt->delayStats.GetP99() * 1000 );
+		if ( m_pEngine != NULL )
+			printf( "\tEngine:\t\tEC %u, expDelay %.2fms, %u ports\n",
+					m_pEngine->GetEventCode(), m_pEngine->GetExpDelay() * 1000,
+					m_pEngine->GetSubscriberCount() );
+		else
+			printf( "\tEngine:\t\tprivate\n" );
+	}
 	return 0;
 }
 
 void TSFifo::ListPorts()
 {
-	map<string, TSFifo *>::iterator   it;
-	for ( it = ms_TSFifoMap.begin(); it != ms_TSFifoMap.end(); it++ )
-		printf( "%s ", it->first.c_str() );
+	epicsThreadOnce( &s_poolOnce, PoolLockInit, NULL );
+	epicsMutexLock( s_poolLock );
+	for ( unsigned int iSlot = 0; iSlot < ms_poolSize; iSlot++ )
+	{
+		if ( ms_pPoolInUse[iSlot] )
+			printf( "%s ", ms_pPool[iSlot].m_portName );
+	}
+	epicsMutexUnlock( s_poolLock );
 	printf( "\n" );
 }
 
@@ -595,6 +1860,9 @@ extern "C" long TSFifo_Init(	aSubRecord	*	pSub	)
 //		F:	TimeStamp FreeRun mode
 // TODO: Add support for 2 event codes, Beam and Camera
 //		G:	Camera trigger Event code for synchronization
+//		H:	ExpectedDelay auto-tuning mode: 0 = Off, 1 = Learn, 2 = Track
+//		I:	ExpectedDelay auto-tuning learning period, sec
+//		J:	ExpectedDelay auto-tuning target PV name, a stringout record
 //
 //	Outputs
 //		A:	TSFifo Sync Status: 0 = unlocked, 1 = locked
@@ -603,6 +1871,15 @@ extern "C" long TSFifo_Init(	aSubRecord	*	pSub	)
 //		D:	DiffVsExpMax, ms
 //		E:	ActualDelayMin, ms
 //		F:	ActualDelayMax, ms
+//		G:	ActualDelayMean, ms
+//		H:	ActualDelayStdDev, ms
+//		I:	ActualDelayP50, ms
+//		J:	ActualDelayP95, ms
+//		K:	ActualDelayP99, ms
+//		L:	ActualDelayDrift, ms per min
+//		M:	ActualDelayCount, synced frames in the statistics
+//		N:	AutoDelayLearned, sec
+//		O:	AutoDelayStatus: 0 = Off, 1 = Learning, 2 = Done, 3 = Tracking, 4 = Failed
 //
 extern "C" long TSFifo_Process( aSubRecord	*	pSub	)
 {
@@ -643,25 +1920,34 @@ extern "C" long TSFifo_Process( aSubRecord	*	pSub	)
 		if ( DEBUG_TS_FIFO )
 			printf( "%s: Attempting to register port name %s\n", pSub->name, pPortName );
 
+		bool	fCreated	= false;
 		pTSFifo		= TSFifo::FindByPortName( pPortName );
 		if ( pTSFifo == NULL )
 		{
 			if ( DEBUG_TS_FIFO )
 				printf( "%s: Creating new TSFifo for port name %s\n", pSub->name, pPortName );
-			pTSFifo = new TSFifo( pPortName, pSub );
+			pTSFifo = TSFifo::Create( pPortName, pSub );
+			if ( pTSFifo == NULL )
+			{
+				printf( "Error %s: Unable to create TSFifo for port %s\n", pSub->name, pPortName );
+				return -1;
+			}
+			fCreated	= true;
 		}
 		if ( pTSFifo->m_pSubRecord != pSub )
 		{
+			// Not ours to destroy, it belongs to the other record
 			printf( "Error %s: Unable to register as TSFifo port %s already registered to %s\n",
-					pSub->name, pPortName, pTSFifo->m_pSubRecord->name );
-			delete pTSFifo;
+					pSub->name, pPortName,
+					pTSFifo->m_pSubRecord != NULL ? pTSFifo->m_pSubRecord->name : "another client" );
 			return -1;
 		}
 		if ( pTSFifo->RegisterTimeStampSource() != asynSuccess )
 		{
 			printf( "Error %s: Unable to register timeStampSource for port %s\n",
 					pSub->name, pPortName );
-			delete pTSFifo;
+			if ( fCreated )
+				TSFifo::Destroy( pTSFifo );
 			return -1;
 		}
 		printf( "%s: Successfully registered timeStampSource for port %s\n",
@@ -728,6 +2014,47 @@ extern "C" long TSFifo_Process( aSubRecord	*	pSub	)
 	if ( fTimeStampCriteriaChanged )
 		pTSFifo->ResetExpectedDelay();
 
+	// Restore any warm start state saved for this event code and generation
+	pTSFifo->ApplyPersist();
+
+	// Share FIFO matching w/ other ports on the same event code and delay
+	pTSFifo->UpdateEngine();
+
+	// ExpectedDelay auto-tuning
+	pIntVal	= static_cast<epicsInt32 *>( pSub->h );
+	if ( pIntVal != NULL )
+	{
+		pDblVal	= static_cast<double *>( pSub->i );
+		pTSFifo->SetAutoDelay(	*pIntVal,
+								( pDblVal != NULL ? *pDblVal : 0.0 ) );
+	}
+	double	learnedDelay	= 0.0;
+	if (	pTSFifo->PollAutoDelay( learnedDelay )
+		&&	fabs( learnedDelay - pTSFifo->m_expDelay ) >= TSFifoAutoDelayMinChange )
+	{
+		// Write it to the ExpectedDelay PV, which updates our input D
+		char	*	pTargetName	= static_cast<char *>( pSub->j );
+		DBADDR		targetAddr;
+		if (	pTargetName == NULL || strlen(pTargetName) == 0
+			||	dbNameToAddr( pTargetName, &targetAddr ) != 0 )
+			printf( "Error %s: Unable to find AutoDelay target PV %s\n",
+					pSub->name, ( pTargetName != NULL ? pTargetName : "(null)" ) );
+		else
+		{
+			if ( DEBUG_TS_FIFO )
+				printf( "%s: AutoDelay updating %s from %.3fms to %.3fms\n", pSub->name,
+						pTargetName, pTSFifo->m_expDelay * 1000, learnedDelay * 1000 );
+			if ( dbPutField( &targetAddr, DBR_DOUBLE, &learnedDelay, 1 ) != 0 )
+				printf( "Error %s: Unable to write AutoDelay target PV %s\n", pSub->name, pTargetName );
+		}
+	}
+
+	// Re-stamping late frames needs a pulse id index for our event code
+	if (	pTSFifo->HasRestampCallback()
+		&&	pTSFifo->m_eventCode != 0
+		&&	TSFifoIndex::FindByEventCode( pTSFifo->m_eventCode ) == NULL )
+		TSFifoIndexConfig( pTSFifo->m_eventCode, TSFifoRestampIndexDepth );
+
 	// Update outputs
 	pIntVal	= static_cast<epicsInt32 *>( pSub->vala );
 	if ( pIntVal != NULL )
@@ -753,10 +2080,109 @@ extern "C" long TSFifo_Process( aSubRecord	*	pSub	)
 	if ( pDblVal != NULL )
 		*pDblVal	= pTSFifo->m_fifoDelayMax;
 
+	// Delay statistics since the last criteria change
+	TSFifoStats		delayStats;
+	pTSFifo->GetDelayStats( delayStats );
+
+	pDblVal	= static_cast<double *>( pSub->valg );
+	if ( pDblVal != NULL )
+		*pDblVal	= delayStats.GetMean() * 1000;
+
+	pDblVal	= static_cast<double *>( pSub->valh );
+	if ( pDblVal != NULL )
+		*pDblVal	= delayStats.GetStdDev() * 1000;
+
+	pDblVal	= static_cast<double *>( pSub->vali );
+	if ( pDblVal != NULL )
+		*pDblVal	= delayStats.GetP50() * 1000;
+
+	pDblVal	= static_cast<double *>( pSub->valj );
+	if ( pDblVal != NULL )
+		*pDblVal	= delayStats.GetP95() * 1000;
+
+	pDblVal	= static_cast<double *>( pSub->valk );
+	if ( pDblVal != NULL )
+		*pDblVal	= delayStats.GetP99() * 1000;
+
+	pDblVal	= static_cast<double *>( pSub->vall );
+	if ( pDblVal != NULL )
+		*pDblVal	= delayStats.GetDrift() * 1000 * 60;
+
+	pIntVal	= static_cast<epicsInt32 *>( pSub->valm );
+	if ( pIntVal != NULL )
+		*pIntVal	= delayStats.GetCount();
+
+	pDblVal	= static_cast<double *>( pSub->valn );
+	if ( pDblVal != NULL )
+		*pDblVal	= pTSFifo->GetAutoDelayLearned();
+
+	pIntVal	= static_cast<epicsInt32 *>( pSub->valo );
+	if ( pIntVal != NULL )
+		*pIntVal	= pTSFifo->GetAutoDelayStatus();
+
 	return status;
 }
 
 
+extern "C" int TSFifoPoolInit( unsigned int nPorts )
+{
+	return TSFifo::PoolInit( nPorts );
+}
+
+extern "C" int TSFifoSetRestampCallback(
+	const char				*	pPortName,
+	TSFifoRestampCallback		pCallback,
+	void					*	pUserPvt	)
+{
+	if ( pPortName == NULL )
+		return -1;
+	TSFifo		*   pTSFifo	= TSFifo::FindByPortName( pPortName );
+	if ( pTSFifo == NULL )
+		return -1;
+	pTSFifo->SetRestampCallback( pCallback, pUserPvt );
+	return 0;
+}
+
+extern "C" int TSFifoGetTimeStampDeferred(
+	const char				*	pPortName,
+	epicsTimeStamp			*	pTimeStampRet,
+	epicsUInt32				*	pRestampToken	)
+{
+	if ( pPortName == NULL )
+		return -1;
+	TSFifo		*   pTSFifo	= TSFifo::FindByPortName( pPortName );
+	if ( pTSFifo == NULL )
+		return -1;
+	return pTSFifo->GetTimeStamp( pTimeStampRet, pRestampToken );
+}
+
+extern "C" int TSFifoGetSyncInfo(
+	const char				*	pPortName,
+	TSFifoSyncInfo			*	pSyncInfo	)
+{
+	if ( pPortName == NULL || pSyncInfo == NULL )
+		return -1;
+	TSFifo		*   pTSFifo	= TSFifo::FindByPortName( pPortName );
+	if ( pTSFifo == NULL )
+		return -1;
+	pTSFifo->GetSyncInfo( *pSyncInfo );
+	return 0;
+}
+
+extern "C" int TSFifoGetTimeStampEx(
+	const char				*	pPortName,
+	epicsTimeStamp			*	pTimeStampRet,
+	TSFifoSyncInfo			*	pSyncInfo	)
+{
+	if ( pPortName == NULL )
+		return -1;
+	TSFifo		*   pTSFifo	= TSFifo::FindByPortName( pPortName );
+	if ( pTSFifo == NULL )
+		return -1;
+	return pTSFifo->GetTimeStampEx( pTimeStampRet, pSyncInfo );
+}
+
+
 // Register aSub functions
 extern "C"
 {
@@ -764,6 +2190,10 @@ epicsRegisterFunction(	TSFifo_Init		);
 epicsRegisterFunction(	TSFifo_Process	);
 epicsRegisterFunction(	TimeStampFifo	);
 epicsExportAddress( int, DEBUG_TS_FIFO	);
+epicsExportAddress( int, TS_FIFO_HOLDOVER_MAX	);
+epicsExportAddress( int, TS_FIFO_SYNC_COUNT_MIN	);
+epicsExportAddress( int, TS_FIFO_SCAN_DEPTH		);
+epicsExportAddress( int, TS_FIFO_TRYLOCK		);
 }
 
 // Register shell callable functions with iocsh
@@ -791,9 +2221,26 @@ static void		ShowTSFifo_CallFunc( const iocshArgBuf * args )
 		TSFifo::ListPorts();
 	}
 }
+
+//	Register TSFifoPoolInit
+static const	iocshArg		TSFifoPoolInit_Arg0		= { "nPorts",	iocshArgInt };
+static const	iocshArg	*	TSFifoPoolInit_Args[1]	= { &TSFifoPoolInit_Arg0 };
+static const	iocshFuncDef	TSFifoPoolInit_FuncDef	= { "TSFifoPoolInit", 1, TSFifoPoolInit_Args };
+static void		TSFifoPoolInit_CallFunc( const iocshArgBuf * args )
+{
+	if ( args[0].ival <= 0 )
+	{
+		printf( "Usage: TSFifoPoolInit nPorts\n" );
+		printf( "Default is %d ports\n", TSFIFO_POOL_DEFAULT );
+		return;
+	}
+	TSFifoPoolInit( args[0].ival );
+}
+
 static void ShowTSFifo_Register( void )
 {
 	iocshRegister( &ShowTSFifo_FuncDef, ShowTSFifo_CallFunc );
+	iocshRegister( &TSFifoPoolInit_FuncDef, TSFifoPoolInit_CallFunc );
 }
 epicsExportRegistrar( ShowTSFifo_Register );
 
@@ -1,7 +1,7 @@
 #ifndef TSFIFO_H
 #define TSFIFO_H
 
-#include <map>
+#include "epicsMutex.h"
 #include "evrTime.h"
 #include "HiResTime.h"
 #include "timingFifoApi.h"
@@ -18,9 +18,90 @@
 #define TSFifo_STS_OK                 0
 #define TSFifo_STS_INVALID_DATA       1
 
+extern	int		DEBUG_TS_FIFO;
+extern	int		TS_FIFO_HOLDOVER_MAX;
+extern	int		TS_FIFO_SYNC_COUNT_MIN;
+extern	int		TS_FIFO_SCAN_DEPTH;
+extern	int		TS_FIFO_TRYLOCK;
+
 extern "C" const char	*	TSFifo_StatusToString( epicsUInt32	status	);
 
+/// TimeStampFifo
+/// asyn timeStampSource callback, userPvt is the TSFifo
+extern "C" void			TimeStampFifo(	void			*	userPvt,
+										epicsTimeStamp	*	pTimeStamp	);
+
+///
+/// Deferred re-stamping of late frames
+/// When GetTimeStamp can't match a frame because it arrived before its
+/// FIFO entry was written, or because its entry aged out of the FIFO
+/// before we could step back to it, it returns the usual provisional
+/// timestamp w/ PULSEID_INVALID along with a non-zero token, even when
+/// the TS_SYNCED policy makes it return -1.
+/// Once the pulse id index for the event code confirms a match,
+/// the registered callback is called w/ that token and the corrected
+/// timestamp.  If no match can be confirmed, the callback is still
+/// called, w/ the provisional timestamp, so callers can let go.
+/// Callbacks are called from the TSFifoRestamp thread.
+///
+typedef void (*TSFifoRestampCallback)(	void				*	pUserPvt,
+										epicsUInt32				token,
+										const epicsTimeStamp *	pTimeStamp	);
+
+extern "C" int	TSFifoSetRestampCallback(	const char				*	pPortName,
+											TSFifoRestampCallback		pCallback,
+											void					*	pUserPvt	);
+extern "C" int	TSFifoGetTimeStampDeferred(	const char				*	pPortName,
+											epicsTimeStamp			*	pTimeStampRet,
+											epicsUInt32				*	pRestampToken	);
+
+/// Max number of earlier FIFO entries checked per StepBackScan
+#define	TSFIFO_SCAN_MAX			64
+
+/// Max number of frames awaiting re-stamping per TSFifo
+#define	TSFIFO_RESTAMP_MAX		16
+
+/// Max port name length, including the terminating null
+#define	TSFIFO_PORT_NAME_MAX	64
+
+/// Number of TSFifo ports in the pool if TSFifoPoolInit isn't called before iocInit
+#define	TSFIFO_POOL_DEFAULT		32
+
+/// TSFifoPoolInit
+/// Allocate the pool of TSFifo ports.  Call from st.cmd before iocInit.
+/// Returns 0 on success, -1 if the pool already exists or can't be allocated
+extern "C" int	TSFifoPoolInit(	unsigned int	nPorts	);
+
+///
+/// Per frame sync quality, so callers can filter questionable frames
+/// How GetTimeStamp got a frame's timestamp:
+///   TSFIFO_SYNC_FIFO_NEXT	- The next FIFO entry was in the sync window
+///   TSFIFO_SYNC_FIFO_DLY	- An earlier FIFO entry was in the sync window
+///   TSFIFO_SYNC_FID_DIFF	- Brief miss, holdover on the last matched fidDiff
+///   TSFIFO_SYNC_TOO_LATE	- Unsynced, queued for re-stamping
+///   TSFIFO_SYNC_FAILED	- Unsynced
+///   TSFIFO_SYNC_LAST_EC	- TS_LAST_EC policy, most recent timestamp for the event code
+///   TSFIFO_SYNC_TOD		- TS_TOD policy, current system time
+///
+typedef enum	{	TSFIFO_SYNC_FIFO_NEXT = 0, TSFIFO_SYNC_FIFO_DLY = 1, TSFIFO_SYNC_FID_DIFF = 2,
+					TSFIFO_SYNC_TOO_LATE = 3, TSFIFO_SYNC_FAILED = 4, TSFIFO_SYNC_LAST_EC = 5,
+					TSFIFO_SYNC_TOD = 6 }	TSFifoSyncType;
+
+typedef struct	TSFifoSyncInfo
+{
+	epicsUInt32		pulseId;		/// Pulse id of the timestamp, PULSEID_INVALID if none
+	TSFifoSyncType	syncType;
+	epicsInt64		diffVsExp;		/// Actual minus expected delay in TSC ticks
+	epicsUInt32		nFifoReads;		/// FIFO entries read for this frame
+	epicsUInt32		generation;		/// Timing generation count
+}	TSFifoSyncInfo;
+
 class   TSFifo;
+class   TSFifoEngine;
+class   TSFifoSim;
+class	TSFifoStats;
+struct	TSFifoPersistData;
+struct	TSFifoPvt;
 struct	aSubRecord;
 
 ///
@@ -43,20 +124,68 @@ public:
 	///				  fiducial pulse id.
 	enum TSPolicy	{ TS_LAST_EC = 0, TS_SYNCED = 1, TS_TOD = 2 };
 
-    /// Constructor
-    TSFifo(	const char			*	pPortName,
-			struct	aSubRecord	*	pSubRecord,
-			TSPolicy				tsPolicy = TS_LAST_EC );
+	/// Sync state machine for the TS_SYNCED policy
+	///   TS_LOCKED    - Last frame matched a FIFO entry within the expected delay window
+	///   TS_HOLDOVER  - Brief miss, coasting on the last known fidDiff between matches
+	///   TS_SEARCHING - Sync lost, restarting from the most recent FIFO entry
+	///   TS_RELOCKING - Generation changed, resuming from the prior FIFO cursor
+	enum TSSyncState	{ TS_LOCKED = 0, TS_HOLDOVER = 1, TS_SEARCHING = 2, TS_RELOCKING = 3 };
 
-    /// Destructor
-    virtual ~TSFifo( );
+	/// How GetTimeStamp got a frame's timestamp, see TSFifoSyncType
+	enum SyncType	{	FIFO_NEXT = TSFIFO_SYNC_FIFO_NEXT, FIFO_DLY = TSFIFO_SYNC_FIFO_DLY,
+						FID_DIFF = TSFIFO_SYNC_FID_DIFF, TOO_LATE = TSFIFO_SYNC_TOO_LATE,
+						FAILED = TSFIFO_SYNC_FAILED, LAST_EC = TSFIFO_SYNC_LAST_EC,
+						TOD = TSFIFO_SYNC_TOD };
+
+	typedef	TSFifoSyncInfo	SyncInfo;
+
+	/// Create()
+	/// Construct a TSFifo in a free slot of the TSFifo pool
+	/// Returns NULL if the pool is full or can't be allocated, or the port name
+	/// is invalid or in use
+	static	TSFifo	*	Create(	const char			*	pPortName,
+								struct	aSubRecord	*	pSubRecord,
+								TSPolicy				tsPolicy = TS_LAST_EC );
+
+	/// Destroy()
+	/// Destruct a TSFifo and return its slot to the pool
+	static	void		Destroy( TSFifo * pTSFifo );
 
 	/// GetTimeStamp
 	/// Synchronize w/ the timestamp FIFO and return the timestamp
 	/// Returns: 0 on success
 	/// On error, returns -1 and sets pTimeStampRet to the current system
 	/// clock timestamp w/ the fiducial pulsid set to invalid
-	int	GetTimeStamp(	epicsTimeStamp		*	pTimeStampRet );
+	/// If pRestampToken is provided and a restamp callback is registered,
+	/// frames that were too late for the FIFO are queued for re-stamping
+	/// and *pRestampToken is set to a non-zero token, otherwise it is set to 0.
+	int	GetTimeStamp(	epicsTimeStamp		*	pTimeStampRet,
+						epicsUInt32			*	pRestampToken = NULL )
+	{
+		return GetTimeStampEx( pTimeStampRet, NULL, pRestampToken );
+	}
+
+	/// GetTimeStampEx
+	/// Same as GetTimeStamp, and if pSyncInfo is provided, fills it in
+	/// w/ the sync quality of this frame
+	int	GetTimeStampEx(	epicsTimeStamp		*	pTimeStampRet,
+						SyncInfo			*	pSyncInfo,
+						epicsUInt32			*	pRestampToken = NULL );
+
+	/// GetSyncInfo
+	/// Copy the sync quality of the last frame the calling thread timestamped
+	/// on this port, or of the port's last frame if this thread hasn't
+	void	GetSyncInfo( SyncInfo & syncInfo ) const;
+
+	/// SetRestampCallback
+	/// Register the callback used to deliver corrected late frame timestamps
+	void	SetRestampCallback(	TSFifoRestampCallback	pCallback,
+								void				*	pUserPvt	);
+
+	bool	HasRestampCallback( ) const
+	{
+		return m_pRestampCallback != NULL;
+	}
 
 	/// Return the current TimeStamp policy
 	TSPolicy	GetTimeStampPolicy( ) const
@@ -70,8 +199,71 @@ public:
 		m_TSPolicy = tsPolicy;
 	}
 
+	/// Return the current sync state
+	TSSyncState	GetSyncState( ) const
+	{
+		return m_syncState;
+	}
+
+	/// SetTimingCriteria()
+	/// Set the event code, generation count and expected delay in sec
+	/// together, as the aSub record does, w/ m_TSLock held
+	void	SetTimingCriteria(	epicsUInt32		eventCode,
+								epicsUInt32		genCount,
+								double			delay		);
+
+	/// SetSim()
+	/// Read FIFO entries from pSim instead of the timing driver, or from
+	/// the timing driver again if NULL.  pSim must outlive its use here.
+	void	SetSim( const TSFifoSim * pSim );
+
+	/// SetSched()
+	/// Set the CPU list and SCHED_FIFO priority for threads calling GetTimeStamp
+	/// Returns 0 on success, otherwise an errno value.  See tsFifoSched.h
+	int		SetSched(	const char	*	pCpuList,
+						int				priority	);
+
+	/// UpdateEngine()
+	/// Subscribe to the shared sync engine for our event code and expected
+	/// delay, or drop our engine if they no longer fit it
+	void	UpdateEngine( );
+
+	/// SetAutoDelay()
+	/// Set the ExpectedDelay auto-tuning mode, a TSFifoAutoDelay::Mode,
+	/// and learning period in sec
+	void	SetAutoDelay(	int				mode,
+							double			period	);
+
+	/// PollAutoDelay()
+	/// Returns true and sets delay when there's a new learned expected delay
+	bool	PollAutoDelay(	double	&	delay	);
+
+	/// Return the auto-tuning status, a TSFifoAutoDelay::Status
+	int		GetAutoDelayStatus( ) const;
+
+	double	GetAutoDelayLearned( ) const;
+
+	/// GetDelayStats()
+	/// Copy the actual delay statistics for synced frames, in sec
+	void	GetDelayStats( TSFifoStats & stats ) const;
+
+	/// GetPersistData()
+	/// Copy our learned sync state for a warm start file
+	void	GetPersistData( TSFifoPersistData & data ) const;
+
+	/// ApplyPersist()
+	/// If a warm start file was loaded for this port and its event code
+	/// and generation match ours, restore its learned sync state and seed
+	/// the delay statistics.  Either way the file is only considered once,
+	/// so after that this is just a flag check.
+	void	ApplyPersist( )
+	{
+		if ( m_persistPending )
+			ApplyPersistPending( );
+	}
+
 	/// ResetExpectedDelay()
-	/// Resets Expected delay values for diagnostic tracking
+	/// Resets Expected delay values and statistics for diagnostic tracking
 	/// Auto-Resets on changes to timeStamp criteria
 	void	ResetExpectedDelay();
 
@@ -80,23 +272,108 @@ public:
 	epicsUInt32	Show( int level ) const;
 
 	/// RegisterTimeStampSource()
-	asynStatus RegisterTimeStampSource( );
+	/// Returns asynSuccess, or the asynStatus of the failed asyn call
+	int		RegisterTimeStampSource( );
 
 	const char *	GetPortName( ) const
 	{
-		return m_portName.c_str();
+		return m_portName;
+	}
+
+	/// Shared sync engine, or NULL for private matching
+	const TSFifoEngine *	GetEngine( ) const
+	{
+		return m_pEngine;
 	}
 public:		//  Public class functions
-	static	TSFifo	*	FindByPortName( const std::string & portName );
+	static	TSFifo	*	FindByPortName( const char * pPortName );
 	
 	static	void		ListPorts( );
 
+	/// PoolInit()
+	/// Allocate room for nPorts TSFifo's.  Only allowed once.
+	static	int			PoolInit( unsigned int nPorts );
+
+	/// SavePersistAll()
+	/// Save the warm start file for each port w/ an event code
+	static	void		SavePersistAll( );
+
+	static	const char *	SyncStateToStr( TSSyncState syncState );
+
+	static	const char *	SyncTypeToStr( SyncType syncType );
+
+	/// Returns true if diffVsExp is within our sync window
+	/// Allow 40% early for sloppy estimated delay and 80% late
+	static	bool		InSyncWindow( double diffVsExp, double expDelay )
+	{
+		double	diffVsExpPercent = diffVsExp * 100.0 / expDelay; 
+		return ( -40.0 < diffVsExpPercent && diffVsExpPercent <= 80.0 );
+	}
+
+	/// Returns true if diffVsExp is close enough to hold over on fidDiff
+	/// Only entries later than our sync window qualify.  An earlier entry
+	/// is from a newer event than our frame's, so we step back for ours instead.
+	static	bool		InHoldoverWindow( double diffVsExp, double expDelay )
+	{
+		return ( (0.8*expDelay) < diffVsExp && diffVsExp <= (2*expDelay) );
+	}
+
+private:	//  Private constructors, use Create and Destroy
+    /// Constructor
+    TSFifo(	const char			*	pPortName,
+			struct	aSubRecord	*	pSubRecord,
+			TSPolicy				tsPolicy,
+			TSFifoPvt			*	pPvt	);
+
+    /// Destructor
+    virtual ~TSFifo( );
+
 private:	//  Private member functions
 	int		UpdateFifoInfo( bool fFirstUpdate );
+	void	ApplyFifoInfo( bool fFirstUpdate );
+	int		StepBackFifoInfo( unsigned int & iBuf, unsigned int & nBuf );
+	unsigned int	StepBackWindow( unsigned int nBufPrior ) const;
+	int		StepBackScan( unsigned int nScanMax, bool & fExhausted );
+	int		CatchUpFifoInfo( );
+	unsigned int	ReadScanInfo(	int				incr,
+									unsigned int	nScanMax,
+									bool		&	fExhausted	);
+	int		SelectScanInfo( unsigned int nScan );
+
+	/// Record the sync quality of the current frame in m_syncInfo
+	/// Must be called w/ m_TSLock mutex locked!
+	void	UpdateSyncInfo(	SyncType		syncType,
+							epicsUInt32		pulseId,
+							double			diffVsExp	);
+
+	/// Add an ExpectedDelay auto-tuning sample for the frame at tscNow
+	/// Must be called w/o m_TSLock locked!
+	void	SampleAutoDelay( t_HiResTime tscNow );
+
+	/// Apply our CPU list and priority to the calling thread if needed
+	/// and track which core it's running on
+	void	ApplySched( );
+
+	/// Apply the warm start file loaded by Create, once we have an event code
+	void	ApplyPersistPending( );
+
+	/// Queue the current frame for re-stamping
+	/// Must be called w/ m_TSLock mutex locked!
+	epicsUInt32	QueueRestamp( epicsTimeStamp & timeStampRet );
+
+	/// Copy out the corrected timestamps of any queued frames the pulse id
+	/// index can now match, and of ones that are too old to keep waiting
+	struct	TSFifoRestamp;
+	unsigned int	ResolveRestamps(	TSFifoRestamp			*	pResolved,
+										TSFifoRestampCallback	&	pCallback,
+										void				*	&	pUserPvt	);
 
 private:	//  Private class functions
-	static	void		AddTSFifo( TSFifo * );
-	static	void		DelTSFifo( TSFifo * );
+	/// Allocate the pool.  Must be called w/ the pool lock held!
+	static	int		PoolAlloc( unsigned int nPorts );
+
+	static	void	RestampThreadStart( void * );
+	static	void	RestampThread( void * );
 
 public:		//  Public input member variables
 	//
@@ -121,13 +398,16 @@ public:		//  Public input member variables
 	struct	aSubRecord	*	m_pSubRecord;
 
 private:	//  Private member variables
-	std::string				m_portName;
+	char					m_portName[TSFIFO_PORT_NAME_MAX];
 	uint64_t				m_idx;
 	unsigned int			m_idxIncr;
 	int						m_fidPrior;
 	int						m_fidDiffPrior;
 	int						m_syncCount;
-	int						m_syncCountMin;
+	TSSyncState				m_syncState;
+	int						m_fidDiffLock;	/// fidDiff between the last two matched entries
+	int						m_holdoverCount;
+	int						m_relockCount;	/// Frames searched from the prior cursor while relocking
 	t_HiResTime				m_tscNow;
 	EventTimingData			m_fifoInfo;
 	epicsTimeStamp			m_fifoTimeStamp;
@@ -135,11 +415,76 @@ private:	//  Private member variables
 	epicsUInt32				m_fidFifo;
 	TSPolicy				m_TSPolicy;
 	epicsMutexId			m_TSLock;
+	TSFifoPvt			*	m_pPvt;			/// Statistics, auto-tuning, sched and warm start state
+	TSFifoEngine		*	m_pEngine;		/// Shared sync engine, or NULL for private matching
+	const TSFifoSim		*	m_pSim;			/// Simulated FIFO, or NULL for the timing driver
+
+	/// Packed window of FIFO entries for StepBackScan, StepBackFifoInfo and CatchUpFifoInfo
+	EventTimingData			m_scanInfo[TSFIFO_SCAN_MAX];
+	uint64_t				m_scanIdx[TSFIFO_SCAN_MAX];
+	t_HiResTime				m_scanTsc[TSFIFO_SCAN_MAX];
+
+	/// Frames awaiting re-stamping
+	struct	TSFifoRestamp
+	{
+		epicsUInt32			token;
+		epicsUInt32			eventCode;
+		t_HiResTime			tscFrame;
+		double				expDelay;
+		epicsTimeStamp		timeStamp;
+	};
+	TSFifoRestampCallback	m_pRestampCallback;
+	void				*	m_pRestampPvt;
+	epicsUInt32				m_restampToken;
+	unsigned int			m_nRestamp;
+	TSFifoRestamp			m_restamp[TSFIFO_RESTAMP_MAX];
+
+	/// CPU affinity and priority for the threads calling GetTimeStamp
+	/// Kept in m_pPvt, guarded by m_schedLock so ApplySched never waits on m_TSLock
+	epicsMutexId			m_schedLock;
+
+	/// Last TS_SYNCED result, reused by contending callers in TS_FIFO_TRYLOCK mode
+	bool					m_lastSynced;
+	t_HiResTime				m_lastTscNow;
+	double					m_lastDiffVsExp;	/// diffVsExp published w/ the last result
+	epicsUInt32				m_lastGen;
+	epicsUInt32				m_nContended;		/// Callers that found the port busy
+	epicsUInt32				m_nReused;			/// Callers that reused a result
+
+	/// Sync quality
+	epicsUInt32				m_nFifoReads;		/// FIFO entries read for the current frame
+	SyncInfo				m_syncInfo;			/// Sync quality of the last frame
+
+	/// Warm start, the file loaded by Create is kept in m_pPvt
+	bool					m_persistPending;	/// Loaded, not yet applied
+	bool					m_persistApplied;
+	bool					m_fidDiffWarm;		/// m_fidDiffLock from the warm start file, not yet measured
+	epicsUInt32				m_nPersistSaves;
+	int						m_persistStatus;	/// 0, or errno from the last save
 
 private:    //  Private class variables
 
-	static  std::map< std::string, TSFifo *>	ms_TSFifoMap;
+	/// Fixed pool of TSFifo's, also our registry of ports
+	static	TSFifo			*	ms_pPool;
+	static	TSFifoPvt		*	ms_pPvtPool;
+	static	bool			*	ms_pPoolInUse;
+	static	unsigned int		ms_poolSize;
 };
 
+///
+/// Per frame sync quality
+/// An asyn timeStampSource can only return an epicsTimeStamp, so the sync
+/// quality of the frame it just stamped is kept for the calling thread.
+/// Drivers can fetch it w/ TSFifoGetSyncInfo right after updateTimeStamp,
+/// from the same thread, or attach it to NDArrays w/ the TSFifoSyncAttr
+/// attribute function.
+/// TSFifoGetTimeStampEx gets a timestamp and its sync quality in one call.
+///
+extern "C" int	TSFifoGetSyncInfo(		const char				*	pPortName,
+										TSFifoSyncInfo			*	pSyncInfo	);
+extern "C" int	TSFifoGetTimeStampEx(	const char				*	pPortName,
+										epicsTimeStamp			*	pTimeStampRet,
+										TSFifoSyncInfo			*	pSyncInfo	);
+
 
 #endif  //  TSFIFO_H
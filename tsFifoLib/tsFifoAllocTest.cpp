@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+#include <epicsThread.h>
+
+#include "evrTime.h"
+#include "HiResTime.h"
+#include "timeStampFifo.h"
+#include "tsFifoSim.h"
+#include "tsFifoEngine.h"
+#include "tsFifoSched.h"
+
+///
+/// Unit test for heap use on the timestamp path
+/// Replaces operator new, and malloc where glibc lets us, w/ versions
+/// that count calls while s_countAllocs is set.  Once a port is synced,
+/// GetTimeStamp, GetTimeStampEx and TimeStampFifo must not allocate on any
+/// sync path, including contended TS_FIFO_TRYLOCK calls, shared engines
+/// and queueing restamps, nor when applying new scheduling, which must
+/// not open any files.
+///
+
+/// Event code and rate used for the frames
+#define	TEST_EVENT_CODE		40
+#define	TEST_RATE_HZ		120.0
+#define	TEST_DELAY			7e-3
+
+/// Frame delay for the restamp frames, over two event periods
+#define	TEST_RESTAMP_DELAY	20e-3
+
+static volatile int		s_countAllocs	= 0;
+static volatile long	s_nAllocs		= 0;
+
+#ifdef	__GLIBC__
+extern "C" void *	__libc_malloc( size_t size );
+extern "C" void *	malloc( size_t size )
+{
+	if ( s_countAllocs )
+		s_nAllocs++;
+	return __libc_malloc( size );
+}
+
+/// Counts through our malloc
+static void * CountedAlloc( size_t size )
+{
+	return malloc( size );
+}
+#else
+static void * CountedAlloc( size_t size )
+{
+	if ( s_countAllocs )
+		s_nAllocs++;
+	return malloc( size );
+}
+#endif
+
+void * operator new( size_t size )
+{
+	void	*	p	= CountedAlloc( size );
+	if ( p == NULL )
+		throw std::bad_alloc();
+	return p;
+}
+
+void * operator new[]( size_t size )
+{
+	void	*	p	= CountedAlloc( size );
+	if ( p == NULL )
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete( void * p ) noexcept
+{
+	free( p );
+}
+
+void operator delete[]( void * p ) noexcept
+{
+	free( p );
+}
+
+
+/// How RunFrames stamps each frame
+enum	FrameCall	{ CALL_GET = 0, CALL_EX = 1, CALL_ASYN = 2 };
+
+/// Time nFrames frames on pTSFifo, one per simulated event, skipping
+/// every dropEvery'th event.  If pTSFifoShared is provided, it stamps each
+/// frame right after pTSFifo.  Each frame also releases the contending
+/// threads, if any.
+/// Returns the number of frames queued for re-stamping
+static unsigned int RunFrames(
+	TSFifo			*	pTSFifo,
+	TSFifo			*	pTSFifoShared,
+	const TSFifoSim	&	sim,
+	unsigned int		nFrames,
+	unsigned int		dropEvery,
+	FrameCall			call	);
+
+/// Threads that stamp each frame along w/ RunFrames, so TS_FIFO_TRYLOCK
+/// callers contend for the port lock
+#define	TEST_N_CONTENDERS	3
+
+static TSFifo		*	volatile	s_pContendFifo	= NULL;
+static volatile unsigned int		s_contendFrame	= 0;
+static volatile unsigned int		s_nContendDone	= 0;
+static volatile unsigned int		s_nContendReused	= 0;
+
+/// ContendThread:  Spin until the next frame, then stamp it at once
+static void ContendThread( void * )
+{
+	unsigned int	frameLast	= 0;
+	while ( true )
+	{
+		while ( s_contendFrame == frameLast )
+			;
+		frameLast	= s_contendFrame;
+		TSFifo	*	pTSFifo	= s_pContendFifo;
+		if ( pTSFifo != NULL )
+		{
+			// Contended callers that reuse a result don't read the FIFO
+			epicsTimeStamp		ts;
+			TSFifo::SyncInfo	syncInfo;
+			if ( pTSFifo->GetTimeStampEx( &ts, &syncInfo ) == 0 && syncInfo.nFifoReads == 0 )
+				__sync_fetch_and_add( &s_nContendReused, 1 );
+		}
+		__sync_fetch_and_add( &s_nContendDone, 1 );
+	}
+}
+
+static unsigned int RunFrames(
+	TSFifo			*	pTSFifo,
+	TSFifo			*	pTSFifoShared,
+	const TSFifoSim	&	sim,
+	unsigned int		nFrames,
+	unsigned int		dropEvery,
+	FrameCall			call	)
+{
+	double			ticksPerSec	= 1.0 / HiResTicksToSeconds( 1LL );
+	unsigned int	fidStep		= sim.GetFidStep( TEST_EVENT_CODE );
+	int64_t			iFidEvent	= ( sim.FidIndex( GetHiResTicks() ) / fidStep ) * fidStep;
+	unsigned int	nQueued		= 0;
+	for ( unsigned int iFrame = 0; iFrame < nFrames; iFrame++ )
+	{
+		iFidEvent	+= fidStep;
+		if ( dropEvery != 0 && ( iFrame % dropEvery ) == dropEvery - 1 )
+			continue;
+		t_HiResTime	tscFrame	= sim.FidTsc( iFidEvent )
+								+ static_cast<t_HiResTime>( TEST_DELAY * ticksPerSec );
+		while ( GetHiResTicks() < tscFrame )
+			;
+
+		unsigned int		nDone	= s_nContendDone;
+		if ( s_pContendFifo != NULL )
+			s_contendFrame++;
+
+		epicsTimeStamp		ts;
+		epicsUInt32			token	= 0;
+		TSFifo::SyncInfo	syncInfo;
+		if ( call == CALL_EX )
+			pTSFifo->GetTimeStampEx( &ts, &syncInfo, &token );
+		else if ( call == CALL_ASYN )
+			TimeStampFifo( pTSFifo, &ts );
+		else
+			pTSFifo->GetTimeStamp( &ts, &token );
+		if ( token != 0 )
+			nQueued++;
+		if ( pTSFifoShared != NULL )
+			pTSFifoShared->GetTimeStamp( &ts );
+
+		if ( s_pContendFifo != NULL )
+		{
+			while ( s_nContendDone - nDone < TEST_N_CONTENDERS )
+				;
+		}
+	}
+	return nQueued;
+}
+
+
+static void TestRestampCallback( void *, epicsUInt32, const epicsTimeStamp * )
+{
+}
+
+
+MAIN(tsFifoAllocTest)
+{
+	testPlan( 10 );
+
+	static char * volatile	pTest;
+	s_countAllocs	= 1;
+	pTest	= new char[16];
+	s_countAllocs	= 0;
+	delete [] pTest;
+	testOk( s_nAllocs == 1, "operator new hook counts allocations" );
+
+	TSFifoSim	sim;
+	sim.Start( 0 );
+	sim.SetEvent( TEST_EVENT_CODE, TEST_RATE_HZ );
+
+	TSFifo	*	pTSFifo	= TSFifo::Create( "AllocTest", NULL, TSFifo::TS_SYNCED );
+	if ( !testOk( pTSFifo != NULL, "Create port" ) )
+		return testDone();
+	pTSFifo->SetTimingCriteria( TEST_EVENT_CODE, 0, TEST_DELAY );
+	pTSFifo->SetSim( &sim );
+
+	// Sync up first, so one-time setup isn't counted
+	RunFrames( pTSFifo, NULL, sim, 20, 0, CALL_GET );
+
+	s_nAllocs		= 0;
+	s_countAllocs	= 1;
+	RunFrames( pTSFifo, NULL, sim, 120, 0, CALL_GET );
+	s_countAllocs	= 0;
+	testOk( s_nAllocs == 0, "GetTimeStamp, steady frames: %ld allocations", s_nAllocs );
+
+	s_nAllocs		= 0;
+	s_countAllocs	= 1;
+	RunFrames( pTSFifo, NULL, sim, 120, 5, CALL_EX );
+	s_countAllocs	= 0;
+	testOk( s_nAllocs == 0, "GetTimeStampEx, dropped triggers: %ld allocations", s_nAllocs );
+
+	s_nAllocs		= 0;
+	s_countAllocs	= 1;
+	RunFrames( pTSFifo, NULL, sim, 120, 5, CALL_ASYN );
+	s_countAllocs	= 0;
+	testOk( s_nAllocs == 0, "TimeStampFifo, dropped triggers: %ld allocations", s_nAllocs );
+
+	// Single pass step back
+	TS_FIFO_SCAN_DEPTH	= 16;
+	s_nAllocs		= 0;
+	s_countAllocs	= 1;
+	RunFrames( pTSFifo, NULL, sim, 120, 5, CALL_GET );
+	s_countAllocs	= 0;
+	TS_FIFO_SCAN_DEPTH	= 0;
+	testOk( s_nAllocs == 0, "GetTimeStamp w/ TS_FIFO_SCAN_DEPTH 16: %ld allocations", s_nAllocs );
+
+	// Contending callers, started before we count
+	TS_FIFO_TRYLOCK	= 1;
+	for ( unsigned int i = 0; i < TEST_N_CONTENDERS; i++ )
+		epicsThreadCreate(	"AllocContend", epicsThreadPriorityMedium,
+							epicsThreadGetStackSize( epicsThreadStackSmall ),
+							ContendThread, NULL );
+	s_pContendFifo	= pTSFifo;
+	RunFrames( pTSFifo, NULL, sim, 20, 0, CALL_GET );
+	s_nAllocs		= 0;
+	s_countAllocs	= 1;
+	RunFrames( pTSFifo, NULL, sim, 120, 5, CALL_GET );
+	s_countAllocs	= 0;
+	s_pContendFifo	= NULL;
+	TS_FIFO_TRYLOCK	= 0;
+	testDiag( "%u contending calls reused a result", s_nContendReused );
+	testOk( s_nAllocs == 0, "GetTimeStamp w/ TS_FIFO_TRYLOCK and %d contending threads: %ld allocations",
+			TEST_N_CONTENDERS, s_nAllocs );
+
+	// Two ports sharing an engine
+	double	delayTolSave	= TS_FIFO_ENGINE_DELAY_TOL;
+	TS_FIFO_ENGINE_DELAY_TOL	= 1e-3;
+	TSFifo	*	pTSFifoShared	= TSFifo::Create( "AllocTestShared", NULL, TSFifo::TS_SYNCED );
+	if ( pTSFifoShared != NULL )
+	{
+		pTSFifoShared->SetTimingCriteria( TEST_EVENT_CODE, 0, TEST_DELAY );
+		pTSFifoShared->SetSim( &sim );
+		pTSFifo->UpdateEngine( );
+		pTSFifoShared->UpdateEngine( );
+		RunFrames( pTSFifo, pTSFifoShared, sim, 20, 0, CALL_GET );
+		s_nAllocs		= 0;
+		s_countAllocs	= 1;
+		RunFrames( pTSFifo, pTSFifoShared, sim, 120, 5, CALL_GET );
+		s_countAllocs	= 0;
+	}
+	testOk( pTSFifoShared != NULL && pTSFifo->GetEngine() != NULL && s_nAllocs == 0,
+			"GetTimeStamp on ports sharing an engine: %ld allocations", s_nAllocs );
+	TSFifo::Destroy( pTSFifoShared );
+	TS_FIFO_ENGINE_DELAY_TOL	= delayTolSave;
+	pTSFifo->UpdateEngine( );
+
+	// Frames whose entries have already aged out of a one entry FIFO are
+	// queued for re-stamping.  The restamp thread is started before we count.
+	TSFifoSim	simRestamp	= sim;
+	simRestamp.SetDepth( 1 );
+	TSFifo	*	pTSFifoRestamp	= TSFifo::Create( "AllocTestRestamp", NULL, TSFifo::TS_SYNCED );
+	unsigned int	nQueued	= 0;
+	if ( pTSFifoRestamp != NULL )
+	{
+		pTSFifoRestamp->SetTimingCriteria( TEST_EVENT_CODE, 0, TEST_RESTAMP_DELAY );
+		pTSFifoRestamp->SetSim( &simRestamp );
+		pTSFifoRestamp->SetRestampCallback( TestRestampCallback, NULL );
+		epicsThreadSleep( 0.2 );
+		s_nAllocs		= 0;
+		s_countAllocs	= 1;
+		nQueued	= RunFrames( pTSFifoRestamp, NULL, simRestamp, TSFIFO_RESTAMP_MAX / 2, 0, CALL_GET );
+		s_countAllocs	= 0;
+	}
+	testOk( nQueued > 0 && s_nAllocs == 0, "GetTimeStamp queueing %u restamps: %ld allocations",
+			nQueued, s_nAllocs );
+	TSFifo::Destroy( pTSFifoRestamp );
+
+	// New scheduling is applied on the next GetTimeStamp.  Any fopen of
+	// sysfs there would allocate, so this also checks it's parsed up front.
+	int		status	= pTSFifo->SetSched( "node:0", 0 );
+	if ( status != 0 )
+		status	= pTSFifo->SetSched( "0", 0 );
+	testDiag( "SetSched: %s", status == 0 ? "OK" : "not supported" );
+	s_nAllocs		= 0;
+	s_countAllocs	= 1;
+	RunFrames( pTSFifo, NULL, sim, 30, 0, CALL_GET );
+	pTSFifo->SetSched( "", 0 );
+	RunFrames( pTSFifo, NULL, sim, 30, 0, CALL_GET );
+	s_countAllocs	= 0;
+	testOk( s_nAllocs == 0, "GetTimeStamp applying SetSched: %ld allocations", s_nAllocs );
+
+	TSFifo::Destroy( pTSFifo );
+	return testDone();
+}
@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "evrTime.h"
+#include "timeStampFifo.h"
+#include "tsFifoAutoDelay.h"
+#include "tsFifoRead.h"
+
+
+/// Learning fails if another peak scores at least this fraction of the best,
+/// unless it's an alias of the best one
+static const double	TSFifoAutoDelayAmbiguous	= 0.5;
+
+/// Sec between fiducials
+static const double	TSFifoAutoDelayFidPeriod	= 1.0 / 360.0;
+
+
+TSFifoAutoDelay::TSFifoAutoDelay( )
+	:	m_mode(				AUTO_DELAY_OFF	),
+		m_status(			AUTO_DELAY_IDLE	),
+		m_period(			10.0			),
+		m_tscStart(			0LL				),
+		m_tscNextSample(	0LL				),
+		m_nSamples(			0				),
+		m_nOutOfRange(		0				),
+		m_fidDiffMin(		0				),
+		m_expDelay(			0.0				),
+		m_learnedDelay(		0.0				)
+{
+	memset( m_hist, 0, sizeof(m_hist) );
+}
+
+
+void TSFifoAutoDelay::Configure(
+	Mode			mode,
+	double			period	)
+{
+	if ( period > 0 )
+		m_period	= period;
+	if ( mode == m_mode )
+		return;
+
+	m_mode	= mode;
+	Restart( );
+	switch ( m_mode )
+	{
+	case AUTO_DELAY_LEARN:	m_status	= AUTO_DELAY_LEARNING;	break;
+	case AUTO_DELAY_TRACK:	m_status	= AUTO_DELAY_TRACKING;	break;
+	default:				m_status	= AUTO_DELAY_IDLE;		break;
+	}
+}
+
+
+void TSFifoAutoDelay::Restart( )
+{
+	m_tscStart		= 0LL;
+	m_tscNextSample	= 0LL;
+	m_nSamples		= 0;
+	m_nOutOfRange	= 0;
+	m_fidDiffMin	= 0;
+	memset( m_hist, 0, sizeof(m_hist) );
+}
+
+
+bool TSFifoAutoDelay::SampleDue( t_HiResTime tscNow )
+{
+	if ( !IsLearning( ) || tscNow < m_tscNextSample )
+		return false;
+	if ( m_tscStart == 0LL )
+		m_tscStart	= tscNow;
+	double	ticksPerSec		= 1.0 / HiResTicksToSeconds( 1LL );
+	m_tscNextSample	= tscNow + static_cast<t_HiResTime>( m_period / TSFIFO_AUTO_DELAY_SAMPLES * ticksPerSec );
+	return true;
+}
+
+
+unsigned int TSFifoAutoDelay::ReadSample(
+	epicsUInt32				eventCode,
+	EventTimingData		*	pScanInfo,
+	const TSFifoSim		*	pSim	)
+{
+	// Fetch the most recent entries for this event code
+	uint64_t		idx		= 0;
+	if ( TSFifoRead( eventCode, MAX_TS_QUEUE, &idx, &pScanInfo[0], pSim ) != 0 )
+		return 0;
+	return 1 + TSFifoReadRange(	eventCode, -1, &idx, &pScanInfo[1], NULL,
+								TSFIFO_AUTO_DELAY_SCAN_MAX - 1, pSim );
+}
+
+
+void TSFifoAutoDelay::AddSample(
+	t_HiResTime					tscNow,
+	double						expDelay,
+	const EventTimingData	*	pScanInfo,
+	unsigned int				nScan	)
+{
+	if ( !IsLearning( ) )
+		return;
+
+	m_expDelay	= expDelay;
+	bool			fAdded		= false;
+	unsigned int	iPrior		= nScan;
+	for ( unsigned int i = 0; i < nScan; i++ )
+	{
+		if ( pScanInfo[i].fifo_tsc > tscNow )
+			continue;
+		double	delay	= HiResTicksToSeconds( tscNow - pScanInfo[i].fifo_tsc );
+		int		iBin	= static_cast<int>( delay / TSFIFO_AUTO_DELAY_BIN_WIDTH );
+		if ( iBin >= TSFIFO_AUTO_DELAY_BINS )
+		{
+			m_nOutOfRange++;
+			break;
+		}
+		m_hist[iBin]++;
+		fAdded	= true;
+
+		// W/o an expected delay, only the most recent entry is a candidate
+		if ( expDelay <= 0 )
+			break;
+
+		// The shortest fidDiff between entries is the event period
+		if ( iPrior < nScan )
+		{
+			int	fidPrior	= PULSEID( pScanInfo[iPrior].fifo_time );
+			int	fidEntry	= PULSEID( pScanInfo[i].fifo_time );
+			if ( fidPrior != PULSEID_INVALID && fidEntry != PULSEID_INVALID )
+			{
+				int	fidDiff	= FID_DIFF( fidPrior, fidEntry );
+				if ( fidDiff > 0 && ( m_fidDiffMin == 0 || fidDiff < m_fidDiffMin ) )
+					m_fidDiffMin	= fidDiff;
+			}
+		}
+		iPrior	= i;
+	}
+	if ( fAdded )
+		m_nSamples++;
+}
+
+
+epicsUInt32 TSFifoAutoDelay::PeakScore( int iBin ) const
+{
+	epicsUInt32	score	= 0;
+	for ( int i = iBin - TSFIFO_AUTO_DELAY_PEAK_HALF; i <= iBin + TSFIFO_AUTO_DELAY_PEAK_HALF; i++ )
+	{
+		if ( i >= 0 && i < TSFIFO_AUTO_DELAY_BINS )
+			score	+= m_hist[i];
+	}
+	return score;
+}
+
+
+int TSFifoAutoDelay::FindPeak(
+	epicsUInt32		&	score,
+	epicsUInt32		&	scoreNext	) const
+{
+	int		iPeak	= -1;
+	score		= 0;
+	scoreNext	= 0;
+	for ( int iBin = 0; iBin < TSFIFO_AUTO_DELAY_BINS; iBin++ )
+	{
+		epicsUInt32	binScore	= PeakScore( iBin );
+		if ( binScore > score )
+		{
+			score	= binScore;
+			iPeak	= iBin;
+		}
+	}
+	if ( iPeak < 0 )
+		return -1;
+
+	// Best score of any peak at least twice the peak width away
+	for ( int iBin = 0; iBin < TSFIFO_AUTO_DELAY_BINS; iBin++ )
+	{
+		if ( abs( iBin - iPeak ) <= 4 * TSFIFO_AUTO_DELAY_PEAK_HALF )
+			continue;
+		epicsUInt32	binScore	= PeakScore( iBin );
+		if ( binScore > scoreNext )
+			scoreNext	= binScore;
+	}
+	return iPeak;
+}
+
+
+unsigned int TSFifoAutoDelay::FindPeaks(
+	int			*	pPeaks,
+	epicsUInt32	*	pScores	) const
+{
+	epicsUInt32		binScores[TSFIFO_AUTO_DELAY_BINS];
+	for ( int iBin = 0; iBin < TSFIFO_AUTO_DELAY_BINS; iBin++ )
+		binScores[iBin]	= PeakScore( iBin );
+
+	unsigned int	nPeaks	= 0;
+	while ( nPeaks < TSFIFO_AUTO_DELAY_PEAKS_MAX )
+	{
+		int				iPeak	= -1;
+		epicsUInt32		score	= 0;
+		for ( int iBin = 0; iBin < TSFIFO_AUTO_DELAY_BINS; iBin++ )
+		{
+			if ( binScores[iBin] <= score )
+				continue;
+			bool	fNearPeak	= false;
+			for ( unsigned int j = 0; j < nPeaks && !fNearPeak; j++ )
+				fNearPeak	= abs( iBin - pPeaks[j] ) <= 4 * TSFIFO_AUTO_DELAY_PEAK_HALF;
+			if ( fNearPeak )
+				continue;
+			score	= binScores[iBin];
+			iPeak	= iBin;
+		}
+		if ( iPeak < 0 || ( nPeaks > 0 && score < pScores[0] * TSFifoAutoDelayAmbiguous ) )
+			break;
+		pPeaks[nPeaks]	= iPeak;
+		pScores[nPeaks]	= score;
+		nPeaks++;
+	}
+	return nPeaks;
+}
+
+
+bool TSFifoAutoDelay::IsAlias(
+	int		iBin,
+	int		iBinPeak	) const
+{
+	if ( m_fidDiffMin <= 0 )
+		return false;
+	double	periodBins	= m_fidDiffMin * TSFifoAutoDelayFidPeriod / TSFIFO_AUTO_DELAY_BIN_WIDTH;
+	double	offset		= abs( iBin - iBinPeak );
+	double	nPeriods	= floor( offset / periodBins + 0.5 );
+	return nPeriods >= 1 && fabs( offset - nPeriods * periodBins ) <= TSFIFO_AUTO_DELAY_PEAK_HALF;
+}
+
+
+void TSFifoAutoDelay::Restore( double learnedDelay )
+{
+	if ( learnedDelay > 0 && m_learnedDelay == 0.0 )
+		m_learnedDelay	= learnedDelay;
+}
+
+
+bool TSFifoAutoDelay::Poll( double & delay )
+{
+	if ( !IsLearning( ) || m_tscStart == 0LL )
+		return false;
+	if ( HiResTicksToSeconds( GetHiResTicks() - m_tscStart ) < m_period )
+		return false;
+
+	int				peaks[TSFIFO_AUTO_DELAY_PEAKS_MAX];
+	epicsUInt32		scores[TSFIFO_AUTO_DELAY_PEAKS_MAX];
+	unsigned int	nPeaks		= FindPeaks( peaks, scores );
+
+	// Close peaks that are all aliases of the best one resolve to the
+	// alias nearest the current expected delay
+	unsigned int	iBest		= 0;
+	bool			fAliased	= ( nPeaks > 1 && m_expDelay > 0 );
+	for ( unsigned int j = 1; j < nPeaks && fAliased; j++ )
+		fAliased	= IsAlias( peaks[j], peaks[0] );
+	if ( fAliased )
+	{
+		for ( unsigned int j = 1; j < nPeaks; j++ )
+		{
+			if (	fabs( ( peaks[j]     + 0.5 ) * TSFIFO_AUTO_DELAY_BIN_WIDTH - m_expDelay )
+				<	fabs( ( peaks[iBest] + 0.5 ) * TSFIFO_AUTO_DELAY_BIN_WIDTH - m_expDelay ) )
+				iBest	= j;
+		}
+	}
+
+	int			iPeak		= ( nPeaks > 0 ? peaks[iBest] : -1 );
+	epicsUInt32	score		= ( nPeaks > 0 ? scores[iBest] : 0 );
+	bool		fAmbiguous	= ( nPeaks > 1 && !fAliased );
+	bool		fLearned	= (		iPeak >= 0
+								&&	score >= TSFIFO_AUTO_DELAY_MIN_FRAMES
+								&&	score * 2 > m_nSamples
+								&&	!fAmbiguous );
+	if ( fLearned )
+	{
+		// Center of the peak, weighted by its bins
+		double	sum		= 0.0;
+		for (	int iBin = iPeak - TSFIFO_AUTO_DELAY_PEAK_HALF;
+				iBin <= iPeak + TSFIFO_AUTO_DELAY_PEAK_HALF; iBin++ )
+		{
+			if ( iBin >= 0 && iBin < TSFIFO_AUTO_DELAY_BINS )
+				sum	+= m_hist[iBin] * ( iBin + 0.5 );
+		}
+		m_learnedDelay	= sum / score * TSFIFO_AUTO_DELAY_BIN_WIDTH;
+		delay			= m_learnedDelay;
+	}
+	if ( DEBUG_TS_FIFO >= 2 || ( !fLearned && DEBUG_TS_FIFO ) )
+		printf( "TSFifoAutoDelay: %u samples, peak %.3fms w/ %u, %u close peaks%s, %u out of range: %s\n",
+				m_nSamples, ( iPeak + 0.5 ) * TSFIFO_AUTO_DELAY_BIN_WIDTH * 1000, score, nPeaks,
+				( fAliased ? " aliased" : "" ), m_nOutOfRange,
+				( fLearned ? "learned" : ( fAmbiguous ? "ambiguous" : "too few samples" ) ) );
+
+	if ( m_mode == AUTO_DELAY_TRACK )
+		Restart( );
+	else
+		m_status	= ( fLearned ? AUTO_DELAY_DONE : AUTO_DELAY_FAILED );
+	return fLearned;
+}
+
+
+const char * TSFifoAutoDelay::StatusToStr( Status status )
+{
+	const char	*	pStr	= "Invalid";
+	switch ( status )
+	{
+	case AUTO_DELAY_IDLE:		pStr	= "Off";		break;
+	case AUTO_DELAY_LEARNING:	pStr	= "Learning";	break;
+	case AUTO_DELAY_DONE:		pStr	= "Done";		break;
+	case AUTO_DELAY_TRACKING:	pStr	= "Tracking";	break;
+	case AUTO_DELAY_FAILED:		pStr	= "Failed";		break;
+	}
+	return pStr;
+}
+
+
+void TSFifoAutoDelay::Show( int level ) const
+{
+	printf( "\tAutoDelay:\t%s, period %.1fsec, learned %.3fms\n",
+			StatusToStr( m_status ), m_period, m_learnedDelay * 1000 );
+	if ( level >= 2 && IsLearning( ) )
+	{
+		epicsUInt32	score		= 0;
+		epicsUInt32	scoreNext	= 0;
+		int			iPeak		= FindPeak( score, scoreNext );
+		printf( "\t\t\t%u samples, peak %.3fms w/ %u, next peak w/ %u\n",
+				m_nSamples, ( iPeak + 0.5 ) * TSFIFO_AUTO_DELAY_BIN_WIDTH * 1000, score, scoreNext );
+	}
+}
@@ -0,0 +1,167 @@
+#ifndef TSFIFO_AUTO_DELAY_H
+#define TSFIFO_AUTO_DELAY_H
+
+#include <stdint.h>
+#include "HiResTime.h"
+#include "timingFifoApi.h"
+
+///
+/// Header file for ExpectedDelay auto-tuning
+///
+/// While learning, one frame per sample interval, TSFIFO_AUTO_DELAY_SAMPLES
+/// per learning period, is sampled.  The sample reads the recent FIFO
+/// entries for its event code outside the port's lock, and adds the delay
+/// from each candidate entry to a histogram.  Only the most recent entry is
+/// a candidate if there's no expected delay yet, otherwise every entry w/in
+/// the histogram's range.  The delay of a frame's own event falls in the
+/// same bins on every sample, while other candidates spread out as frames
+/// and events drift in phase.  At the end of the learning period the peak
+/// of the histogram becomes the learned expected delay, if it holds most of
+/// the samples and no other peak comes close.
+/// Frames locked to a periodic event code also leave aliases of the peak,
+/// one per event period.  If every close peak is offset from the best one
+/// by a multiple of the event period, measured by the fidDiff between
+/// successive entries, the alias nearest the current expected delay is
+/// learned.  Otherwise learning fails rather than guess.
+///
+/// Modes:
+///   AUTO_DELAY_OFF	- No learning
+///   AUTO_DELAY_LEARN	- Learn once, each time this mode is selected
+///   AUTO_DELAY_TRACK	- Learn continuously, one result per learning period,
+///						  to follow slow drift
+///
+
+/// Min samples in the histogram peak needed for a learned delay
+#define	TSFIFO_AUTO_DELAY_MIN_FRAMES	10
+
+/// Frames sampled per learning period
+#define	TSFIFO_AUTO_DELAY_SAMPLES		100
+
+/// Max FIFO entries checked per sample
+#define	TSFIFO_AUTO_DELAY_SCAN_MAX		64
+
+/// Histogram bins, and bin width in sec, covering delays up to 102.4ms
+#define	TSFIFO_AUTO_DELAY_BINS			1024
+#define	TSFIFO_AUTO_DELAY_BIN_WIDTH		100e-6
+
+/// Peaks are scored over this many bins either side of their center, so
+/// frame jitter up to +/-0.5ms stays in one peak.  Other peaks must be at
+/// least twice the peak width away, well under the 2.8ms between fiducials.
+#define	TSFIFO_AUTO_DELAY_PEAK_HALF		5
+
+/// Max close peaks checked for aliasing
+#define	TSFIFO_AUTO_DELAY_PEAKS_MAX		40
+
+class	TSFifoSim;
+
+class	TSFifoAutoDelay
+{
+public:
+	enum Mode		{ AUTO_DELAY_OFF = 0, AUTO_DELAY_LEARN = 1, AUTO_DELAY_TRACK = 2 };
+
+	enum Status		{	AUTO_DELAY_IDLE = 0, AUTO_DELAY_LEARNING = 1, AUTO_DELAY_DONE = 2,
+						AUTO_DELAY_TRACKING = 3, AUTO_DELAY_FAILED = 4 };
+
+	TSFifoAutoDelay( );
+
+	/// Configure()
+	/// Set the mode and learning period in sec
+	/// Selecting a new mode restarts learning
+	void	Configure(	Mode			mode,
+						double			period	);
+
+	/// Returns true while frames are being sampled
+	bool	IsLearning( ) const
+	{
+		return m_status == AUTO_DELAY_LEARNING || m_status == AUTO_DELAY_TRACKING;
+	}
+
+	/// SampleDue()
+	/// Returns true if the frame at tscNow should be sampled, at most once
+	/// per sample interval.  The caller then reads the FIFO w/ ReadSample
+	/// and passes the entries to AddSample.
+	bool	SampleDue(	t_HiResTime		tscNow	);
+
+	/// ReadSample()
+	/// Read the most recent FIFO entries for eventCode into pScanInfo,
+	/// newest first.  Entries come from pSim if given, otherwise the timing
+	/// driver.  Needs no lock.  Returns the number of entries read
+	static unsigned int	ReadSample(	epicsUInt32				eventCode,
+									EventTimingData		*	pScanInfo,
+									const TSFifoSim		*	pSim = NULL	);
+
+	/// AddSample()
+	/// Add the candidate delays of a frame at tscNow to the histogram.
+	/// pScanInfo must be newest first, as from ReadSample.
+	void	AddSample(	t_HiResTime					tscNow,
+						double						expDelay,
+						const EventTimingData	*	pScanInfo,
+						unsigned int				nScan	);
+
+	/// Poll()
+	/// At the end of a learning period, set delay to the learned delay
+	/// Returns true if there's a new learned delay
+	bool	Poll(	double		&	delay	);
+
+	/// Restore()
+	/// Restore the delay learned before an IOC restart for display and
+	/// saving.  Only a delay learned in this run is ever returned by Poll.
+	void	Restore(	double		learnedDelay	);
+
+	Mode	GetMode( ) const
+	{
+		return m_mode;
+	}
+
+	Status	GetStatus( ) const
+	{
+		return m_status;
+	}
+
+	double	GetLearnedDelay( ) const
+	{
+		return m_learnedDelay;
+	}
+
+	/// Show()
+	/// Display the learning state on stdout
+	void	Show( int level ) const;
+
+	static	const char *	StatusToStr( Status status );
+
+private:
+	void	Restart( );
+
+	/// Find the histogram peak, and the best score of any other peak
+	/// Returns the peak's bin, or -1 if the histogram is empty
+	int		FindPeak(	epicsUInt32		&	score,
+						epicsUInt32		&	scoreNext	) const;
+
+	/// Find the peaks scoring at least TSFifoAutoDelayAmbiguous of the best,
+	/// best first, at least twice the peak width apart.
+	/// Returns the number of peaks found
+	unsigned int	FindPeaks(	int			*	pPeaks,
+								epicsUInt32	*	pScores	) const;
+
+	/// Returns true if the bins are a multiple of the event period apart
+	bool	IsAlias(	int		iBin,
+						int		iBinPeak	) const;
+
+	/// Returns the sum of the bins within TSFIFO_AUTO_DELAY_PEAK_HALF of iBin
+	epicsUInt32	PeakScore(	int		iBin	) const;
+
+private:
+	Mode				m_mode;
+	Status				m_status;
+	double				m_period;			/// Learning period in sec
+	t_HiResTime			m_tscStart;			/// TSC of the first sample this period
+	t_HiResTime			m_tscNextSample;
+	epicsUInt32			m_nSamples;
+	epicsUInt32			m_nOutOfRange;		/// Candidates past the last bin
+	int					m_fidDiffMin;		/// Fiducials between successive entries, the event period
+	double				m_expDelay;			/// Expected delay of the last sample
+	double				m_learnedDelay;
+	epicsUInt32			m_hist[TSFIFO_AUTO_DELAY_BINS];	/// Candidate delays this period
+};
+
+#endif  //  TSFIFO_AUTO_DELAY_H
@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <epicsThread.h>
+
+#include "evrTime.h"
+#include "HiResTime.h"
+#include "timeStampFifo.h"
+#include "tsFifoRead.h"
+#include "tsFifoSim.h"
+
+///
+/// Microbenchmarks for the TSFifo hot path
+///
+/// Each benchmark times nIter calls of one component against the simulated
+/// timing FIFO and reports the mean ns per call.  Results are written as
+/// JSON so they can be tracked across tagged releases.
+/// Components are only timed through the public and C API, and run on
+/// their own port and simulation, so they don't change anything another
+/// port depends on.  TS_FIFO_SCAN_DEPTH is restored after each scan run.
+///
+/// Usage:	tsFifoBench [nIter [jsonFile [tag]]]
+///
+
+/// Port, event code and expected delay used for the benchmarks
+static const char		*	TSFifoBenchPortName		= "TSFifoBench";
+static const unsigned int	TSFifoBenchEventCode	= 40;
+static const double			TSFifoBenchDelay		= 7e-3;
+
+/// Default number of calls per benchmark
+static const unsigned int	TSFifoBenchIterDefault	= 20000;
+
+/// Step back depths to benchmark
+static const unsigned int	TSFifoBenchDepths[]		= { 1, 4, 16, TSFIFO_SCAN_MAX };
+#define	N_BENCH_DEPTHS		( sizeof(TSFifoBenchDepths) / sizeof(TSFifoBenchDepths[0]) )
+
+#define	N_BENCH_MAX			( 8 + 3 * N_BENCH_DEPTHS )
+
+static volatile double		s_benchSink	= 0;
+
+
+///	TSFifoBench times each component through the same public and C API
+///	the drivers use, so the benchmarks track what callers actually pay
+class	TSFifoBench
+{
+public:
+	TSFifoBench( TSFifo * pTSFifo, const TSFifoSim * pSim, unsigned int nIter )
+		:	m_pTSFifo(	pTSFifo	),
+			m_pSim(		pSim	),
+			m_nIter(	nIter	),
+			m_nResults(	0		)
+	{
+	}
+
+	void	Run( );
+	int		WriteJson( FILE * fp, const char * pTag ) const;
+
+private:
+	void	AddResult( const char * pName, unsigned int depth, t_HiResTime tscStart, unsigned int nCalls );
+
+	void	BenchFifoRead( );
+	void	BenchWindowTest( );
+	void	BenchFidDiff( );
+	void	BenchStepBack( unsigned int depth );
+	void	BenchReadRange( unsigned int depth );
+	void	BenchScanDepth( unsigned int depth );
+	void	BenchFindByPortName( );
+	void	BenchTimeStampFifo( );
+	void	BenchGetTimeStamp( );
+	void	BenchGetTimeStampEx( );
+
+	struct	BenchResult
+	{
+		const char	*	pName;
+		unsigned int	depth;
+		double			nsPerCall;
+	};
+
+	TSFifo			*	m_pTSFifo;
+	const TSFifoSim	*	m_pSim;
+	unsigned int		m_nIter;
+	unsigned int		m_nResults;
+	BenchResult			m_results[N_BENCH_MAX];
+};
+
+
+/// WriteJsonString:  Write s as a quoted JSON string
+static void WriteJsonString( FILE * fp, const char * s )
+{
+	fputc( '"', fp );
+	for ( ; s != NULL && *s != 0; s++ )
+	{
+		unsigned char	c	= static_cast<unsigned char>( *s );
+		if ( c == '"' || c == '\\' )
+			fprintf( fp, "\\%c", c );
+		else if ( c < 0x20 )
+			fprintf( fp, "\\u%04x", c );
+		else
+			fputc( c, fp );
+	}
+	fputc( '"', fp );
+}
+
+
+void TSFifoBench::AddResult(
+	const char		*	pName,
+	unsigned int		depth,
+	t_HiResTime			tscStart,
+	unsigned int		nCalls	)
+{
+	double	sec	= HiResTicksToSeconds( GetHiResTicks() - tscStart );
+	if ( m_nResults >= N_BENCH_MAX || nCalls == 0 )
+		return;
+	m_results[m_nResults].pName		= pName;
+	m_results[m_nResults].depth		= depth;
+	m_results[m_nResults].nsPerCall	= sec * 1e9 / nCalls;
+	m_nResults++;
+}
+
+
+void TSFifoBench::BenchFifoRead( )
+{
+	EventTimingData	fifoInfo;
+	uint64_t		idx			= 0;
+	unsigned int	nCalls		= 0;
+	t_HiResTime		tscStart	= GetHiResTicks();
+	for ( unsigned int i = 0; i < m_nIter; i++ )
+	{
+		if ( TSFifoRead( TSFifoBenchEventCode, MAX_TS_QUEUE, &idx, &fifoInfo, m_pSim ) != 0 )
+			break;
+		nCalls++;
+	}
+	AddResult( "TSFifoRead", 0, tscStart, nCalls );
+}
+
+
+void TSFifoBench::BenchWindowTest( )
+{
+	unsigned int	nInWindow	= 0;
+	t_HiResTime	tscStart	= GetHiResTicks();
+	for ( unsigned int i = 0; i < m_nIter; i++ )
+	{
+		double	diffVsExp	= ( i % 64 ) * 0.5e-3 - 8e-3;
+		if ( TSFifo::InSyncWindow( diffVsExp, TSFifoBenchDelay ) )
+			nInWindow++;
+	}
+	AddResult( "InSyncWindow", 0, tscStart, m_nIter );
+	s_benchSink	+= nInWindow;
+}
+
+
+void TSFifoBench::BenchFidDiff( )
+{
+	int			sum			= 0;
+	t_HiResTime	tscStart	= GetHiResTicks();
+	for ( unsigned int i = 0; i < m_nIter; i++ )
+	{
+		// Cover wraparound at FID_MAX
+		epicsUInt32	fidPrior	= ( FID_MAX - 64 + 3 * i ) % FID_MAX;
+		epicsUInt32	fid			= ( fidPrior + 3 ) % FID_MAX;
+		sum	+= FID_DIFF( fid, fidPrior );
+	}
+	AddResult( "FID_DIFF", 0, tscStart, m_nIter );
+	s_benchSink	+= sum;
+}
+
+
+/// BenchStepBack:  Newest entry, then depth earlier ones, one read each
+void TSFifoBench::BenchStepBack( unsigned int depth )
+{
+	EventTimingData	fifoInfo;
+	unsigned int	nCalls		= 0;
+	t_HiResTime		tscStart	= GetHiResTicks();
+	for ( unsigned int i = 0; i < m_nIter; i++ )
+	{
+		uint64_t	idx	= 0;
+		if ( TSFifoRead( TSFifoBenchEventCode, MAX_TS_QUEUE, &idx, &fifoInfo, m_pSim ) != 0 )
+			break;
+		for ( unsigned int iStep = 0; iStep < depth; iStep++ )
+		{
+			if ( TSFifoRead( TSFifoBenchEventCode, -1, &idx, &fifoInfo, m_pSim ) != 0 )
+				break;
+		}
+		nCalls++;
+	}
+	AddResult( "TSFifoRead step back", depth, tscStart, nCalls );
+}
+
+
+/// BenchReadRange:  Newest entry, then depth earlier ones in one range
+void TSFifoBench::BenchReadRange( unsigned int depth )
+{
+	EventTimingData	fifoBuf[TSFIFO_SCAN_MAX];
+	unsigned int	nCalls		= 0;
+	t_HiResTime		tscStart	= GetHiResTicks();
+	for ( unsigned int i = 0; i < m_nIter; i++ )
+	{
+		uint64_t	idx	= 0;
+		if ( TSFifoRead( TSFifoBenchEventCode, MAX_TS_QUEUE, &idx, &fifoBuf[0], m_pSim ) != 0 )
+			break;
+		s_benchSink	+= TSFifoReadRange( TSFifoBenchEventCode, -1, &idx, fifoBuf, NULL, depth, m_pSim );
+		nCalls++;
+	}
+	AddResult( "TSFifoReadRange", depth, tscStart, nCalls );
+}
+
+
+/// BenchScanDepth:  Unsynced GetTimeStamp w/ TS_FIFO_SCAN_DEPTH set to depth
+/// SetSim drops the port's sync before each call.  The newest 360Hz entry
+/// is then always too early for our expected delay, so each call steps
+/// back through the FIFO to find its match.
+void TSFifoBench::BenchScanDepth( unsigned int depth )
+{
+	epicsTimeStamp	ts;
+	int				scanDepthSave	= TS_FIFO_SCAN_DEPTH;
+	TS_FIFO_SCAN_DEPTH	= depth;
+	t_HiResTime		tscStart	= GetHiResTicks();
+	for ( unsigned int i = 0; i < m_nIter; i++ )
+	{
+		m_pTSFifo->SetSim( m_pSim );
+		m_pTSFifo->GetTimeStamp( &ts );
+	}
+	AddResult( "GetTimeStamp scan", depth, tscStart, m_nIter );
+	TS_FIFO_SCAN_DEPTH	= scanDepthSave;
+}
+
+
+void TSFifoBench::BenchFindByPortName( )
+{
+	const char	*	pPortName	= m_pTSFifo->GetPortName();
+	unsigned int	nFound		= 0;
+	t_HiResTime		tscStart	= GetHiResTicks();
+	for ( unsigned int i = 0; i < m_nIter; i++ )
+	{
+		if ( TSFifo::FindByPortName( pPortName ) != NULL )
+			nFound++;
+	}
+	AddResult( "FindByPortName", 0, tscStart, m_nIter );
+	s_benchSink	+= nFound;
+}
+
+
+void TSFifoBench::BenchTimeStampFifo( )
+{
+	epicsTimeStamp	ts;
+	t_HiResTime		tscStart	= GetHiResTicks();
+	for ( unsigned int i = 0; i < m_nIter; i++ )
+		TimeStampFifo( m_pTSFifo, &ts );
+	AddResult( "TimeStampFifo", 0, tscStart, m_nIter );
+}
+
+
+void TSFifoBench::BenchGetTimeStamp( )
+{
+	epicsTimeStamp	ts;
+	t_HiResTime		tscStart	= GetHiResTicks();
+	for ( unsigned int i = 0; i < m_nIter; i++ )
+		m_pTSFifo->GetTimeStamp( &ts );
+	AddResult( "GetTimeStamp", 0, tscStart, m_nIter );
+}
+
+
+void TSFifoBench::BenchGetTimeStampEx( )
+{
+	epicsTimeStamp	ts;
+	TSFifoSyncInfo	syncInfo;
+	const char	*	pPortName	= m_pTSFifo->GetPortName();
+	t_HiResTime		tscStart	= GetHiResTicks();
+	for ( unsigned int i = 0; i < m_nIter; i++ )
+		TSFifoGetTimeStampEx( pPortName, &ts, &syncInfo );
+	AddResult( "TSFifoGetTimeStampEx", 0, tscStart, m_nIter );
+}
+
+
+void TSFifoBench::Run( )
+{
+	m_nResults	= 0;
+	BenchFifoRead( );
+	BenchWindowTest( );
+	BenchFidDiff( );
+	for ( unsigned int i = 0; i < N_BENCH_DEPTHS; i++ )
+		BenchStepBack( TSFifoBenchDepths[i] );
+	for ( unsigned int i = 0; i < N_BENCH_DEPTHS; i++ )
+		BenchReadRange( TSFifoBenchDepths[i] );
+	for ( unsigned int i = 0; i < N_BENCH_DEPTHS; i++ )
+		BenchScanDepth( TSFifoBenchDepths[i] );
+	BenchFindByPortName( );
+	BenchTimeStampFifo( );
+	BenchGetTimeStamp( );
+	BenchGetTimeStampEx( );
+}
+
+
+int TSFifoBench::WriteJson( FILE * fp, const char * pTag ) const
+{
+	fprintf( fp, "{\n" );
+	fprintf( fp, "  \"tag\": " );
+	WriteJsonString( fp, pTag );
+	fprintf( fp, ",\n  \"port\": " );
+	WriteJsonString( fp, m_pTSFifo->GetPortName() );
+	fprintf( fp, ",\n" );
+	fprintf( fp, "  \"eventCode\": %u,\n",		TSFifoBenchEventCode );
+	fprintf( fp, "  \"iterations\": %u,\n",		m_nIter );
+	fprintf( fp, "  \"benchmarks\": [\n" );
+	for ( unsigned int i = 0; i < m_nResults; i++ )
+	{
+		fprintf( fp, "    { \"name\": \"%s\", \"depth\": %u, \"ns_per_call\": %.1f }%s\n",
+				m_results[i].pName, m_results[i].depth, m_results[i].nsPerCall,
+				i + 1 < m_nResults ? "," : "" );
+	}
+	fprintf( fp, "  ]\n" );
+	fprintf( fp, "}\n" );
+	return 0;
+}
+
+
+int main( int argc, char ** argv )
+{
+	unsigned int	nIter		= TSFifoBenchIterDefault;
+	const char	*	fileName	= NULL;
+	const char	*	tag			= "";
+	if ( argc > 1 )
+		nIter	= strtoul( argv[1], NULL, 0 );
+	if ( argc > 2 )
+		fileName	= argv[2];
+	if ( argc > 3 )
+		tag		= argv[3];
+	if ( nIter == 0 )
+	{
+		printf( "Usage: tsFifoBench [nIter [jsonFile [tag]]]\n" );
+		return 1;
+	}
+
+	TSFifo	*	pTSFifo	= TSFifo::Create( TSFifoBenchPortName, NULL, TSFifo::TS_SYNCED );
+	if ( pTSFifo == NULL )
+		return 1;
+	pTSFifo->SetTimingCriteria( TSFifoBenchEventCode, 0, TSFifoBenchDelay );
+
+	// Run against our own simulated FIFO, w/ enough events to step back through
+	TSFifoSim	sim;
+	sim.Start( 0 );
+	sim.SetEvent( TSFifoBenchEventCode, 360.0 );
+	epicsThreadSleep( 2.0 * TSFIFO_SCAN_MAX / 360.0 );
+	pTSFifo->SetSim( &sim );
+
+	TSFifoBench		bench( pTSFifo, &sim, nIter );
+	bench.Run( );
+
+	FILE	*	fp	= stdout;
+	if ( fileName != NULL && strlen(fileName) > 0 )
+	{
+		fp	= fopen( fileName, "w" );
+		if ( fp == NULL )
+		{
+			printf( "Error tsFifoBench: Unable to open %s\n", fileName );
+			TSFifo::Destroy( pTSFifo );
+			return 1;
+		}
+	}
+	bench.WriteJson( fp, tag );
+	if ( fp != stdout )
+		fclose( fp );
+
+	TSFifo::Destroy( pTSFifo );
+	return 0;
+}
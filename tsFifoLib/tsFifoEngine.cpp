@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <math.h>
+
+#include <iocsh.h>
+#include <epicsThread.h>
+#include <epicsExport.h>
+
+#include "evrTime.h"
+#include "mrfCommon.h"
+#include "tsFifoEngine.h"
+
+double					TS_FIFO_ENGINE_DELAY_TOL	= 0.0;
+double					TS_FIFO_ENGINE_FRAME_TOL	= 1.4e-3;
+
+/// Max time in sec a port waits for another port's claimed match
+static const double		TSFifoEngineWaitMax			= 1e-3;
+
+/// Engines by event code, each a list w/ one engine per delay class
+static TSFifoEngine	*	s_enginesByEventCode[ MRF_NUM_EVENTS ];
+
+/// Serializes engine creation, re-keying and subscriber counts
+static epicsMutexId		s_engineListLock	= 0;
+static epicsThreadOnceId	s_engineListOnce	= EPICS_THREAD_ONCE_INIT;
+
+static void EngineListInit( void * )
+{
+	s_engineListLock	= epicsMutexMustCreate( );
+}
+
+
+/// Constructor for TSFifoEngine
+TSFifoEngine::TSFifoEngine(
+	epicsUInt32				eventCode,
+	double					expDelay,
+	const TSFifoSim		*	pSim	)
+	:	m_eventCode(	eventCode		),
+		m_expDelay(		expDelay		),
+		m_pSim(			pSim			),
+		m_nSubscribers(	0				),
+		m_fClaimed(		false			),
+		m_fMatchValid(	false			),
+		m_tscFrame(		0LL				),
+		m_genCount(		0				),
+		m_idx(			0LL				),
+		m_nWaiters(		0				),
+		m_nMatches(		0				),
+		m_nShared(		0				),
+		m_nWaits(		0				),
+		m_lock(			0				),
+		m_matchDone(	0				),
+		m_pNext(		NULL			)
+{
+	m_lock		= epicsMutexCreate( );
+	m_matchDone	= epicsEventCreate( epicsEventEmpty );
+}
+
+/// Destructor
+TSFifoEngine::~TSFifoEngine( )
+{
+	if ( m_lock )
+	{
+		epicsMutexDestroy( m_lock );
+		m_lock = 0;
+	}
+	if ( m_matchDone )
+	{
+		epicsEventDestroy( m_matchDone );
+		m_matchDone = 0;
+	}
+}
+
+
+bool TSFifoEngine::Accepts(
+	epicsUInt32				eventCode,
+	double					expDelay,
+	const TSFifoSim		*	pSim	) const
+{
+	if ( TS_FIFO_ENGINE_DELAY_TOL <= 0 || m_nSubscribers == 0 )
+		return false;
+	return	eventCode == m_eventCode
+		&&	pSim == m_pSim
+		&&	fabs( expDelay - m_expDelay ) <= TS_FIFO_ENGINE_DELAY_TOL;
+}
+
+
+bool TSFifoEngine::IsSameFrame( t_HiResTime tscFrame ) const
+{
+	t_HiResTime	tscDiff	= ( tscFrame > m_tscFrame ? tscFrame - m_tscFrame : m_tscFrame - tscFrame );
+	return HiResTicksToSeconds( tscDiff ) <= TS_FIFO_ENGINE_FRAME_TOL;
+}
+
+
+TSFifoEngine::MatchStatus TSFifoEngine::BeginMatch(
+	t_HiResTime				tscFrame,
+	epicsUInt32				genCount,
+	epicsUInt32				eventCode,
+	double					expDelay,
+	const TSFifoSim		*	pSim,
+	uint64_t			&	idx,
+	EventTimingData		&	fifoInfo	)
+{
+	epicsMutexLock( m_lock );
+	if ( !Accepts( eventCode, expDelay, pSim ) )
+	{
+		// Re-keyed or dropped since the caller read its engine
+		epicsMutexUnlock( m_lock );
+		return MATCH_OWN;
+	}
+	if ( m_fClaimed && m_genCount == genCount && IsSameFrame( tscFrame ) )
+	{
+		// Another port is matching our frame, wait for its result
+		t_HiResTime	tscWaitEnd	= GetHiResTicks()
+								+ static_cast<t_HiResTime>( TSFifoEngineWaitMax / HiResTicksToSeconds( 1LL ) );
+		m_nWaiters++;
+		m_nWaits++;
+		while ( m_fClaimed && m_genCount == genCount && IsSameFrame( tscFrame ) )
+		{
+			t_HiResTime	tscNow	= GetHiResTicks();
+			if ( tscNow >= tscWaitEnd )
+				break;
+			epicsMutexUnlock( m_lock );
+			epicsEventWaitWithTimeout( m_matchDone, HiResTicksToSeconds( tscWaitEnd - tscNow ) );
+			epicsMutexLock( m_lock );
+		}
+
+		// Pass the wakeup on to the next waiter
+		m_nWaiters--;
+		if ( m_nWaiters > 0 && !m_fClaimed )
+			epicsEventSignal( m_matchDone );
+		if ( !Accepts( eventCode, expDelay, pSim ) )
+		{
+			epicsMutexUnlock( m_lock );
+			return MATCH_OWN;
+		}
+	}
+
+	if ( m_fMatchValid && !m_fClaimed && m_genCount == genCount && IsSameFrame( tscFrame ) )
+	{
+		idx			= m_idx;
+		fifoInfo	= m_fifoInfo;
+		epicsMutexUnlock( m_lock );
+		return MATCH_SHARED;
+	}
+	if ( m_fClaimed )
+	{
+		// Still matching, or matching some other frame
+		epicsMutexUnlock( m_lock );
+		return MATCH_OWN;
+	}
+
+	m_fClaimed		= true;
+	m_fMatchValid	= false;
+	m_tscFrame		= tscFrame;
+	m_genCount		= genCount;
+	epicsMutexUnlock( m_lock );
+	return MATCH_CLAIMED;
+}
+
+
+void TSFifoEngine::EndMatch(
+	bool					fMatched,
+	uint64_t				idx,
+	const EventTimingData &	fifoInfo	)
+{
+	epicsMutexLock( m_lock );
+	if ( fMatched )
+	{
+		m_idx			= idx;
+		m_fifoInfo		= fifoInfo;
+		m_fMatchValid	= true;
+		m_nMatches++;
+	}
+	m_fClaimed	= false;
+	if ( m_nWaiters > 0 )
+		epicsEventSignal( m_matchDone );
+	epicsMutexUnlock( m_lock );
+}
+
+
+void TSFifoEngine::AddShared( )
+{
+	epicsMutexLock( m_lock );
+	m_nShared++;
+	epicsMutexUnlock( m_lock );
+}
+
+
+void TSFifoEngine::Show( int level ) const
+{
+	printf( "TSFifoEngine for event code %u, expDelay %.2fms%s\n",	m_eventCode, m_expDelay * 1000,
+			m_pSim != NULL ? ", simulated FIFO" : "" );
+	printf( "\tSubscribers:\t%u\n",	m_nSubscribers );
+	printf( "\tMatches:\t%u\n",		m_nMatches );
+	printf( "\tShared:\t\t%u\n",	m_nShared );
+	printf( "\tWaits:\t\t%u\n",	m_nWaits );
+	if ( level >= 1 && m_fMatchValid )
+		printf( "\tLast Match:\tfidFifo 0x%X, gen %u\n",
+				PULSEID( m_fifoInfo.fifo_time ), m_genCount );
+}
+
+
+TSFifoEngine	*	TSFifoEngine::Subscribe(
+	epicsUInt32				eventCode,
+	double					expDelay,
+	const TSFifoSim		*	pSim	)
+{
+	if ( eventCode == 0 || eventCode >= MRF_NUM_EVENTS || TS_FIFO_ENGINE_DELAY_TOL <= 0 )
+		return NULL;
+
+	epicsThreadOnce( &s_engineListOnce, EngineListInit, NULL );
+	epicsMutexLock( s_engineListLock );
+
+	TSFifoEngine	*	pEngine	= s_enginesByEventCode[eventCode];
+	TSFifoEngine	*	pIdle	= NULL;
+	for ( ; pEngine != NULL && !pEngine->Accepts( eventCode, expDelay, pSim ); pEngine = pEngine->m_pNext )
+	{
+		if ( pEngine->m_nSubscribers == 0 && pIdle == NULL )
+			pIdle	= pEngine;
+	}
+
+	if ( pEngine == NULL && pIdle != NULL )
+	{
+		// Re-key an idle engine rather than add one, unless a port that
+		// held it from before is still matching on it.  Nobody can claim
+		// it meanwhile, as BeginMatch only accepts subscribed engines.
+		epicsMutexLock( pIdle->m_lock );
+		if ( !pIdle->m_fClaimed )
+		{
+			pIdle->m_expDelay		= expDelay;
+			pIdle->m_pSim			= pSim;
+			pIdle->m_fMatchValid	= false;
+			pIdle->m_nMatches		= 0;
+			pIdle->m_nShared		= 0;
+			pIdle->m_nWaits			= 0;
+			pEngine	= pIdle;
+		}
+		epicsMutexUnlock( pIdle->m_lock );
+	}
+	if ( pEngine == NULL )
+	{
+		pEngine	= new TSFifoEngine( eventCode, expDelay, pSim );
+		if ( pEngine->m_lock == 0 || pEngine->m_matchDone == 0 )
+		{
+			printf( "TSFifoEngine: Unable to create engine due to epicsMutexCreate or epicsEventCreate error!\n" );
+			delete pEngine;
+			epicsMutexUnlock( s_engineListLock );
+			return NULL;
+		}
+		pEngine->m_pNext	= s_enginesByEventCode[eventCode];
+		s_enginesByEventCode[eventCode]	= pEngine;
+	}
+	epicsMutexLock( pEngine->m_lock );
+	pEngine->m_nSubscribers++;
+	epicsMutexUnlock( pEngine->m_lock );
+
+	epicsMutexUnlock( s_engineListLock );
+	return pEngine;
+}
+
+
+void TSFifoEngine::Unsubscribe( TSFifoEngine * pEngine )
+{
+	if ( pEngine == NULL )
+		return;
+
+	// Engines w/o subscribers are kept for re-keying, as ports may
+	// still be in BeginMatch on them
+	epicsMutexLock( s_engineListLock );
+	epicsMutexLock( pEngine->m_lock );
+	if ( pEngine->m_nSubscribers > 0 )
+		pEngine->m_nSubscribers--;
+	epicsMutexUnlock( pEngine->m_lock );
+	epicsMutexUnlock( s_engineListLock );
+}
+
+
+void TSFifoEngine::ShowAll( int level )
+{
+	printf( "TS_FIFO_ENGINE_DELAY_TOL:\t%.3fms%s\n",	TS_FIFO_ENGINE_DELAY_TOL * 1000,
+			TS_FIFO_ENGINE_DELAY_TOL <= 0 ? ", shared engines disabled" : "" );
+	printf( "TS_FIFO_ENGINE_FRAME_TOL:\t%.3fms\n",	TS_FIFO_ENGINE_FRAME_TOL * 1000 );
+	for ( unsigned int eventCode = 0; eventCode < MRF_NUM_EVENTS; eventCode++ )
+	{
+		for ( TSFifoEngine * pEngine = s_enginesByEventCode[eventCode]; pEngine != NULL; pEngine = pEngine->m_pNext )
+			pEngine->Show( level );
+	}
+}
+
+
+// Register shell callable functions with iocsh
+
+//	Register ShowTSFifoEngine
+static const	iocshArg		ShowTSFifoEngine_Arg0		= { "level",	iocshArgInt };
+static const	iocshArg	*	ShowTSFifoEngine_Args[1]	= { &ShowTSFifoEngine_Arg0 };
+static const	iocshFuncDef	ShowTSFifoEngine_FuncDef	= { "ShowTSFifoEngine", 1, ShowTSFifoEngine_Args };
+static void		ShowTSFifoEngine_CallFunc( const iocshArgBuf * args )
+{
+	TSFifoEngine::ShowAll( args[0].ival );
+}
+
+static void TSFifoEngine_Register( void )
+{
+	iocshRegister( &ShowTSFifoEngine_FuncDef,	ShowTSFifoEngine_CallFunc	);
+}
+epicsExportRegistrar( TSFifoEngine_Register );
+
+extern "C"
+{
+epicsExportAddress( double, TS_FIFO_ENGINE_DELAY_TOL );
+epicsExportAddress( double, TS_FIFO_ENGINE_FRAME_TOL );
+}
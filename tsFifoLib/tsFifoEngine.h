@@ -0,0 +1,162 @@
+#ifndef TSFIFO_ENGINE_H
+#define TSFIFO_ENGINE_H
+
+#include <stdint.h>
+#include "epicsMutex.h"
+#include "epicsEvent.h"
+#include "HiResTime.h"
+#include "timingFifoApi.h"
+
+///
+/// Header file for shared TSFifo sync engines
+///
+/// Ports that share an event code and expected delay, and stamp the same
+/// frame, all end up matching the same FIFO entry for it.  A TSFifoEngine
+/// lets them reuse that match opportunistically: the first subscribed port
+/// to run GetTimeStamp for a frame claims it, does the FIFO matching and
+/// publishes the matched entry.  Ports whose frames arrive within
+/// TS_FIFO_ENGINE_FRAME_TOL of it wait briefly for that entry and adopt it
+/// as long as it's in their own sync window.  Every port still runs its
+/// own sync, the engine only saves the FIFO reads for frames it has seen.
+/// Ports w/ a delay outside every engine's delay class get their own engine,
+/// which is the same as private matching.
+///
+/// Engines are keyed by event code, delay class and FIFO source, so ports
+/// on a simulated FIFO only share w/ ports on the same simulation.
+/// Engines are never deleted, so a port can use its engine w/o holding any
+/// lock.  An engine w/o subscribers is re-keyed for the next delay class
+/// that needs one, so there are never more engines than subscribed classes.
+///
+/// Engines are only used when TS_FIFO_ENGINE_DELAY_TOL is non-zero.
+///
+/// iocsh commands:
+///   ShowTSFifoEngine level	- Show all engines, their subscribers and matches
+///
+
+class	TSFifoSim;
+
+/// Max difference in seconds between a port's expected delay and an
+/// engine's for the port to share its matches.  0 disables shared engines.
+extern	double	TS_FIFO_ENGINE_DELAY_TOL;
+
+/// Max difference in seconds between two ports' GetTimeStamp calls for
+/// them to be stamping the same frame.  Keep it under half the fastest
+/// event period, so the next frame is never mistaken for this one.
+extern	double	TS_FIFO_ENGINE_FRAME_TOL;
+
+///
+/// TSFifoEngine holds the most recent matched FIFO entry for one
+/// event code and expected delay class
+///
+class	TSFifoEngine
+{
+public:
+	/// Constructor
+	TSFifoEngine(	epicsUInt32				eventCode,
+					double					expDelay,
+					const TSFifoSim		*	pSim	);
+
+	/// Destructor
+	virtual ~TSFifoEngine( );
+
+	/// Returns true if a port w/ this event code, delay and FIFO source
+	/// can share our matches.  The key only changes w/ both m_lock and the
+	/// engine list lock held, so hold either for an answer that stays true.
+	bool	Accepts(	epicsUInt32				eventCode,
+						double					expDelay,
+						const TSFifoSim		*	pSim	) const;
+
+	/// Result of BeginMatch
+	enum MatchStatus
+	{
+		MATCH_SHARED	= 0,	/// idx and fifoInfo hold the entry matched for this frame
+		MATCH_CLAIMED	= 1,	/// Caller matches this frame and must call EndMatch
+		MATCH_OWN		= 2		/// Caller matches this frame on its own
+	};
+
+	/// BeginMatch()
+	/// Fetch the entry matched for a frame at tscFrame.  If another port
+	/// is matching the same frame, wait briefly for its result.  If nobody
+	/// is, the caller claims the frame and must publish w/ EndMatch.
+	/// Returns MATCH_OWN if the engine no longer accepts the caller's
+	/// event code, delay and FIFO source, e.g. it was re-keyed.
+	/// The engine isn't locked while the matching port reads the FIFO.
+	/// Call it before taking the port's own lock, as it can wait.
+	MatchStatus	BeginMatch(	t_HiResTime				tscFrame,
+							epicsUInt32				genCount,
+							epicsUInt32				eventCode,
+							double					expDelay,
+							const TSFifoSim		*	pSim,
+							uint64_t			&	idx,
+							EventTimingData		&	fifoInfo	);
+
+	/// EndMatch()
+	/// Publish the result of a claimed match, w/ fMatched false if there's none
+	void	EndMatch(	bool					fMatched,
+						uint64_t				idx,
+						const EventTimingData &	fifoInfo	);
+
+	/// AddShared()
+	/// Count a shared match that a port accepted
+	void	AddShared( );
+
+	/// Show()
+	/// Display pertinent TSFifoEngine info on stdout
+	void	Show( int level ) const;
+
+	epicsUInt32		GetEventCode( ) const
+	{
+		return m_eventCode;
+	}
+
+	double			GetExpDelay( ) const
+	{
+		return m_expDelay;
+	}
+
+	unsigned int	GetSubscriberCount( ) const
+	{
+		return m_nSubscribers;
+	}
+
+	epicsUInt32		GetSharedCount( ) const
+	{
+		return m_nShared;
+	}
+
+public:		//  Public class functions
+	/// Subscribe()
+	/// Find, re-key or create the engine for this event code, delay and
+	/// FIFO source, NULL for the timing driver
+	static	TSFifoEngine *	Subscribe(		epicsUInt32				eventCode,
+											double					expDelay,
+											const TSFifoSim		*	pSim	);
+	static	void			Unsubscribe(	TSFifoEngine *	pEngine		);
+
+	static	void			ShowAll( int level );
+
+private:	//  Private member functions
+	/// Returns true if tscFrame is close enough to m_tscFrame to be the same frame
+	bool	IsSameFrame( t_HiResTime tscFrame ) const;
+
+private:	//  Private member variables
+	epicsUInt32				m_eventCode;
+	double					m_expDelay;
+	const TSFifoSim		*	m_pSim;			/// FIFO source, NULL for the timing driver
+	unsigned int			m_nSubscribers;
+	bool					m_fClaimed;		/// A port is matching m_tscFrame now
+	bool					m_fMatchValid;
+	t_HiResTime				m_tscFrame;		/// Frame the match was claimed for
+	epicsUInt32				m_genCount;		/// Generation the match was made on
+	uint64_t				m_idx;
+	EventTimingData			m_fifoInfo;
+	unsigned int			m_nWaiters;		/// Ports waiting on the claimed match
+	epicsUInt32				m_nMatches;		/// Matches published
+	epicsUInt32				m_nShared;		/// Matches adopted by other ports
+	epicsUInt32				m_nWaits;		/// Ports that waited on a claimed match
+	epicsMutexId			m_lock;
+	epicsEventId			m_matchDone;	/// Signaled when a claimed match is published
+	TSFifoEngine		*	m_pNext;		/// Next engine for the same event code
+};
+
+#endif  //  TSFIFO_ENGINE_H
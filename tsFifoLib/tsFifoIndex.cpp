@@ -0,0 +1,494 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iocsh.h>
+#include <epicsThread.h>
+#include <epicsExport.h>
+
+#include "evrTime.h"
+#include "mrfCommon.h"
+#include "tsFifoIndex.h"
+#include "tsFifoRead.h"
+
+using namespace		std;
+
+/// Poll period for keeping the indices ahead of FIFO wraparound
+/// MAX_TS_QUEUE entries at 360Hz wrap in about 1.4sec
+static const double		TSFifoIndexPollPeriod	= 0.25;
+
+/// Indices by event code.  Indices are never deleted, so a pointer read
+/// under s_indexLock stays valid after it's released.
+static TSFifoIndex	*	s_indexByEventCode[ MRF_NUM_EVENTS ];
+static bool				s_pollThreadStarted	= false;
+
+/// Serializes s_indexByEventCode and s_pollThreadStarted
+static epicsMutexId			s_indexLock	= 0;
+static epicsThreadOnceId	s_indexOnce	= EPICS_THREAD_ONCE_INIT;
+
+static void IndexLockInit( void * )
+{
+	s_indexLock	= epicsMutexMustCreate( );
+}
+
+/// Max FIFO entries fetched per TSFifoReadRange call
+#define	TSFifoIndexReadChunk	32
+
+/// Compare timestamps, ignoring the pulse id in the nsec field
+static inline bool TimeLessOrEqual( const epicsTimeStamp & t1, const epicsTimeStamp & t2 )
+{
+	if ( t1.secPastEpoch != t2.secPastEpoch )
+		return t1.secPastEpoch < t2.secPastEpoch;
+	return ( t1.nsec & ~PULSEID_INVALID ) <= ( t2.nsec & ~PULSEID_INVALID );
+}
+
+
+/// Constructor for TSFifoIndex
+TSFifoIndex::TSFifoIndex(
+	epicsUInt32				eventCode,
+	double					depthMinutes,
+	const TSFifoSim		*	pSim	)
+	:	m_eventCode(	eventCode		),
+		m_depthMinutes(	depthMinutes	),
+		m_pSim(			pSim			),
+		m_capacity(		MAX_TS_QUEUE	),
+		m_head(			0				),
+		m_count(		0				),
+		m_idx(			0LL				),
+		m_tscUpdated(	0LL				),
+		m_fStarted(		false			),
+		m_nLost(		0				),
+		m_lock(			0				)
+{
+	size_t	capacity	= static_cast<size_t>( depthMinutes * 60 * 360 );
+	if ( m_capacity < capacity )
+		m_capacity	= capacity;
+	m_tsc.resize(		m_capacity	);
+	m_pulseId.resize(	m_capacity	);
+	m_time.resize(		m_capacity	);
+	m_resyncBuf.resize(	MAX_TS_QUEUE	);
+	m_timeUpdated.secPastEpoch	= 0;
+	m_timeUpdated.nsec			= 0;
+	m_lock	= epicsMutexCreate( );
+}
+
+/// Destructor
+TSFifoIndex::~TSFifoIndex( )
+{
+	if ( m_lock )
+	{
+		epicsMutexDestroy( m_lock );
+		m_lock = 0;
+	}
+}
+
+
+/// AddEntry:  Append a FIFO entry, overwriting the oldest when full
+/// Must be called w/ m_lock mutex locked!
+void TSFifoIndex::AddEntry( const EventTimingData & fifoInfo )
+{
+	// Keep the arrays sorted by tsc
+	if ( m_count > 0 && fifoInfo.fifo_tsc <= m_tsc[ RingIndex( m_count - 1 ) ] )
+		return;
+
+	size_t	iRing;
+	if ( m_count < m_capacity )
+	{
+		iRing	= RingIndex( m_count );
+		m_count++;
+	}
+	else
+	{
+		iRing	= m_head;
+		m_head	= ( m_head + 1 ) % m_capacity;
+	}
+	m_tsc[iRing]		= fifoInfo.fifo_tsc;
+	m_pulseId[iRing]	= PULSEID( fifoInfo.fifo_time );
+	m_time[iRing]		= fifoInfo.fifo_time;
+}
+
+
+unsigned int TSFifoIndex::Update( )
+{
+	EventTimingData		fifoInfo;
+	unsigned int		nAdded	= 0;
+
+	// Every event before now is in the FIFO by the time we drain it
+	t_HiResTime			tscUpdate	= GetHiResTicks();
+	epicsTimeStamp		timeUpdate;
+	epicsTimeGetCurrent( &timeUpdate );
+
+	epicsMutexLock( m_lock );
+	if ( !m_fStarted )
+	{
+		// Start w/ everything still in the FIFO
+		nAdded	= Resync( 0 );
+		if ( nAdded == 0 )
+		{
+			epicsMutexUnlock( m_lock );
+			return 0;
+		}
+		m_fStarted	= true;
+	}
+
+	EventTimingData		fifoBuf[TSFifoIndexReadChunk];
+	unsigned int		nRead;
+	do
+	{
+		nRead	= TSFifoReadRange( m_eventCode, 1, &m_idx, fifoBuf, NULL, TSFifoIndexReadChunk, m_pSim );
+		for ( unsigned int i = 0; i < nRead; i++ )
+			AddEntry( fifoBuf[i] );
+		nAdded	+= nRead;
+	}	while ( nRead == TSFifoIndexReadChunk );
+
+	if ( nAdded == 0 )
+	{
+		// Nothing new, or our cursor fell out of the FIFO
+		// If there's a newer entry than our cursor we couldn't read the
+		// next one, so we've been lapped, however deep the FIFO is
+		uint64_t	idxNewest	= m_idx;
+		if (	TSFifoRead( m_eventCode, MAX_TS_QUEUE, &idxNewest, &fifoInfo, m_pSim ) == 0
+			&&	idxNewest > m_idx )
+			nAdded	= Resync( m_idx );
+	}
+	m_tscUpdated	= tscUpdate;
+	m_timeUpdated	= timeUpdate;
+	epicsMutexUnlock( m_lock );
+	return nAdded;
+}
+
+
+/// Resync:  Restart our FIFO cursor from the most recent entry, adding
+/// the entries still in the FIFO after idxLast, oldest first
+/// Returns the number of entries added
+/// Must be called w/ m_lock mutex locked!
+unsigned int TSFifoIndex::Resync( uint64_t idxLast )
+{
+	uint64_t		idxNewest	= idxLast;
+	if ( TSFifoRead( m_eventCode, MAX_TS_QUEUE, &idxNewest, &m_resyncBuf[0], m_pSim ) != 0 )
+		return 0;
+	if ( idxNewest <= idxLast )
+		return 0;
+
+	// Read back to the oldest entry we need in one range
+	uint64_t		nNeeded	= idxNewest - idxLast;
+	unsigned int	nMax	= static_cast<unsigned int>( nNeeded < MAX_TS_QUEUE ? nNeeded : MAX_TS_QUEUE );
+	uint64_t		idx		= idxNewest;
+	unsigned int	nRead	= 1;
+	if ( nMax > 1 )
+		nRead	+= TSFifoReadRange( m_eventCode, -1, &idx, &m_resyncBuf[1], NULL, nMax - 1, m_pSim );
+	for ( unsigned int i = nRead; i > 0; i-- )
+		AddEntry( m_resyncBuf[i - 1] );
+
+	if ( idxLast != 0 )
+		m_nLost	+= static_cast<epicsUInt32>( nNeeded - nRead );
+	m_idx	= idxNewest;
+	return nRead;
+}
+
+
+/// FindTsc:  Binary search for the most recent entry at or before tsc
+/// Must be called w/ m_lock mutex locked!
+int TSFifoIndex::FindTsc( t_HiResTime tsc ) const
+{
+	if ( m_count == 0 || tsc < m_tsc[ RingIndex( 0 ) ] )
+		return -1;
+
+	size_t	lo	= 0;
+	size_t	hi	= m_count;
+	while ( hi - lo > 1 )
+	{
+		size_t	mid	= lo + ( hi - lo ) / 2;
+		if ( m_tsc[ RingIndex( mid ) ] <= tsc )
+			lo	= mid;
+		else
+			hi	= mid;
+	}
+	return static_cast<int>( lo );
+}
+
+
+/// FindTime:  Binary search for the most recent entry at or before time
+/// Must be called w/ m_lock mutex locked!
+int TSFifoIndex::FindTime( const epicsTimeStamp & time ) const
+{
+	if ( m_count == 0 || !TimeLessOrEqual( m_time[ RingIndex( 0 ) ], time ) )
+		return -1;
+
+	size_t	lo	= 0;
+	size_t	hi	= m_count;
+	while ( hi - lo > 1 )
+	{
+		size_t	mid	= lo + ( hi - lo ) / 2;
+		if ( TimeLessOrEqual( m_time[ RingIndex( mid ) ], time ) )
+			lo	= mid;
+		else
+			hi	= mid;
+	}
+	return static_cast<int>( lo );
+}
+
+
+int TSFifoIndex::LookupByTsc(
+	t_HiResTime				tsc,
+	epicsTimeStamp		*	pTimeStampRet,
+	t_HiResTime			*	pTscRet	)
+{
+	if ( pTimeStampRet == NULL )
+		return -1;
+
+	epicsMutexLock( m_lock );
+	int		i	= -1;
+	if ( m_fStarted && tsc <= m_tscUpdated )
+		i	= FindTsc( tsc );
+	if ( i >= 0 )
+	{
+		*pTimeStampRet	= m_time[ RingIndex( i ) ];
+		if ( pTscRet != NULL )
+			*pTscRet	= m_tsc[ RingIndex( i ) ];
+	}
+	epicsMutexUnlock( m_lock );
+	return i >= 0 ? 0 : -1;
+}
+
+
+int TSFifoIndex::LookupByTime(
+	const epicsTimeStamp *	pTime,
+	epicsTimeStamp		*	pTimeStampRet,
+	t_HiResTime			*	pTscRet	)
+{
+	if ( pTime == NULL || pTimeStampRet == NULL )
+		return -1;
+
+	epicsMutexLock( m_lock );
+	int		i	= -1;
+	if ( m_fStarted && TimeLessOrEqual( *pTime, m_timeUpdated ) )
+		i	= FindTime( *pTime );
+	if ( i >= 0 )
+	{
+		*pTimeStampRet	= m_time[ RingIndex( i ) ];
+		if ( pTscRet != NULL )
+			*pTscRet	= m_tsc[ RingIndex( i ) ];
+	}
+	epicsMutexUnlock( m_lock );
+	return i >= 0 ? 0 : -1;
+}
+
+
+void TSFifoIndex::Show( int level ) const
+{
+	epicsMutexLock( m_lock );
+	printf( "TSFifoIndex for event code %u\n",	m_eventCode );
+	printf( "\tDepth:\t\t%.1f min, %zu entries\n",	m_depthMinutes, m_capacity );
+	printf( "\tEntries:\t%zu\n",	m_count );
+	printf( "\tLost:\t\t%u\n",		m_nLost );
+	if ( level >= 1 && m_count > 0 )
+	{
+		size_t	iOld	= RingIndex( 0 );
+		size_t	iNew	= RingIndex( m_count - 1 );
+		double	span	= HiResTicksToSeconds( m_tsc[iNew] - m_tsc[iOld] );
+		printf( "\tOldest:\ttsc %llu, fid 0x%X\n",	m_tsc[iOld], m_pulseId[iOld] );
+		printf( "\tNewest:\ttsc %llu, fid 0x%X\n",	m_tsc[iNew], m_pulseId[iNew] );
+		printf( "\tSpan:\t\t%.3f sec\n",	span );
+	}
+	epicsMutexUnlock( m_lock );
+}
+
+
+TSFifoIndex	*	TSFifoIndex::Configure(
+	epicsUInt32				eventCode,
+	double					depthMinutes,
+	const TSFifoSim		*	pSim	)
+{
+	if ( eventCode == 0 || eventCode >= MRF_NUM_EVENTS || depthMinutes <= 0 )
+		return NULL;
+
+	epicsThreadOnce( &s_indexOnce, IndexLockInit, NULL );
+	epicsMutexLock( s_indexLock );
+	if ( s_indexByEventCode[eventCode] != NULL )
+	{
+		TSFifoIndex	*	pIndex	= s_indexByEventCode[eventCode];
+		epicsMutexUnlock( s_indexLock );
+		printf( "TSFifoIndex: Event code %u already indexed\n", eventCode );
+		return pIndex;
+	}
+
+	TSFifoIndex	*	pIndex	= new TSFifoIndex( eventCode, depthMinutes, pSim );
+	if ( pIndex->m_lock == 0 )
+	{
+		epicsMutexUnlock( s_indexLock );
+		printf( "TSFifoIndex: Unable to create index due to epicsMutexCreate error!\n" );
+		delete pIndex;
+		return NULL;
+	}
+	s_indexByEventCode[eventCode]	= pIndex;
+
+	if ( !s_pollThreadStarted )
+	{
+		s_pollThreadStarted	= true;
+		epicsThreadCreate(	"TSFifoIndex", epicsThreadPriorityMedium,
+							epicsThreadGetStackSize( epicsThreadStackSmall ),
+							TSFifoIndex::PollThread, NULL );
+	}
+	epicsMutexUnlock( s_indexLock );
+	return pIndex;
+}
+
+
+TSFifoIndex	*	TSFifoIndex::FindByEventCode( epicsUInt32 eventCode )
+{
+	if ( eventCode >= MRF_NUM_EVENTS )
+		return NULL;
+	epicsThreadOnce( &s_indexOnce, IndexLockInit, NULL );
+	epicsMutexLock( s_indexLock );
+	TSFifoIndex	*	pIndex	= s_indexByEventCode[eventCode];
+	epicsMutexUnlock( s_indexLock );
+	return pIndex;
+}
+
+
+void TSFifoIndex::ShowAll( int level )
+{
+	for ( unsigned int eventCode = 0; eventCode < MRF_NUM_EVENTS; eventCode++ )
+	{
+		TSFifoIndex	*	pIndex	= FindByEventCode( eventCode );
+		if ( pIndex != NULL )
+			pIndex->Show( level );
+	}
+}
+
+
+/// PollThread:  Keeps all indices drained between frames so slow
+/// data sources don't lose entries to FIFO wraparound.
+/// This is the only place indices are updated, so GetTimeStamp and
+/// lookups never drain the FIFO themselves.
+void TSFifoIndex::PollThread( void * )
+{
+	while ( true )
+	{
+		for ( unsigned int eventCode = 0; eventCode < MRF_NUM_EVENTS; eventCode++ )
+		{
+			TSFifoIndex	*	pIndex	= FindByEventCode( eventCode );
+			if ( pIndex != NULL )
+				pIndex->Update( );
+		}
+		epicsThreadSleep( TSFifoIndexPollPeriod );
+	}
+}
+
+
+extern "C" int TSFifoIndexConfig(
+	epicsUInt32				eventCode,
+	double					depthMinutes	)
+{
+	return TSFifoIndex::Configure( eventCode, depthMinutes ) != NULL ? 0 : -1;
+}
+
+extern "C" int TSFifoIndexLookupByTsc(
+	epicsUInt32				eventCode,
+	t_HiResTime				tsc,
+	epicsTimeStamp		*	pTimeStampRet	)
+{
+	TSFifoIndex	*	pIndex	= TSFifoIndex::FindByEventCode( eventCode );
+	if ( pIndex == NULL )
+		return -1;
+	return pIndex->LookupByTsc( tsc, pTimeStampRet );
+}
+
+extern "C" int TSFifoIndexLookupByTime(
+	epicsUInt32				eventCode,
+	const epicsTimeStamp *	pTime,
+	epicsTimeStamp		*	pTimeStampRet	)
+{
+	TSFifoIndex	*	pIndex	= TSFifoIndex::FindByEventCode( eventCode );
+	if ( pIndex == NULL )
+		return -1;
+	return pIndex->LookupByTime( pTime, pTimeStampRet );
+}
+
+
+// Register shell callable functions with iocsh
+
+static void ShowLookupResult( int status, epicsUInt32 eventCode, const epicsTimeStamp & ts )
+{
+	if ( status != 0 )
+	{
+		printf( "Not found in TSFifoIndex for event code %u\n", eventCode );
+		return;
+	}
+	char		acBuff[40];
+	epicsTimeToStrftime( acBuff, 40, "%Y-%m-%d %H:%M:%S.%06f", &ts );
+	printf( "ts %s, fid 0x%X\n", acBuff, PULSEID(ts) );
+}
+
+//	Register TSFifoIndexConfig
+static const	iocshArg		TSFifoIndexConfig_Arg0		= { "eventCode",	iocshArgInt };
+static const	iocshArg		TSFifoIndexConfig_Arg1		= { "depthMinutes",	iocshArgDouble };
+static const	iocshArg	*	TSFifoIndexConfig_Args[2]	= { &TSFifoIndexConfig_Arg0, &TSFifoIndexConfig_Arg1 };
+static const	iocshFuncDef	TSFifoIndexConfig_FuncDef	= { "TSFifoIndexConfig", 2, TSFifoIndexConfig_Args };
+static void		TSFifoIndexConfig_CallFunc( const iocshArgBuf * args )
+{
+	if ( args[0].ival <= 0 || args[1].dval <= 0 )
+	{
+		printf( "Usage: TSFifoIndexConfig eventCode depthMinutes\n" );
+		return;
+	}
+	if ( TSFifoIndexConfig( args[0].ival, args[1].dval ) != 0 )
+		printf( "Error: Unable to index event code %d\n", args[0].ival );
+}
+
+//	Register TSFifoIndexQuery
+static const	iocshArg		TSFifoIndexQuery_Arg0		= { "eventCode",	iocshArgInt };
+static const	iocshArg		TSFifoIndexQuery_Arg1		= { "tsc",			iocshArgString };
+static const	iocshArg	*	TSFifoIndexQuery_Args[2]	= { &TSFifoIndexQuery_Arg0, &TSFifoIndexQuery_Arg1 };
+static const	iocshFuncDef	TSFifoIndexQuery_FuncDef	= { "TSFifoIndexQuery", 2, TSFifoIndexQuery_Args };
+static void		TSFifoIndexQuery_CallFunc( const iocshArgBuf * args )
+{
+	if ( args[0].ival <= 0 || args[1].sval == 0 )
+	{
+		printf( "Usage: TSFifoIndexQuery eventCode tsc\n" );
+		return;
+	}
+	t_HiResTime		tsc	= strtoull( args[1].sval, NULL, 0 );
+	epicsTimeStamp	ts;
+	int	status	= TSFifoIndexLookupByTsc( args[0].ival, tsc, &ts );
+	ShowLookupResult( status, args[0].ival, ts );
+}
+
+//	Register TSFifoIndexQueryTime
+static const	iocshArg		TSFifoIndexQueryTime_Arg0	= { "eventCode",	iocshArgInt };
+static const	iocshArg		TSFifoIndexQueryTime_Arg1	= { "secondsAgo",	iocshArgDouble };
+static const	iocshArg	*	TSFifoIndexQueryTime_Args[2]= { &TSFifoIndexQueryTime_Arg0, &TSFifoIndexQueryTime_Arg1 };
+static const	iocshFuncDef	TSFifoIndexQueryTime_FuncDef= { "TSFifoIndexQueryTime", 2, TSFifoIndexQueryTime_Args };
+static void		TSFifoIndexQueryTime_CallFunc( const iocshArgBuf * args )
+{
+	if ( args[0].ival <= 0 )
+	{
+		printf( "Usage: TSFifoIndexQueryTime eventCode secondsAgo\n" );
+		return;
+	}
+	epicsTimeStamp	when;
+	epicsTimeStamp	ts;
+	epicsTimeGetCurrent( &when );
+	epicsTimeAddSeconds( &when, -args[1].dval );
+	int	status	= TSFifoIndexLookupByTime( args[0].ival, &when, &ts );
+	ShowLookupResult( status, args[0].ival, ts );
+}
+
+//	Register ShowTSFifoIndex
+static const	iocshArg		ShowTSFifoIndex_Arg0		= { "level",	iocshArgInt };
+static const	iocshArg	*	ShowTSFifoIndex_Args[1]		= { &ShowTSFifoIndex_Arg0 };
+static const	iocshFuncDef	ShowTSFifoIndex_FuncDef		= { "ShowTSFifoIndex", 1, ShowTSFifoIndex_Args };
+static void		ShowTSFifoIndex_CallFunc( const iocshArgBuf * args )
+{
+	TSFifoIndex::ShowAll( args[0].ival );
+}
+
+static void TSFifoIndex_Register( void )
+{
+	iocshRegister( &TSFifoIndexConfig_FuncDef,		TSFifoIndexConfig_CallFunc		);
+	iocshRegister( &TSFifoIndexQuery_FuncDef,		TSFifoIndexQuery_CallFunc		);
+	iocshRegister( &TSFifoIndexQueryTime_FuncDef,	TSFifoIndexQueryTime_CallFunc	);
+	iocshRegister( &ShowTSFifoIndex_FuncDef,		ShowTSFifoIndex_CallFunc		);
+}
+epicsExportRegistrar( TSFifoIndex_Register );
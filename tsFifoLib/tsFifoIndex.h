@@ -0,0 +1,135 @@
+#ifndef TSFIFO_INDEX_H
+#define TSFIFO_INDEX_H
+
+#include <vector>
+#include "epicsTime.h"
+#include "epicsMutex.h"
+#include "HiResTime.h"
+#include "timingFifoApi.h"
+
+class	TSFifoSim;
+
+///
+/// Header file for the pulse id correlation index
+///
+/// The EVR FIFO only holds the last MAX_TS_QUEUE entries for each event
+/// code, so data that arrives late can't be matched to a pulse id once the
+/// FIFO has wrapped.  A TSFifoIndex keeps a compact history of the FIFO
+/// entries for one event code, covering a configurable number of minutes,
+/// so frames can be mapped back to a pulse id by TSC or approximate time
+/// long after GetTimeStamp ran.
+///
+
+///
+/// C API for pulse id lookups
+/// All return 0 on success, or -1 if the event code isn't indexed or the
+/// requested TSC or time isn't covered by the index.  Indices are updated
+/// every 0.25 sec by a poll thread, so the most recent events may not be
+/// covered yet.
+/// On success, pTimeStampRet is set to the timestamp of the most recent
+/// event at or before the requested TSC or time.
+///
+extern "C" int	TSFifoIndexConfig(			epicsUInt32				eventCode,
+											double					depthMinutes	);
+extern "C" int	TSFifoIndexLookupByTsc(		epicsUInt32				eventCode,
+											t_HiResTime				tsc,
+											epicsTimeStamp		*	pTimeStampRet	);
+extern "C" int	TSFifoIndexLookupByTime(	epicsUInt32				eventCode,
+											const epicsTimeStamp *	pTime,
+											epicsTimeStamp		*	pTimeStampRet	);
+
+///
+/// TSFifoIndex holds sorted arrays of fifo_tsc, pulse id and timestamp
+/// for one event code in a fixed size ring, so lookups are a binary search.
+///
+class	TSFifoIndex
+{
+public:
+	/// Constructor
+	/// depthMinutes sets the ring capacity, assuming a 360Hz event rate
+	/// If pSim is provided, entries come from the simulated FIFO
+	TSFifoIndex(	epicsUInt32				eventCode,
+					double					depthMinutes,
+					const TSFifoSim		*	pSim = NULL	);
+
+	/// Destructor
+	virtual ~TSFifoIndex( );
+
+	/// Update()
+	/// Drain any new entries for our event code from the timing FIFO
+	/// Called from the poll thread.
+	/// Returns the number of entries added
+	unsigned int	Update( );
+
+	/// LookupByTsc()
+	/// Find the most recent event at or before tsc
+	/// Returns 0 on success, -1 if tsc predates the index or is newer
+	/// than its last update
+	int		LookupByTsc(	t_HiResTime				tsc,
+							epicsTimeStamp		*	pTimeStampRet,
+							t_HiResTime			*	pTscRet	= NULL	);
+
+	/// LookupByTime()
+	/// Find the most recent event at or before pTime
+	/// Returns 0 on success, -1 if pTime predates the index or is newer
+	/// than its last update
+	int		LookupByTime(	const epicsTimeStamp *	pTime,
+							epicsTimeStamp		*	pTimeStampRet,
+							t_HiResTime			*	pTscRet	= NULL	);
+
+	/// Show()
+	/// Display pertinent TSFifoIndex info on stdout
+	void	Show( int level ) const;
+
+	epicsUInt32		GetEventCode( ) const
+	{
+		return m_eventCode;
+	}
+
+public:		//  Public class functions
+	static	TSFifoIndex	*	Configure(	epicsUInt32				eventCode,
+										double					depthMinutes,
+										const TSFifoSim		*	pSim = NULL	);
+
+	static	TSFifoIndex	*	FindByEventCode( epicsUInt32 eventCode );
+
+	static	void			ShowAll( int level );
+
+private:	//  Private member functions
+	void	AddEntry(	const EventTimingData	&	fifoInfo	);
+	unsigned int	Resync(	uint64_t	idxLast	);
+
+	/// Return the logical index of the most recent entry w/ tsc at or before
+	/// the requested tsc, or -1 if none.  Must be called w/ m_lock held.
+	int		FindTsc(	t_HiResTime		tsc		) const;
+	int		FindTime(	const epicsTimeStamp	&	time	) const;
+
+	/// Map a logical index, 0 = oldest, to a ring buffer index
+	size_t	RingIndex( size_t	i	) const
+	{
+		return ( m_head + i ) % m_capacity;
+	}
+
+private:	//  Private class functions
+	static	void	PollThread( void * );
+
+private:	//  Private member variables
+	epicsUInt32					m_eventCode;
+	double						m_depthMinutes;
+	const TSFifoSim			*	m_pSim;			/// Simulated FIFO, or NULL for the timing driver
+	size_t						m_capacity;
+	size_t						m_head;			/// Ring index of the oldest entry
+	size_t						m_count;
+	uint64_t					m_idx;			/// Timing FIFO cursor
+	t_HiResTime					m_tscUpdated;	/// TSC of the last Update, all earlier events are indexed
+	epicsTimeStamp				m_timeUpdated;	/// Time of the last Update
+	bool						m_fStarted;
+	epicsUInt32					m_nLost;		/// Entries lost to FIFO wraparound
+	std::vector<t_HiResTime>	m_tsc;
+	std::vector<epicsUInt32>	m_pulseId;
+	std::vector<epicsTimeStamp>	m_time;
+	std::vector<EventTimingData>	m_resyncBuf;	/// Entries read back by Resync
+	epicsMutexId				m_lock;
+};
+
+#endif  //  TSFIFO_INDEX_H
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "cantProceed.h"
+#include "epicsExport.h"
+#include "registryFunction.h"
+#include "NDAttribute.h"
+#include "timeStampFifo.h"
+
+///
+/// NDAttribute function for TSFifo sync quality
+///
+/// Use as a FUNCT attribute in an areaDetector attributes file, e.g.
+///   <Attribute name="TSSyncType" type="FUNCT" source="TSFifoSyncAttr"
+///              param="CAM SyncType" datatype="INT" description="TSFifo sync type"/>
+/// param is the TSFifo port name followed by one of:
+///   PulseId, SyncType, DiffVsExp, FifoReads or Generation
+/// Values are for the last frame the calling thread timestamped on the
+/// port, so the driver must call updateTimeStamp before getAttributes,
+/// from the same thread, as areaDetector drivers do.
+///
+
+enum TSFifoSyncAttrField	{ SYNC_ATTR_PULSE_ID, SYNC_ATTR_SYNC_TYPE, SYNC_ATTR_DIFF_VS_EXP,
+							  SYNC_ATTR_FIFO_READS, SYNC_ATTR_GENERATION };
+
+static const struct
+{
+	const char			*	pName;
+	TSFifoSyncAttrField		field;
+}	s_syncAttrFields[]	=
+{
+	{ "PulseId",	SYNC_ATTR_PULSE_ID		},
+	{ "SyncType",	SYNC_ATTR_SYNC_TYPE		},
+	{ "DiffVsExp",	SYNC_ATTR_DIFF_VS_EXP	},
+	{ "FifoReads",	SYNC_ATTR_FIFO_READS	},
+	{ "Generation",	SYNC_ATTR_GENERATION	}
+};
+
+struct TSFifoSyncAttrPvt
+{
+	char					portName[TSFIFO_PORT_NAME_MAX];
+	TSFifoSyncAttrField		field;
+};
+
+
+static int TSFifoSyncAttr(
+	const char		*	paramString,
+	void			**	functionPvt,
+	NDAttribute		*	pAttribute	)
+{
+	const char			*	functionName	= "TSFifoSyncAttr";
+	TSFifoSyncAttrPvt	*	pPvt			= static_cast<TSFifoSyncAttrPvt *>( *functionPvt );
+	if ( pPvt == NULL )
+	{
+		// First call, parse the port name and field once
+		char			portName[TSFIFO_PORT_NAME_MAX];
+		char			fieldName[32];
+		if (	paramString == NULL
+			||	sscanf( paramString, "%63s %31s", portName, fieldName ) != 2 )
+		{
+			printf( "Error %s: param must be \"portName field\"\n", functionName );
+			return -1;
+		}
+
+		unsigned int	nFields	= sizeof(s_syncAttrFields) / sizeof(s_syncAttrFields[0]);
+		unsigned int	i;
+		for ( i = 0; i < nFields; i++ )
+		{
+			if ( strcmp( fieldName, s_syncAttrFields[i].pName ) == 0 )
+				break;
+		}
+		if ( i >= nFields )
+		{
+			printf( "Error %s: Unknown field %s\n", functionName, fieldName );
+			return -1;
+		}
+
+		pPvt	= static_cast<TSFifoSyncAttrPvt *>( callocMustSucceed( 1, sizeof(TSFifoSyncAttrPvt), functionName ) );
+		strcpy( pPvt->portName, portName );
+		pPvt->field		= s_syncAttrFields[i].field;
+		*functionPvt	= pPvt;
+	}
+
+	TSFifoSyncInfo		syncInfo;
+	if ( TSFifoGetSyncInfo( pPvt->portName, &syncInfo ) != 0 )
+		return -1;
+
+	switch ( pPvt->field )
+	{
+	case SYNC_ATTR_PULSE_ID:
+		pAttribute->setDataType( NDAttrUInt32 );
+		pAttribute->setValue( &syncInfo.pulseId );
+		break;
+	case SYNC_ATTR_SYNC_TYPE:
+		{
+		epicsInt32	syncType	= syncInfo.syncType;
+		pAttribute->setDataType( NDAttrInt32 );
+		pAttribute->setValue( &syncType );
+		}
+		break;
+	case SYNC_ATTR_DIFF_VS_EXP:
+		pAttribute->setDataType( NDAttrInt64 );
+		pAttribute->setValue( &syncInfo.diffVsExp );
+		break;
+	case SYNC_ATTR_FIFO_READS:
+		pAttribute->setDataType( NDAttrUInt32 );
+		pAttribute->setValue( &syncInfo.nFifoReads );
+		break;
+	case SYNC_ATTR_GENERATION:
+		pAttribute->setDataType( NDAttrUInt32 );
+		pAttribute->setValue( &syncInfo.generation );
+		break;
+	}
+	return 0;
+}
+
+
+extern "C"
+{
+epicsRegisterFunction(	TSFifoSyncAttr	);
+}
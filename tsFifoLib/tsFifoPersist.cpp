@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <iocsh.h>
+#include <epicsExport.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+
+#include "HiResTime.h"
+#include "timeStampFifo.h"
+#include "tsFifoPersist.h"
+
+static char					s_persistDir[TSFIFO_PERSIST_DIR_MAX]	= "";
+static double				s_persistPeriod		= TSFIFO_PERSIST_PERIOD_DEFAULT;
+static bool					s_saveThreadStarted	= false;
+static epicsMutexId			s_persistLock		= 0;
+static epicsThreadOnceId	s_persistOnce		= EPICS_THREAD_ONCE_INIT;
+
+static void PersistLockInit( void * )
+{
+	s_persistLock	= epicsMutexMustCreate( );
+}
+
+
+/// PersistPath:  Build the file path for pPortName in the persist dir
+/// Returns false if there's no persist dir or the path doesn't fit
+static bool PersistPath(
+	const char	*	pPortName,
+	const char	*	pSuffix,
+	char		*	pPath,
+	size_t			pathSize	)
+{
+	epicsThreadOnce( &s_persistOnce, PersistLockInit, NULL );
+	epicsMutexLock( s_persistLock );
+	int		len	= 0;
+	if ( s_persistDir[0] != '\0' )
+		len	= snprintf( pPath, pathSize, "%s/%s.tsfifo%s", s_persistDir, pPortName, pSuffix );
+	epicsMutexUnlock( s_persistLock );
+	return ( len > 0 && static_cast<size_t>(len) < pathSize );
+}
+
+
+int TSFifoPersistLoad(
+	const char			*	pPortName,
+	TSFifoPersistData	&	data	)
+{
+	char	acPath[TSFIFO_PERSIST_DIR_MAX + TSFIFO_PORT_NAME_MAX + 16];
+	if ( pPortName == NULL || !PersistPath( pPortName, "", acPath, sizeof(acPath) ) )
+		return -1;
+
+	FILE	*	fp	= fopen( acPath, "rb" );
+	if ( fp == NULL )
+		return -1;
+	size_t	nRead	= fread( &data, sizeof(data), 1, fp );
+	fclose( fp );
+
+	const char	*	pReason	= NULL;
+	double			secPerTick	= HiResTicksToSeconds( 1LL );
+	if ( nRead != 1 )
+		pReason	= "short file";
+	else if (	data.magic		!= TSFIFO_PERSIST_MAGIC
+			||	data.version	!= TSFIFO_PERSIST_VERSION
+			||	data.size		!= sizeof(TSFifoPersistData) )
+		pReason	= "unknown format";
+	else if ( fabs( data.secPerTick - secPerTick ) > TSFIFO_PERSIST_TSC_TOL * secPerTick )
+		pReason	= "TSC calibration changed";
+	if ( pReason != NULL )
+	{
+		printf( "TSFifo: Ignoring warm start file %s, %s\n", acPath, pReason );
+		return -1;
+	}
+
+	if ( DEBUG_TS_FIFO )
+		printf( "TSFifo: Loaded warm start file %s, EC %u, gen %u\n",
+				acPath, data.eventCode, data.generation );
+	return 0;
+}
+
+
+int TSFifoPersistSave(
+	const char				*	pPortName,
+	const TSFifoPersistData	&	data	)
+{
+	char	acPath[TSFIFO_PERSIST_DIR_MAX + TSFIFO_PORT_NAME_MAX + 16];
+	char	acTmpPath[TSFIFO_PERSIST_DIR_MAX + TSFIFO_PORT_NAME_MAX + 16];
+	if (	pPortName == NULL
+		||	!PersistPath( pPortName, "", acPath, sizeof(acPath) )
+		||	!PersistPath( pPortName, ".tmp", acTmpPath, sizeof(acTmpPath) ) )
+		return EINVAL;
+
+	// Write a temp file and rename it, so a crash never leaves a partial file
+	FILE	*	fp	= fopen( acTmpPath, "wb" );
+	if ( fp == NULL )
+		return errno;
+	int		status	= 0;
+	if ( fwrite( &data, sizeof(data), 1, fp ) != 1 )
+		status	= errno;
+	if ( fclose( fp ) != 0 && status == 0 )
+		status	= errno;
+	if ( status == 0 && rename( acTmpPath, acPath ) != 0 )
+		status	= errno;
+	if ( status != 0 )
+		remove( acTmpPath );
+	return status;
+}
+
+
+/// SaveThread:  Save all ports every persist period
+static void SaveThread( void * )
+{
+	while ( true )
+	{
+		epicsMutexLock( s_persistLock );
+		double	period	= s_persistPeriod;
+		bool	fSave	= ( s_persistDir[0] != '\0' );
+		epicsMutexUnlock( s_persistLock );
+
+		epicsThreadSleep( period );
+		if ( fSave )
+			TSFifo::SavePersistAll( );
+	}
+}
+
+
+extern "C" int TSFifoSetPersistDir(
+	const char	*	pPath,
+	double			period	)
+{
+	if ( pPath == NULL )
+		pPath	= "";
+	if ( strlen(pPath) >= TSFIFO_PERSIST_DIR_MAX )
+	{
+		printf( "TSFifoSetPersistDir: Path %s is longer than %d chars\n", pPath, TSFIFO_PERSIST_DIR_MAX - 1 );
+		return -1;
+	}
+
+	epicsThreadOnce( &s_persistOnce, PersistLockInit, NULL );
+	epicsMutexLock( s_persistLock );
+	strcpy( s_persistDir, pPath );
+	s_persistPeriod	= ( period > 0 ? period : TSFIFO_PERSIST_PERIOD_DEFAULT );
+	bool	fStart	= ( s_persistDir[0] != '\0' && !s_saveThreadStarted );
+	if ( fStart )
+		s_saveThreadStarted	= true;
+	epicsMutexUnlock( s_persistLock );
+
+	if ( fStart )
+		epicsThreadCreate(	"TSFifoPersist", epicsThreadPriorityLow,
+							epicsThreadGetStackSize( epicsThreadStackSmall ),
+							SaveThread, NULL );
+	return 0;
+}
+
+
+// Register shell callable functions with iocsh
+
+//	Register TSFifoSetPersistDir
+static const	iocshArg		TSFifoSetPersistDir_Arg0	= { "path",		iocshArgString };
+static const	iocshArg		TSFifoSetPersistDir_Arg1	= { "period",	iocshArgDouble };
+static const	iocshArg	*	TSFifoSetPersistDir_Args[2]	=
+{
+	&TSFifoSetPersistDir_Arg0, &TSFifoSetPersistDir_Arg1
+};
+static const	iocshFuncDef	TSFifoSetPersistDir_FuncDef	= { "TSFifoSetPersistDir", 2, TSFifoSetPersistDir_Args };
+static void		TSFifoSetPersistDir_CallFunc( const iocshArgBuf * args )
+{
+	if ( args[0].sval == 0 )
+	{
+		printf( "Usage: TSFifoSetPersistDir path period\n" );
+		printf( "  path:   Directory for <portName>.tsfifo warm start files, empty to stop saving\n" );
+		printf( "  period: Save period in sec, default %.0f\n", TSFIFO_PERSIST_PERIOD_DEFAULT );
+		return;
+	}
+	TSFifoSetPersistDir( args[0].sval, args[1].dval );
+}
+static void TSFifoPersist_Register( void )
+{
+	iocshRegister( &TSFifoSetPersistDir_FuncDef, TSFifoSetPersistDir_CallFunc );
+}
+epicsExportRegistrar( TSFifoPersist_Register );
@@ -0,0 +1,76 @@
+#ifndef TSFIFO_PERSIST_H
+#define TSFIFO_PERSIST_H
+
+#include "epicsTypes.h"
+
+///
+/// Header file for TSFifo warm-start across IOC restarts
+///
+/// A background thread periodically saves each port's learned sync state
+/// to <dir>/<portName>.tsfifo, a small versioned binary file.  When a port
+/// is created its file is loaded, and the first time TSFifo_Process sees
+/// the port's event code and generation the state is applied only if they
+/// match what was saved.  The port then starts w/ its fidDiff cadence,
+/// delay range, delay statistics and auto-tuned expected delay instead of
+/// from scratch.
+///
+/// Files w/ a different magic, version or size, or saved w/ a different
+/// TSC calibration, are ignored.
+///
+
+/// "TSFP"
+#define	TSFIFO_PERSIST_MAGIC			0x50465354
+#define	TSFIFO_PERSIST_VERSION			1
+
+/// Max persist directory length, including the terminating null
+#define	TSFIFO_PERSIST_DIR_MAX			256
+
+/// Save period in sec if TSFifoSetPersistDir isn't given one
+#define	TSFIFO_PERSIST_PERIOD_DEFAULT	60.0
+
+/// Max relative change in TSC calibration for a file to be used
+#define	TSFIFO_PERSIST_TSC_TOL			1e-3
+
+struct	TSFifoPersistData
+{
+	epicsUInt32		magic;			/// TSFIFO_PERSIST_MAGIC
+	epicsUInt32		version;		/// TSFIFO_PERSIST_VERSION
+	epicsUInt32		size;			/// sizeof(TSFifoPersistData)
+	epicsUInt32		eventCode;
+	epicsUInt32		generation;
+	epicsInt32		fidDiffLock;	/// fidDiff between matched FIFO entries
+	double			secPerTick;		/// TSC calibration when saved
+	double			expDelay;		/// Expected delay when saved, sec
+	double			learnedDelay;	/// Auto-tuned expected delay, sec, 0 if none
+	double			diffVsExpMin;	/// sec
+	double			diffVsExpMax;	/// sec
+	double			fifoDelayMin;	/// sec
+	double			fifoDelayMax;	/// sec
+	epicsUInt32		delayCount;		/// Synced frames in the delay statistics
+	double			delayMean;		/// sec
+	double			delayStdDev;	/// sec
+	double			delayP50;		/// sec
+	double			delayP95;		/// sec
+	double			delayP99;		/// sec
+};
+
+/// TSFifoSetPersistDir
+/// Set the directory and save period in sec, and start the save thread.
+/// Call from st.cmd before iocInit so new ports can load their files.
+/// An empty path stops saving.
+/// Returns 0 on success, -1 on error
+extern "C" int	TSFifoSetPersistDir(	const char	*	pPath,
+										double			period	);
+
+/// TSFifoPersistLoad
+/// Returns 0 and fills in data if the persist dir has a valid file for pPortName
+int		TSFifoPersistLoad(	const char			*	pPortName,
+							TSFifoPersistData	&	data	);
+
+/// TSFifoPersistSave
+/// Write data to the file for pPortName in the persist dir
+/// Returns 0 on success, otherwise an errno value
+int		TSFifoPersistSave(	const char				*	pPortName,
+							const TSFifoPersistData	&	data	);
+
+#endif  //  TSFIFO_PERSIST_H
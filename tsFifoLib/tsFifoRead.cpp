@@ -0,0 +1,123 @@
+#include <stdio.h>
+
+#include <iocsh.h>
+#include <registryFunction.h>
+#include <epicsExport.h>
+
+#include "timeStampFifo.h"
+#include "tsFifoRead.h"
+#include "tsFifoSim.h"
+
+static TSFifoBulkReadFunc	s_pBulkRead	= NULL;
+
+
+int TSFifoRead(
+	unsigned int			eventCode,
+	int						incr,
+	uint64_t			*	pIdx,
+	EventTimingData		*	pFifoInfoRet,
+	const TSFifoSim		*	pSim	)
+{
+	if ( pSim != NULL )
+		return pSim->Read( eventCode, incr, pIdx, pFifoInfoRet );
+	return timingFifoRead( eventCode, incr, pIdx, pFifoInfoRet );
+}
+
+epicsUInt32 TSFifoGetLastFiducial( const TSFifoSim * pSim )
+{
+	if ( pSim != NULL )
+		return pSim->GetLastFiducial( );
+	return timingGetLastFiducial( );
+}
+
+
+extern "C" void TSFifoRegisterBulkRead( TSFifoBulkReadFunc pBulkRead )
+{
+	s_pBulkRead	= pBulkRead;
+}
+
+extern "C" int TSFifoHasBulkRead( )
+{
+	return s_pBulkRead != NULL;
+}
+
+
+unsigned int TSFifoReadRange(
+	unsigned int			eventCode,
+	int						incr,
+	uint64_t			*	pIdx,
+	EventTimingData		*	pBuf,
+	uint64_t			*	pIdxBuf,
+	unsigned int			nMax,
+	const TSFifoSim		*	pSim	)
+{
+	if ( pIdx == NULL || pBuf == NULL || nMax == 0 )
+		return 0;
+
+	TSFifoBulkReadFunc	pBulkRead	= s_pBulkRead;
+	if ( pBulkRead != NULL && pSim == NULL )
+	{
+		// One driver call for the whole range
+		uint64_t		idxStart	= *pIdx;
+		unsigned int	nRead		= (*pBulkRead)( eventCode, incr, pIdx, pBuf, nMax );
+		if ( nRead > nMax )
+			nRead	= nMax;
+
+		// The entry indices are only implied if the range was contiguous,
+		// i.e. it ended nRead steps from where it started
+		if ( *pIdx == idxStart + static_cast<int64_t>( incr ) * nRead )
+		{
+			for ( unsigned int i = 0; pIdxBuf != NULL && i < nRead; i++ )
+				pIdxBuf[i]	= idxStart + static_cast<int64_t>( incr ) * ( i + 1 );
+			return nRead;
+		}
+
+		// Otherwise read it again one entry at a time
+		if ( DEBUG_TS_FIFO >= 4 )
+			printf( "TSFifoReadRange: EC %u, bulk read of %u entries from %llu wasn't contiguous\n",
+					eventCode, nRead, static_cast<unsigned long long>( idxStart ) );
+		*pIdx	= idxStart;
+	}
+
+	// No driver support, fall back to one timingFifoRead per entry
+	unsigned int	nRead	= 0;
+	for ( ; nRead < nMax; nRead++ )
+	{
+		if ( TSFifoRead( eventCode, incr, pIdx, &pBuf[nRead], pSim ) != 0 )
+			break;
+		if ( pIdxBuf != NULL )
+			pIdxBuf[nRead]	= *pIdx;
+	}
+	return nRead;
+}
+
+
+// Register shell callable functions with iocsh
+
+//	Register TSFifoSetBulkRead
+static const	iocshArg		TSFifoSetBulkRead_Arg0		= { "functionName",	iocshArgString };
+static const	iocshArg	*	TSFifoSetBulkRead_Args[1]	= { &TSFifoSetBulkRead_Arg0 };
+static const	iocshFuncDef	TSFifoSetBulkRead_FuncDef	= { "TSFifoSetBulkRead", 1, TSFifoSetBulkRead_Args };
+static void		TSFifoSetBulkRead_CallFunc( const iocshArgBuf * args )
+{
+	if ( args[0].sval == 0 )
+	{
+		printf( "Usage: TSFifoSetBulkRead functionName\n" );
+		printf( "Bulk FIFO reads are %s\n", TSFifoHasBulkRead() ? "enabled" : "disabled" );
+		printf( "W/o a driver bulk reader, each FIFO entry is read w/ its own timingFifoRead\n" );
+		return;
+	}
+
+	TSFifoBulkReadFunc	pBulkRead = (TSFifoBulkReadFunc) registryFunctionFind( args[0].sval );
+	if ( pBulkRead == NULL )
+	{
+		printf( "Error TSFifoSetBulkRead: Cannot find function \"%s\"\n", args[0].sval );
+		return;
+	}
+	TSFifoRegisterBulkRead( pBulkRead );
+}
+static void TSFifoRead_Register( void )
+{
+	iocshRegister( &TSFifoSetBulkRead_FuncDef, TSFifoSetBulkRead_CallFunc );
+}
+epicsExportRegistrar( TSFifoRead_Register );
@@ -0,0 +1,71 @@
+#ifndef TSFIFO_READ_H
+#define TSFIFO_READ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "timingFifoApi.h"
+
+///
+/// Header file for bulk reads of the timing FIFO
+///
+/// timingFifoRead returns one entry per call, and each call takes the
+/// driver's lock.  TSFifoReadRange fetches a contiguous range of entries
+/// for an event code in one operation when the timing driver provides a
+/// bulk reader, and falls back to looped timingFifoRead calls otherwise.
+///
+/// The timing driver doesn't export a bulk reader yet, so until one is
+/// registered w/ TSFifoSetBulkRead or TSFifoRegisterBulkRead, every entry
+/// is still its own timingFifoRead call and TSFifoReadRange saves nothing.
+///
+/// All reads take an optional TSFifoSim.  When one is given, entries come
+/// from that simulation instead of the timing driver.
+///
+
+class	TSFifoSim;
+
+/// TSFifoRead
+/// Single entry read, same as timingFifoRead, except it reads from pSim
+/// when provided
+extern int				TSFifoRead(	unsigned int			eventCode,
+									int						incr,
+									uint64_t			*	pIdx,
+									EventTimingData		*	pFifoInfoRet,
+									const TSFifoSim		*	pSim = NULL	);
+
+/// TSFifoGetLastFiducial
+/// Same as timingGetLastFiducial, or the simulated fiducial from pSim
+extern epicsUInt32		TSFifoGetLastFiducial( const TSFifoSim * pSim = NULL );
+
+/// Driver provided bulk reader
+/// Reads up to nMax entries for eventCode into pBuf, stepping by incr
+/// from *pIdx, and leaves *pIdx at the last entry read.
+/// Returns the number of entries read
+typedef unsigned int (*TSFifoBulkReadFunc)(	unsigned int			eventCode,
+											int						incr,
+											uint64_t			*	pIdx,
+											EventTimingData		*	pBuf,
+											unsigned int			nMax	);
+
+/// TSFifoRegisterBulkRead
+/// Register a driver bulk reader, or NULL to revert to looped reads
+extern "C" void			TSFifoRegisterBulkRead(	TSFifoBulkReadFunc	pBulkRead	);
+
+/// Returns true if a driver bulk reader is registered
+extern "C" int			TSFifoHasBulkRead( );
+
+/// TSFifoReadRange
+/// Read up to nMax consecutive entries for eventCode, stepping by incr
+/// (1 or -1) from *pIdx.  On return, *pIdx is the index of the last entry
+/// read and, if pIdxBuf is provided, pIdxBuf[i] is the index of pBuf[i].
+/// If a bulk read doesn't return a contiguous range, the range is read
+/// again one entry at a time so pIdxBuf is always exact.
+/// Returns the number of entries read
+extern unsigned int		TSFifoReadRange(	unsigned int			eventCode,
+											int						incr,
+											uint64_t			*	pIdx,
+											EventTimingData		*	pBuf,
+											uint64_t			*	pIdxBuf,
+											unsigned int			nMax,
+											const TSFifoSim		*	pSim = NULL	);
+
+#endif  //  TSFIFO_READ_H
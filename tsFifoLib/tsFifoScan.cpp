@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "tsFifoScan.h"
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#define TSFIFO_SCAN_AVX2
+#include <immintrin.h>
+#endif
+
+
+/// ScanWindowScalar:  Portable fallback for TSFifoScanWindow
+static int ScanWindowScalar(
+	const t_HiResTime	*	pTsc,
+	unsigned int			iFirst,
+	unsigned int			nTsc,
+	t_HiResTime				tscNow,
+	epicsInt64				tscDelayMin,
+	epicsInt64				tscDelayMax,
+	epicsInt64				tscDelayExp,
+	int						iBest,
+	epicsUInt64			&	costBest	)
+{
+	for ( unsigned int i = iFirst; i < nTsc; i++ )
+	{
+		epicsInt64	tscDelay	= static_cast<epicsInt64>( tscNow - pTsc[i] );
+		if ( tscDelay <= tscDelayMin || tscDelay > tscDelayMax )
+			continue;
+		epicsInt64	diff	= tscDelay - tscDelayExp;
+		epicsUInt64	cost	= static_cast<epicsUInt64>( diff < 0 ? -diff : diff );
+		if ( cost < costBest )
+		{
+			costBest	= cost;
+			iBest		= static_cast<int>( i );
+		}
+	}
+	return iBest;
+}
+
+
+#ifdef TSFIFO_SCAN_AVX2
+/// ScanWindowAVX2:  Tests 4 candidates per step
+/// Only called when the CPU reports AVX2 support
+__attribute__(( target( "avx2" ) ))
+static int ScanWindowAVX2(
+	const t_HiResTime	*	pTsc,
+	unsigned int			nTsc,
+	t_HiResTime				tscNow,
+	epicsInt64				tscDelayMin,
+	epicsInt64				tscDelayMax,
+	epicsInt64				tscDelayExp	)
+{
+	const __m256i	vNow	= _mm256_set1_epi64x( static_cast<long long>( tscNow ) );
+	const __m256i	vMin	= _mm256_set1_epi64x( tscDelayMin );
+	const __m256i	vMax	= _mm256_set1_epi64x( tscDelayMax );
+	const __m256i	vExp	= _mm256_set1_epi64x( tscDelayExp );
+	const __m256i	vZero	= _mm256_setzero_si256( );
+	int				iBest	= -1;
+	epicsUInt64		costBest= UINT64_MAX;
+	unsigned int	i		= 0;
+
+	for ( ; i + 4 <= nTsc; i += 4 )
+	{
+		__m256i	vTsc	= _mm256_loadu_si256( reinterpret_cast<const __m256i *>( pTsc + i ) );
+		__m256i	vDelay	= _mm256_sub_epi64( vNow, vTsc );
+
+		// In window if delay > min and !( delay > max )
+		__m256i	vInWin	= _mm256_andnot_si256(	_mm256_cmpgt_epi64( vDelay, vMax ),
+												_mm256_cmpgt_epi64( vDelay, vMin ) );
+		int		mask	= _mm256_movemask_pd( _mm256_castsi256_pd( vInWin ) );
+		if ( mask == 0 )
+			continue;
+
+		// cost = | delay - exp |
+		__m256i	vDiff	= _mm256_sub_epi64( vDelay, vExp );
+		__m256i	vNeg	= _mm256_cmpgt_epi64( vZero, vDiff );
+		__m256i	vCost	= _mm256_blendv_epi8( vDiff, _mm256_sub_epi64( vZero, vDiff ), vNeg );
+		epicsUInt64	cost[4] __attribute__(( aligned( 32 ) ));
+		_mm256_store_si256( reinterpret_cast<__m256i *>( cost ), vCost );
+
+		while ( mask != 0 )
+		{
+			int		lane	= __builtin_ctz( mask );
+			mask   &= mask - 1;
+			if ( cost[lane] < costBest )
+			{
+				costBest	= cost[lane];
+				iBest		= static_cast<int>( i + lane );
+			}
+		}
+	}
+
+	// Finish any leftover candidates
+	return ScanWindowScalar(	pTsc, i, nTsc, tscNow, tscDelayMin, tscDelayMax, tscDelayExp,
+								iBest, costBest );
+}
+#endif
+
+
+extern "C" int TSFifoScanIsVectorized( )
+{
+#ifdef TSFIFO_SCAN_AVX2
+	static int	s_hasAVX2	= -1;
+	if ( s_hasAVX2 < 0 )
+	{
+		__builtin_cpu_init( );
+		s_hasAVX2	= __builtin_cpu_supports( "avx2" ) ? 1 : 0;
+	}
+	return s_hasAVX2;
+#else
+	return 0;
+#endif
+}
+
+
+extern "C" int TSFifoScanWindow(
+	const t_HiResTime	*	pTsc,
+	unsigned int			nTsc,
+	t_HiResTime				tscNow,
+	epicsInt64				tscDelayMin,
+	epicsInt64				tscDelayMax,
+	epicsInt64				tscDelayExp	)
+{
+	if ( pTsc == NULL || nTsc == 0 )
+		return -1;
+
+#ifdef TSFIFO_SCAN_AVX2
+	if ( TSFifoScanIsVectorized( ) )
+		return ScanWindowAVX2( pTsc, nTsc, tscNow, tscDelayMin, tscDelayMax, tscDelayExp );
+#endif
+
+	epicsUInt64		costBest	= UINT64_MAX;
+	return ScanWindowScalar(	pTsc, 0, nTsc, tscNow, tscDelayMin, tscDelayMax, tscDelayExp,
+								-1, costBest );
+}
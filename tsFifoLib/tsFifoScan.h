@@ -0,0 +1,31 @@
+#ifndef TSFIFO_SCAN_H
+#define TSFIFO_SCAN_H
+
+#include "epicsTypes.h"
+#include "HiResTime.h"
+
+///
+/// Header file for the FIFO window scan kernel
+///
+/// Evaluates the sync window test for a packed array of fifo_tsc values
+/// in one pass, using AVX2 when the CPU supports it and a scalar loop
+/// otherwise.
+///
+
+/// TSFifoScanWindow
+/// Select the best candidate from pTsc[0..nTsc), in the order the FIFO
+/// entries were read.  A candidate's delay is tscNow - pTsc[i], and it's in
+/// the window if tscDelayMin < delay <= tscDelayMax.  The best candidate
+/// is the one w/ delay closest to tscDelayExp, the lowest index on ties.
+/// Returns the index of the best candidate, or -1 if none are in the window
+extern "C" int	TSFifoScanWindow(	const t_HiResTime	*	pTsc,
+									unsigned int			nTsc,
+									t_HiResTime				tscNow,
+									epicsInt64				tscDelayMin,
+									epicsInt64				tscDelayMax,
+									epicsInt64				tscDelayExp	);
+
+/// Returns true if TSFifoScanWindow is using the AVX2 kernel
+extern "C" int	TSFifoScanIsVectorized( );
+
+#endif  //  TSFIFO_SCAN_H
@@ -0,0 +1,259 @@
+#ifdef __linux__
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+#include <pthread.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <iocsh.h>
+#include <epicsExport.h>
+
+#include "timeStampFifo.h"
+#include "tsFifoSched.h"
+
+#ifdef __linux__
+
+/// ParseCpuList:  Parse a CPU list like "0,2,4-7" or "node:1" into cpuMask
+/// Returns 0 on success, otherwise an errno value
+static int ParseCpuList( const char * pCpuList, epicsUInt32 * cpuMask )
+{
+	char	acNodeList[TSFIFO_CPU_LIST_MAX * 4];
+
+	memset( cpuMask, 0, sizeof(epicsUInt32) * TSFIFO_CPU_MAX / 32 );
+	if ( strncmp( pCpuList, "node:", 5 ) == 0 )
+	{
+		// Read the cores for this NUMA node from sysfs
+		char	acPath[80];
+		char *	pEnd	= NULL;
+		long	node	= strtol( pCpuList + 5, &pEnd, 10 );
+		if ( pEnd == pCpuList + 5 || *pEnd != '\0' || node < 0 )
+			return EINVAL;
+		snprintf( acPath, sizeof(acPath), "/sys/devices/system/node/node%ld/cpulist", node );
+		FILE	*	fp	= fopen( acPath, "r" );
+		if ( fp == NULL )
+			return ENOENT;
+		if ( fgets( acNodeList, sizeof(acNodeList), fp ) == NULL )
+			acNodeList[0]	= '\0';
+		fclose( fp );
+		acNodeList[strcspn( acNodeList, "\n" )]	= '\0';
+		pCpuList	= acNodeList;
+	}
+
+	const char	*	p		= pCpuList;
+	unsigned int	nCpus	= 0;
+	while ( *p != '\0' )
+	{
+		char *	pEnd	= NULL;
+		long	cpuFirst	= strtol( p, &pEnd, 10 );
+		if ( pEnd == p || cpuFirst < 0 )
+			return EINVAL;
+		long	cpuLast		= cpuFirst;
+		p	= pEnd;
+		if ( *p == '-' )
+		{
+			cpuLast	= strtol( p + 1, &pEnd, 10 );
+			if ( pEnd == p + 1 || cpuLast < cpuFirst )
+				return EINVAL;
+			p	= pEnd;
+		}
+		if ( cpuLast >= TSFIFO_CPU_MAX || cpuLast >= CPU_SETSIZE )
+			return EINVAL;
+		for ( long cpu = cpuFirst; cpu <= cpuLast; cpu++ )
+		{
+			cpuMask[cpu / 32]	|= ( 1u << ( cpu % 32 ) );
+			nCpus++;
+		}
+		if ( *p == ',' )
+			p++;
+		else if ( *p != '\0' )
+			return EINVAL;
+	}
+	return nCpus > 0 ? 0 : EINVAL;
+}
+
+
+static void MaskToCpuSet( const epicsUInt32 * cpuMask, cpu_set_t * pCpuSet )
+{
+	CPU_ZERO( pCpuSet );
+	for ( int cpu = 0; cpu < TSFIFO_CPU_MAX && cpu < CPU_SETSIZE; cpu++ )
+	{
+		if ( cpuMask[cpu / 32] & ( 1u << ( cpu % 32 ) ) )
+			CPU_SET( cpu, pCpuSet );
+	}
+}
+
+
+static void CpuSetToMask( const cpu_set_t * pCpuSet, epicsUInt32 * cpuMask )
+{
+	memset( cpuMask, 0, sizeof(epicsUInt32) * TSFIFO_CPU_MAX / 32 );
+	for ( int cpu = 0; cpu < TSFIFO_CPU_MAX && cpu < CPU_SETSIZE; cpu++ )
+	{
+		if ( CPU_ISSET( cpu, pCpuSet ) )
+			cpuMask[cpu / 32]	|= ( 1u << ( cpu % 32 ) );
+	}
+}
+
+
+extern "C" int TSFifoSchedParse(
+	const char		*	pCpuList,
+	int					priority,
+	TSFifoSched		*	pSched		)
+{
+	if ( pSched == NULL )
+		return EINVAL;
+	memset( pSched, 0, sizeof(*pSched) );
+	if ( pCpuList != NULL && strlen(pCpuList) > 0 )
+	{
+		if ( strlen(pCpuList) >= TSFIFO_CPU_LIST_MAX )
+			return EINVAL;
+		int	status	= ParseCpuList( pCpuList, pSched->cpuMask );
+		if ( status != 0 )
+			return status;
+		pSched->fAffinity	= true;
+	}
+	if (	priority < 0
+		||	( priority > 0 && priority < sched_get_priority_min( SCHED_FIFO ) )
+		||	priority > sched_get_priority_max( SCHED_FIFO ) )
+		return EINVAL;
+	pSched->priority	= priority;
+	return 0;
+}
+
+
+extern "C" int TSFifoSchedCheck(
+	const char	*	pCpuList,
+	int				priority	)
+{
+	TSFifoSched	sched;
+	return TSFifoSchedParse( pCpuList, priority, &sched );
+}
+
+
+extern "C" int TSFifoSchedApply(
+	const TSFifoSched	*	pSched,
+	TSFifoSchedSaved	*	pSaved	)
+{
+	if ( pSched == NULL || pSaved == NULL )
+		return EINVAL;
+
+	// Save the thread's own settings before we change them
+	int		status	= 0;
+	if ( !pSaved->fSaved )
+	{
+		cpu_set_t			cpuSet;
+		struct sched_param	param;
+		status	= pthread_getaffinity_np( pthread_self(), sizeof(cpuSet), &cpuSet );
+		if ( status == 0 )
+			status	= pthread_getschedparam( pthread_self(), &pSaved->policy, &param );
+		if ( status != 0 )
+			return status;
+		CpuSetToMask( &cpuSet, pSaved->cpuMask );
+		pSaved->priority	= param.sched_priority;
+		pSaved->fSaved		= true;
+	}
+
+	cpu_set_t	cpuSet;
+	MaskToCpuSet( pSched->fAffinity ? pSched->cpuMask : pSaved->cpuMask, &cpuSet );
+	status	= pthread_setaffinity_np( pthread_self(), sizeof(cpuSet), &cpuSet );
+	if ( status != 0 )
+		return status;
+
+	struct sched_param	param;
+	memset( &param, 0, sizeof(param) );
+	if ( pSched->priority > 0 )
+	{
+		param.sched_priority	= pSched->priority;
+		status	= pthread_setschedparam( pthread_self(), SCHED_FIFO, &param );
+	}
+	else
+	{
+		param.sched_priority	= pSaved->priority;
+		status	= pthread_setschedparam( pthread_self(), pSaved->policy, &param );
+	}
+	return status;
+}
+
+
+extern "C" int TSFifoSchedGetCpu( )
+{
+	return sched_getcpu( );
+}
+
+#else	//	__linux__
+
+extern "C" int TSFifoSchedParse(
+	const char		*	pCpuList,
+	int					priority,
+	TSFifoSched		*	pSched		)
+{
+	return ENOTSUP;
+}
+
+extern "C" int TSFifoSchedCheck(
+	const char	*	pCpuList,
+	int				priority	)
+{
+	return ENOTSUP;
+}
+
+extern "C" int TSFifoSchedApply(
+	const TSFifoSched	*	pSched,
+	TSFifoSchedSaved	*	pSaved	)
+{
+	return ENOTSUP;
+}
+
+extern "C" int TSFifoSchedGetCpu( )
+{
+	return -1;
+}
+
+#endif	//	__linux__
+
+
+// Register shell callable functions with iocsh
+
+//	Register TSFifoSetSched
+static const	iocshArg		TSFifoSetSched_Arg0		= { "portName",	iocshArgString };
+static const	iocshArg		TSFifoSetSched_Arg1		= { "cpuList",	iocshArgString };
+static const	iocshArg		TSFifoSetSched_Arg2		= { "priority",	iocshArgInt };
+static const	iocshArg	*	TSFifoSetSched_Args[3]	=
+{
+	&TSFifoSetSched_Arg0, &TSFifoSetSched_Arg1, &TSFifoSetSched_Arg2
+};
+static const	iocshFuncDef	TSFifoSetSched_FuncDef	= { "TSFifoSetSched", 3, TSFifoSetSched_Args };
+static void		TSFifoSetSched_CallFunc( const iocshArgBuf * args )
+{
+	if ( args[0].sval == 0 )
+	{
+		printf( "Usage: TSFifoSetSched portName cpuList priority\n" );
+		printf( "  Changes the scheduling of every thread that calls GetTimeStamp on the port,\n" );
+		printf( "  including driver threads not created by this module, on their next call.\n" );
+		printf( "  cpuList:  i.e. 2,3 or 4-7 or node:0, empty for the original affinity\n" );
+		printf( "  priority: SCHED_FIFO priority, 0 for the original scheduling\n" );
+		return;
+	}
+
+	TSFifo		*   pTSFifo		= TSFifo::FindByPortName( args[0].sval );
+	if ( pTSFifo == NULL )
+	{
+		printf( "Error: Unable to find TSFifo %s\n", args[0].sval );
+		printf( "Available TSFifo Ports are:\n" );
+		TSFifo::ListPorts();
+		return;
+	}
+	int	status	= pTSFifo->SetSched( args[1].sval, args[2].ival );
+	if ( status != 0 )
+		printf( "Error TSFifoSetSched: Invalid settings for port %s: %s\n",
+				args[0].sval, strerror( status ) );
+}
+static void TSFifoSched_Register( void )
+{
+	iocshRegister( &TSFifoSetSched_FuncDef, TSFifoSetSched_CallFunc );
+}
+epicsExportRegistrar( TSFifoSched_Register );
@@ -0,0 +1,82 @@
+#ifndef TSFIFO_SCHED_H
+#define TSFIFO_SCHED_H
+
+#include "epicsTypes.h"
+
+///
+/// Header file for TSFifo CPU affinity and real-time priority
+///
+/// GetTimeStamp's accuracy depends on how quickly the thread calling it
+/// runs after a frame arrives, and on the TSC being consistent between
+/// the cores it runs on.  Each TSFifo port can pin the thread calling its
+/// GetTimeStamp to a set of cores and give it a SCHED_FIFO priority.
+/// The settings are parsed once, when they're set, and applied by
+/// GetTimeStamp itself the first time each thread calls it after the
+/// settings change.  Each thread's own policy, priority and affinity are
+/// saved before the first change, and restored when the settings go back
+/// to an empty cpuList or priority 0.
+///
+/// CPU lists are in the usual Linux format, i.e. "2", "2,3" or "4-7",
+/// or "node:N" for all the cores on NUMA node N, such as the node
+/// servicing the EVR interrupts.
+///
+/// iocsh commands:
+///   TSFifoSetSched portName cpuList priority	- Set the port's CPU list and
+///						SCHED_FIFO priority.  An empty cpuList restores the original
+///						affinity, and priority 0 the original scheduling policy.
+///
+
+/// Max length of a CPU list, including the terminating null
+#define	TSFIFO_CPU_LIST_MAX		64
+
+/// Max number of cores in a CPU list
+#define	TSFIFO_CPU_MAX			1024
+
+///
+/// TSFifoSched
+/// A parsed CPU list and priority, ready to apply w/o any file system access
+///
+struct	TSFifoSched
+{
+	bool			fAffinity;							/// false to leave affinity as saved
+	int				priority;							/// SCHED_FIFO priority, 0 for the saved policy
+	epicsUInt32		cpuMask[TSFIFO_CPU_MAX / 32];
+};
+
+///
+/// TSFifoSchedSaved
+/// A thread's own scheduling, saved before TSFifoSchedApply first changes it
+///
+struct	TSFifoSchedSaved
+{
+	bool			fSaved;
+	int				policy;
+	int				priority;
+	epicsUInt32		cpuMask[TSFIFO_CPU_MAX / 32];
+};
+
+/// TSFifoSchedParse
+/// Parse the CPU list and priority into pSched.  node:N lists are read from sysfs.
+/// Returns 0 if they're valid, otherwise an errno value
+extern "C" int	TSFifoSchedParse(	const char		*	pCpuList,
+									int					priority,
+									TSFifoSched		*	pSched		);
+
+/// TSFifoSchedCheck
+/// Returns 0 if the CPU list and priority are valid, otherwise an errno value
+extern "C" int	TSFifoSchedCheck(	const char	*	pCpuList,
+									int				priority	);
+
+/// TSFifoSchedApply
+/// Apply pSched to the calling thread, first saving its own scheduling
+/// in pSaved if it isn't saved yet.  Settings left at their defaults
+/// restore the saved ones.  Makes no file system calls.
+/// Returns 0 on success, otherwise an errno value
+extern "C" int	TSFifoSchedApply(	const TSFifoSched	*	pSched,
+									TSFifoSchedSaved	*	pSaved	);
+
+/// TSFifoSchedGetCpu
+/// Returns the core the calling thread is running on, or -1 if unknown
+extern "C" int	TSFifoSchedGetCpu( );
+
+#endif  //  TSFIFO_SCHED_H
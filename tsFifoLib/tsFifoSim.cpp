@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "evrTime.h"
+#include "mrfCommon.h"
+#include "HiResTime.h"
+#include "tsFifoSim.h"
+
+
+TSFifoSim::TSFifoSim( )
+	:	m_tsc0(			0LL		),
+		m_fid0(			0		),
+		m_ticksPerFid(	0.0		),
+		m_depth(		MAX_TS_QUEUE	)
+{
+	m_time0.secPastEpoch	= 0;
+	m_time0.nsec			= 0;
+	for ( unsigned int eventCode = 0; eventCode < MRF_NUM_EVENTS; eventCode++ )
+		m_fidStep[eventCode]	= 0;
+}
+
+void TSFifoSim::Start( epicsUInt32 fid0 )
+{
+	m_fid0			= fid0 % FID_MAX;
+	m_ticksPerFid	= 1.0 / ( 360.0 * HiResTicksToSeconds( 1LL ) );
+	m_tsc0			= GetHiResTicks();
+	epicsTimeGetCurrent( &m_time0 );
+}
+
+int TSFifoSim::SetEvent( unsigned int eventCode, double rateHz )
+{
+	if ( eventCode == 0 || eventCode >= MRF_NUM_EVENTS || rateHz <= 0 || rateHz > 360.0 )
+		return -1;
+	m_fidStep[eventCode]	= static_cast<unsigned int>( 360.0 / rateHz + 0.5 );
+	return 0;
+}
+
+void TSFifoSim::SetDepth( unsigned int depth )
+{
+	if ( depth == 0 || depth > MAX_TS_QUEUE )
+		depth	= MAX_TS_QUEUE;
+	m_depth	= depth;
+}
+
+int64_t TSFifoSim::FidIndex( t_HiResTime tsc ) const
+{
+	if ( tsc < m_tsc0 || m_ticksPerFid <= 0 )
+		return -1;
+	return static_cast<int64_t>( ( tsc - m_tsc0 ) / m_ticksPerFid );
+}
+
+t_HiResTime TSFifoSim::FidTsc( int64_t iFid ) const
+{
+	return m_tsc0 + static_cast<t_HiResTime>( iFid * m_ticksPerFid );
+}
+
+epicsUInt32 TSFifoSim::FidPulseId( int64_t iFid ) const
+{
+	return static_cast<epicsUInt32>( ( m_fid0 + iFid ) % FID_MAX );
+}
+
+epicsUInt32 TSFifoSim::GetLastFiducial( ) const
+{
+	int64_t		iFid	= FidIndex( GetHiResTicks() );
+	if ( iFid < 0 )
+		return PULSEID_INVALID;
+	return FidPulseId( iFid );
+}
+
+int TSFifoSim::Read(
+	unsigned int			eventCode,
+	int						incr,
+	uint64_t			*	pIdx,
+	EventTimingData		*	pFifoInfoRet	) const
+{
+	if ( pIdx == NULL || pFifoInfoRet == NULL || eventCode >= MRF_NUM_EVENTS )
+		return -1;
+	unsigned int	fidStep	= m_fidStep[eventCode];
+	int64_t			iFidNow	= FidIndex( GetHiResTicks() );
+	if ( fidStep == 0 || iFidNow < 0 )
+		return -1;
+
+	int64_t		kNow	= iFidNow / fidStep;
+	int64_t		kOldest	= kNow - m_depth + 1;
+	int64_t		k;
+	if ( incr == MAX_TS_QUEUE )
+		k	= kNow;
+	else
+		k	= static_cast<int64_t>( *pIdx ) - 1 + incr;
+	if ( k < 0 || k < kOldest || k > kNow )
+		return -1;
+
+	int64_t		iFid	= k * fidStep;
+	*pIdx	= static_cast<uint64_t>( k + 1 );
+	pFifoInfoRet->fifo_tsc	= FidTsc( iFid );
+	pFifoInfoRet->fifo_fid	= FidPulseId( iFid );
+	pFifoInfoRet->fifo_time	= m_time0;
+	epicsTimeAddSeconds( &pFifoInfoRet->fifo_time, iFid / 360.0 );
+	pFifoInfoRet->fifo_time.nsec	= ( pFifoInfoRet->fifo_time.nsec & ~PULSEID_INVALID )
+									| FidPulseId( iFid );
+	return 0;
+}
+
+
@@ -0,0 +1,93 @@
+#ifndef TSFIFO_SIM_H
+#define TSFIFO_SIM_H
+
+#include <stdint.h>
+#include "epicsTypes.h"
+#include "epicsTime.h"
+#include "mrfCommon.h"
+#include "HiResTime.h"
+#include "timingFifoApi.h"
+
+///
+/// Header file for the simulated timing FIFO
+///
+/// A TSFifoSim generates events on a 360Hz fiducial grid derived from the
+/// real TSC, so the real TSFifo sync logic can be exercised without EVR
+/// hardware.  A simulation is attached to one TSFifo port w/ TSFifo::SetSim,
+/// and only that port reads from it.  All other ports keep reading the
+/// timing driver.  The tsFifoSimTest unit test runs scripted frame
+/// sequences against it, see tsFifoSimRun.h.
+///
+
+///
+/// TSFifoSim
+/// Base fiducial b occurs at m_tsc0 + b * m_ticksPerFid and has pulse id
+/// ( m_fid0 + b ) % FID_MAX.  Event k for an event code w/ fidStep n occurs
+/// on base fiducial k * n and has FIFO index k + 1.  Only the last
+/// MAX_TS_QUEUE events for each event code are available, as w/ the EVR,
+/// or fewer w/ SetDepth.
+///
+class	TSFifoSim
+{
+public:
+	TSFifoSim( );
+
+	/// Start()
+	/// Restart the fiducial grid now, w/ fid0 as its first pulse id
+	void	Start( epicsUInt32 fid0 );
+
+	/// Stop()
+	/// Stop the fiducial grid, keeping the simulated event codes
+	void	Stop( )
+	{
+		m_ticksPerFid	= 0.0;
+	}
+
+	bool	IsStarted( ) const
+	{
+		return m_ticksPerFid > 0;
+	}
+
+	/// SetEvent()
+	/// Simulate eventCode at 360Hz divided by an integer close to 360/rateHz
+	/// Returns 0 on success, -1 on an invalid event code or rate
+	int		SetEvent(	unsigned int	eventCode,
+						double			rateHz	);
+
+	/// SetDepth()
+	/// Keep only the last depth events for each event code, up to MAX_TS_QUEUE,
+	/// as for a FIFO that wraps sooner
+	void	SetDepth( unsigned int depth );
+
+	/// Returns the number of fiducials between events, 0 if not simulated
+	unsigned int	GetFidStep( unsigned int eventCode ) const
+	{
+		return eventCode < MRF_NUM_EVENTS ? m_fidStep[eventCode] : 0;
+	}
+
+	/// Read()
+	/// Same as timingFifoRead
+	int		Read(	unsigned int			eventCode,
+					int						incr,
+					uint64_t			*	pIdx,
+					EventTimingData		*	pFifoInfoRet	) const;
+
+	/// GetLastFiducial()
+	/// Same as timingGetLastFiducial
+	epicsUInt32		GetLastFiducial( ) const;
+
+	/// Ground truth for checking results
+	int64_t			FidIndex(	t_HiResTime		tsc		) const;
+	t_HiResTime		FidTsc(		int64_t			iFid	) const;
+	epicsUInt32		FidPulseId(	int64_t			iFid	) const;
+
+private:
+	t_HiResTime		m_tsc0;
+	epicsUInt32		m_fid0;
+	epicsTimeStamp	m_time0;
+	double			m_ticksPerFid;
+	unsigned int	m_depth;
+	unsigned int	m_fidStep[ MRF_NUM_EVENTS ];
+};
+
+#endif  //  TSFIFO_SIM_H
@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <epicsThread.h>
+#include <epicsEvent.h>
+
+#include "evrTime.h"
+#include "HiResTime.h"
+#include "timeStampFifo.h"
+#include "tsFifoSim.h"
+#include "tsFifoSimRun.h"
+
+/// Max threads timestamping each frame in TSFifoSimRun
+#define	TSFIFO_SIM_CALLERS_MAX	8
+
+
+/// WaitForTsc:  Sleep, then spin, until the TSC reaches tscWait
+static void WaitForTsc( t_HiResTime tscWait )
+{
+	t_HiResTime	tscNow	= GetHiResTicks();
+	if ( tscNow < tscWait )
+	{
+		double	secWait	= HiResTicksToSeconds( tscWait - tscNow );
+		if ( secWait > 2e-3 )
+			epicsThreadSleep( secWait - 2e-3 );
+	}
+	while ( GetHiResTicks() < tscWait )
+		;
+}
+
+
+/// One of the threads timestamping each frame in TSFifoSimRun
+struct	TSFifoSimCaller
+{
+	TSFifo			*	pTSFifo;
+	epicsEventId		go;
+	epicsEventId		done;
+	bool				fExit;
+	int					status;
+	epicsTimeStamp		ts;
+	TSFifoSyncInfo		syncInfo;
+	t_HiResTime			tscDone;
+};
+
+static void TSFifoSimCall( TSFifoSimCaller * pCaller )
+{
+	pCaller->status		= pCaller->pTSFifo->GetTimeStampEx( &pCaller->ts, &pCaller->syncInfo );
+	pCaller->tscDone	= GetHiResTicks();
+}
+
+static void TSFifoSimCallerThread( void * pArg )
+{
+	TSFifoSimCaller	*	pCaller	= static_cast<TSFifoSimCaller *>( pArg );
+	while ( true )
+	{
+		epicsEventMustWait( pCaller->go );
+		if ( pCaller->fExit )
+			break;
+		TSFifoSimCall( pCaller );
+		epicsEventSignal( pCaller->done );
+	}
+	epicsEventSignal( pCaller->done );
+}
+
+
+void TSFifoSimInitScenario(
+	TSFifoSimScenario	&	scenario,
+	unsigned int			eventCode,
+	unsigned int			nFrames,
+	double					delay	)
+{
+	memset( &scenario, 0, sizeof(scenario) );
+	scenario.eventCode	= eventCode;
+	scenario.nFrames	= nFrames;
+	scenario.delay		= delay;
+	scenario.nCallers	= 1;
+}
+
+
+///	TSFifoSimRun
+///	Scripted frame sequence against the simulated FIFO
+///	There's one frame per simulated event, as for a camera triggered by the
+///	event code.  Each frame calls GetTimeStampEx the requested delay after
+///	its event, and checks the returned pulse id against the pulse id of the
+///	triggering event.
+///	The run gets its own TSFifo port and its own copy of the simulation,
+///	so other ports, simulated or not, aren't affected.
+///	Stale resets are only counted for caller 0, which stamps each frame
+///	from this thread.
+int TSFifoSimRun(
+	const char				*	portName,
+	const TSFifoSim			&	simIn,
+	const TSFifoSimScenario	&	scenario,
+	TSFifoSimResult			&	result	)
+{
+	memset( &result, 0, sizeof(result) );
+	unsigned int	eventCode	= scenario.eventCode;
+	if ( !simIn.IsStarted() || simIn.GetFidStep( eventCode ) == 0 )
+	{
+		printf( "TSFifoSimRun: Enable the simulation and event code %u first\n", eventCode );
+		return -1;
+	}
+	if ( scenario.delay <= 0 )
+		return -1;
+	unsigned int	nCallers	= scenario.nCallers;
+	if ( nCallers == 0 )
+		nCallers	= 1;
+	if ( nCallers > TSFIFO_SIM_CALLERS_MAX )
+		nCallers	= TSFIFO_SIM_CALLERS_MAX;
+
+	TSFifo	*	pTSFifo	= TSFifo::Create( portName, NULL, TSFifo::TS_SYNCED );
+	if ( pTSFifo == NULL )
+	{
+		printf( "TSFifoSimRun: Unable to create port %s\n", portName );
+		return -1;
+	}
+	TSFifoSim		sim			= simIn;
+	epicsUInt32		genCount	= 0;
+	double			delay		= scenario.delay;
+	pTSFifo->SetSim( &sim );
+	pTSFifo->SetTimingCriteria( eventCode, genCount, delay );
+
+	// Caller 0 is this thread, the others wait for each frame
+	TSFifoSimCaller	callers[TSFIFO_SIM_CALLERS_MAX];
+	for ( unsigned int i = 0; i < nCallers; i++ )
+	{
+		callers[i].pTSFifo	= pTSFifo;
+		callers[i].fExit	= false;
+		if ( i == 0 )
+			continue;
+		callers[i].go		= epicsEventMustCreate( epicsEventEmpty );
+		callers[i].done		= epicsEventMustCreate( epicsEventEmpty );
+		epicsThreadCreate(	"TSFifoSimCaller", epicsThreadPriorityHigh,
+							epicsThreadGetStackSize( epicsThreadStackSmall ),
+							TSFifoSimCallerThread, &callers[i] );
+	}
+
+	double			ticksPerSec	= 1.0 / HiResTicksToSeconds( 1LL );
+	unsigned int	fidStep		= sim.GetFidStep( eventCode );
+	t_HiResTime		tscNextIn	= static_cast<t_HiResTime>(
+									( fidStep / 360.0 + 0.6 * delay ) * ticksPerSec );
+	int64_t			nGapEvents	= static_cast<int64_t>( scenario.gap * 360.0 / fidStep ) + 1;
+
+	// One frame per event, starting w/ the next one
+	int64_t		iFidEvent	= ( sim.FidIndex( GetHiResTicks() ) / fidStep ) * fidStep;
+	for ( unsigned int iFrame = 0; iFrame < scenario.nFrames; iFrame++ )
+	{
+		iFidEvent	+= fidStep;
+
+		bool	fGap	= false;
+		if (	scenario.gapEvery != 0 && iFrame != 0
+			&&	( iFrame % scenario.gapEvery ) == scenario.gapEvery - 1 )
+		{
+			// No frames for a while, so the port's next FIFO entry is stale
+			iFidEvent	+= nGapEvents * fidStep;
+			fGap		= true;
+			result.nGaps++;
+		}
+		t_HiResTime	tscEvent	= sim.FidTsc( iFidEvent );
+
+		if ( scenario.dropEvery != 0 && ( iFrame % scenario.dropEvery ) == scenario.dropEvery - 1 )
+		{
+			// Dropped trigger, no frame for this event
+			WaitForTsc( tscEvent );
+			result.nDropped++;
+			continue;
+		}
+		if ( scenario.genEvery != 0 && ( iFrame % scenario.genEvery ) == scenario.genEvery - 1 )
+		{
+			pTSFifo->SetTimingCriteria( eventCode, ++genCount, delay );
+			result.nGen++;
+		}
+
+		double	frameDelay	= delay + iFrame * scenario.drift
+							+ scenario.jitter * ( 2.0 * rand() / RAND_MAX - 1.0 );
+		if ( frameDelay < 0 )
+			frameDelay	= 0;
+		WaitForTsc( tscEvent + static_cast<t_HiResTime>( frameDelay * ticksPerSec ) );
+
+		for ( unsigned int i = 1; i < nCallers; i++ )
+			epicsEventSignal( callers[i].go );
+		TSFifoSimCall( &callers[0] );
+		for ( unsigned int i = 1; i < nCallers; i++ )
+			epicsEventMustWait( callers[i].done );
+
+		// Every pulse id we get must be the triggering event's
+		epicsUInt32		pulseIdEvent	= sim.FidPulseId( iFidEvent );
+		for ( unsigned int i = 0; i < nCallers; i++ )
+		{
+			epicsUInt32		pulseId	= PULSEID( callers[i].ts );
+			result.nCalls++;
+			if ( callers[i].tscDone > tscEvent + tscNextIn )
+				result.nDisturbed++;
+			else if ( callers[i].status != 0 || pulseId == PULSEID_INVALID )
+				result.nUnsynced++;
+			else if ( pulseId == pulseIdEvent )
+			{
+				result.nMatch++;
+				if (	fGap && i == 0
+					&&	callers[i].syncInfo.syncType == TSFIFO_SYNC_FIFO_NEXT
+					&&	callers[i].syncInfo.nFifoReads == 2 )
+					result.nStaleResets++;
+			}
+			else
+			{
+				result.nWrong++;
+				if ( DEBUG_TS_FIFO >= 2 )
+					printf( "TSFifoSimRun: frame %u, caller %u, fid 0x%X, expected 0x%X\n",
+							iFrame, i, pulseId, pulseIdEvent );
+			}
+		}
+	}
+
+	for ( unsigned int i = 1; i < nCallers; i++ )
+	{
+		callers[i].fExit	= true;
+		epicsEventSignal( callers[i].go );
+		epicsEventMustWait( callers[i].done );
+		epicsEventDestroy( callers[i].go );
+		epicsEventDestroy( callers[i].done );
+	}
+	TSFifo::Destroy( pTSFifo );
+
+	printf( "TSFifoSimRun %s: %u frames, %u callers, %u dropped, %u gen changes, %u gaps\n",
+			portName, scenario.nFrames, nCallers, result.nDropped, result.nGen, result.nGaps );
+	printf( "\tmatch %u, wrong %u, unsynced %u, disturbed %u, stale resets %u\n",
+			result.nMatch, result.nWrong, result.nUnsynced, result.nDisturbed, result.nStaleResets );
+	return 0;
+}
+
+
+double TSFifoSimMatchFraction( const TSFifoSimResult & result )
+{
+	unsigned int	nChecked	= result.nCalls - result.nDisturbed;
+	if ( nChecked == 0 )
+		return 0.0;
+	return static_cast<double>( result.nMatch ) / nChecked;
+}
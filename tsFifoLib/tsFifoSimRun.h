@@ -0,0 +1,74 @@
+#ifndef TSFIFO_SIM_RUN_H
+#define TSFIFO_SIM_RUN_H
+
+#include "epicsTypes.h"
+
+///
+/// Header file for the scripted sync runs used by tsFifoSimTest
+///
+/// Not part of the timeStampFifo library.  TSFifoSimRun drives a new TSFifo
+/// port w/ one frame per simulated event and classifies every pulse id it
+/// gets back against the event that triggered the frame.
+///
+
+class	TSFifoSim;
+
+///
+/// TSFifoSimScenario
+/// Frame sequence for one TSFifoSimRun
+///
+struct	TSFifoSimScenario
+{
+	unsigned int	eventCode;	/// Simulated event code for the frames
+	unsigned int	nFrames;	/// Number of frames, including dropped ones
+	double			delay;		/// Frame delay after the event in sec
+	double			jitter;		/// Random +/- jitter on the frame delay in sec
+	double			drift;		/// Frame delay drift per frame in sec
+	unsigned int	dropEvery;	/// Skip every Nth trigger, 0 for none
+	unsigned int	genEvery;	/// Bump the generation count every Nth frame, 0 for none
+	unsigned int	nCallers;	/// Threads timestamping each frame at once, 0 or 1 for one
+	double			gap;		/// Pause in sec before every gapEvery'th frame, long
+								/// enough that the port's next FIFO entry goes stale
+	unsigned int	gapEvery;	/// 0 for no gaps
+};
+
+///
+/// TSFifoSimResult
+/// Frame counts from one TSFifoSimRun, per caller and frame
+///
+struct	TSFifoSimResult
+{
+	unsigned int	nCalls;			/// GetTimeStamp calls checked
+	unsigned int	nMatch;			/// Pulse id of the triggering event
+	unsigned int	nWrong;			/// Valid pulse id of another event.  Always a failure.
+	unsigned int	nUnsynced;		/// PULSEID_INVALID, expected after drops and generation changes
+	unsigned int	nDisturbed;		/// GetTimeStamp didn't return until the next event was in the
+									/// sync window, e.g. the thread was preempted.  Not checked.
+	unsigned int	nDropped;		/// Dropped triggers
+	unsigned int	nGen;			/// Generation changes
+	unsigned int	nGaps;			/// Gaps before a frame
+	unsigned int	nStaleResets;	/// Frames after a gap that rejected the stale FIFO entry,
+									/// reset to the newest one and matched
+};
+
+/// TSFifoSimInitScenario
+/// Scenario w/ a fixed delay and nothing else going on
+extern void		TSFifoSimInitScenario(	TSFifoSimScenario	&	scenario,
+										unsigned int			eventCode,
+										unsigned int			nFrames,
+										double					delay	);
+
+/// TSFifoSimRun
+/// Runs the scenario against a new TS_SYNCED port named portName, which
+/// must not exist yet, reading from its own copy of sim.
+/// Returns 0 w/ result filled in, or -1 on error
+extern int		TSFifoSimRun(	const char				*	portName,
+								const TSFifoSim			&	sim,
+								const TSFifoSimScenario	&	scenario,
+								TSFifoSimResult			&	result	);
+
+/// TSFifoSimMatchFraction
+/// Fraction of the checked calls that matched, not counting disturbed ones
+extern double	TSFifoSimMatchFraction(	const TSFifoSimResult	&	result	);
+
+#endif  //  TSFIFO_SIM_RUN_H
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+
+#include "evrTime.h"
+#include "HiResTime.h"
+#include "timeStampFifo.h"
+#include "tsFifoIndex.h"
+#include "tsFifoEngine.h"
+#include "tsFifoSim.h"
+#include "tsFifoSimRun.h"
+
+///
+/// Unit test for TSFifo sync against the simulated timing FIFO
+/// Each TSFifoSimRun checks every pulse id it gets against the event
+/// that triggered its frame, so any wrong pulse id fails the test, and
+/// too few matches means the port isn't keeping sync.
+///
+/// The randomized runs log their seed.  Set TSFIFO_SIM_SEED to repeat them.
+///
+
+/// Event codes and rates used for the runs
+#define	TEST_EVENT_CODE		40
+#define	TEST_RATE_HZ		30.0
+#define	TEST_EVENT_CODE_60	42
+#define	TEST_RESTAMP_EC		41
+
+/// Min fraction of matched frames, steady and w/ dropped triggers
+#define	TEST_MATCH_MIN			0.95
+#define	TEST_MATCH_MIN_DROPS	0.80
+
+/// Number of randomized runs
+#define	TEST_N_RANDOM		8
+
+/// Number of late frames queued for re-stamping
+#define	TEST_N_RESTAMP		8
+
+/// Number of frames stamped by the ports sharing an engine
+#define	TEST_N_ENGINE		60
+
+static TSFifoSim		s_sim;
+
+/// The restamp index keeps reading its sim after the test is done
+static TSFifoSim		s_simRestamp;
+
+
+/// RunOk:  Run a scenario, check for wrong pulse ids and the match fraction
+static void RunOk(	const char				*	portName,
+					const TSFifoSimScenario	&	scenario,
+					double						matchMin,
+					const char				*	desc	)
+{
+	TSFifoSimResult		result;
+	int		status	= TSFifoSimRun( portName, s_sim, scenario, result );
+	testOk( status == 0 && result.nWrong == 0, "%s: %u wrong pulse ids", desc, result.nWrong );
+	testOk( status == 0 && TSFifoSimMatchFraction( result ) >= matchMin,
+			"%s: %.1f%% matched, %u unsynced", desc,
+			100 * TSFifoSimMatchFraction( result ), result.nUnsynced );
+}
+
+
+/// RandomRuns:  Sweep rate, delay, jitter, drops and callers at random
+/// The ranges keep each frame's next event well out of its sync window,
+/// so a wrong pulse id is always a failure.
+static void RandomRuns( )
+{
+	const char		*	pSeed	= getenv( "TSFIFO_SIM_SEED" );
+	unsigned int		seed	= pSeed != NULL	? strtoul( pSeed, NULL, 0 )
+												: static_cast<unsigned int>( time( NULL ) );
+	testDiag( "Randomized runs, seed %u", seed );
+	srand( seed );
+
+	for ( unsigned int iRun = 0; iRun < TEST_N_RANDOM; iRun++ )
+	{
+		TSFifoSimScenario	scenario;
+		double				u		= static_cast<double>( rand() ) / RAND_MAX;
+		unsigned int		ec		= ( rand() % 2 ) ? TEST_EVENT_CODE_60 : TEST_EVENT_CODE;
+		TSFifoSimInitScenario( scenario, ec, 90, 4e-3 + 8e-3 * u );
+		scenario.jitter		= 0.2 * scenario.delay * rand() / RAND_MAX;
+		scenario.dropEvery	= ( rand() % 2 ) ? 4 + rand() % 9 : 0;
+		scenario.nCallers	= 1 + rand() % 2;
+
+		char				portName[TSFIFO_PORT_NAME_MAX];
+		TSFifoSimResult		result;
+		snprintf( portName, sizeof(portName), "SimRandom%u", iRun );
+		int		status		= TSFifoSimRun( portName, s_sim, scenario, result );
+		double	matchMin	= scenario.dropEvery != 0 ? TEST_MATCH_MIN_DROPS : TEST_MATCH_MIN;
+		testOk( status == 0 && result.nWrong == 0 && TSFifoSimMatchFraction( result ) >= matchMin,
+				"Random %u: EC %u, delay %.2fms, jitter %.2fms, dropEvery %u, %u callers: "
+				"%u wrong, %.1f%% matched", iRun, ec, scenario.delay * 1000, scenario.jitter * 1000,
+				scenario.dropEvery, scenario.nCallers, result.nWrong,
+				100 * TSFifoSimMatchFraction( result ) );
+	}
+}
+
+
+/// Restamped frames, filled in by the restamp callback
+struct	TestRestamp
+{
+	epicsMutexId		lock;
+	unsigned int		nFrames;
+	epicsUInt32			token[TEST_N_RESTAMP];
+	epicsUInt32			pulseIdEvent[TEST_N_RESTAMP];
+	epicsUInt32			pulseIdRestamp[TEST_N_RESTAMP];
+	unsigned int		nCallbacks;
+};
+
+static void TestRestampCallback( void * pUserPvt, epicsUInt32 token, const epicsTimeStamp * pTimeStamp )
+{
+	TestRestamp	*	pTest	= static_cast<TestRestamp *>( pUserPvt );
+	epicsMutexLock( pTest->lock );
+	pTest->nCallbacks++;
+	for ( unsigned int i = 0; i < pTest->nFrames; i++ )
+	{
+		if ( pTest->token[i] == token )
+			pTest->pulseIdRestamp[i]	= PULSEID( *pTimeStamp );
+	}
+	epicsMutexUnlock( pTest->lock );
+}
+
+
+/// RestampRun:  Frames whose FIFO entries have already aged out
+/// The sim only keeps the newest entry, so each frame finds the next
+/// event in the FIFO and can't step back to its own.  Each gets a restamp
+/// token and a provisional timestamp, and the sim backed pulse id index
+/// must resolve every token to the frame's event.
+static void RestampRun( )
+{
+	const double	delay	= 25e-3;
+	s_simRestamp.Start( 0 );
+	s_simRestamp.SetEvent( TEST_RESTAMP_EC, 60.0 );
+	s_simRestamp.SetDepth( 1 );
+
+	TSFifoIndex		*	pIndex	= TSFifoIndex::Configure( TEST_RESTAMP_EC, 0.1, &s_simRestamp );
+	TSFifo			*	pTSFifo	= TSFifo::Create( "SimRestamp", NULL, TSFifo::TS_SYNCED );
+	testOk( pIndex != NULL && pTSFifo != NULL, "Create sim backed index and port" );
+	if ( pIndex == NULL || pTSFifo == NULL )
+		return;
+
+	TestRestamp		test;
+	test.lock		= epicsMutexMustCreate( );
+	test.nFrames	= 0;
+	test.nCallbacks	= 0;
+	pTSFifo->SetSim( &s_simRestamp );
+	pTSFifo->SetTimingCriteria( TEST_RESTAMP_EC, 0, delay );
+	pTSFifo->SetRestampCallback( TestRestampCallback, &test );
+
+	double			ticksPerSec	= 1.0 / HiResTicksToSeconds( 1LL );
+	unsigned int	fidStep		= s_simRestamp.GetFidStep( TEST_RESTAMP_EC );
+	int64_t			iFidEvent	= ( s_simRestamp.FidIndex( GetHiResTicks() ) / fidStep ) * fidStep;
+	unsigned int	nQueued		= 0;
+	for ( unsigned int iFrame = 0; iFrame < TEST_N_RESTAMP; iFrame++ )
+	{
+		iFidEvent	+= fidStep;
+		t_HiResTime	tscEvent	= s_simRestamp.FidTsc( iFidEvent );
+		t_HiResTime	tscFrame	= tscEvent + static_cast<t_HiResTime>( delay * ticksPerSec );
+
+		// Index each event before the next one replaces it in our one entry FIFO
+		while ( GetHiResTicks() < tscEvent )
+			epicsThreadSleep( 1e-3 );
+		pIndex->Update( );
+		while ( GetHiResTicks() < tscFrame )
+			epicsThreadSleep( 1e-3 );
+
+		epicsTimeStamp	ts;
+		epicsUInt32		token	= 0;
+		int				status	= pTSFifo->GetTimeStamp( &ts, &token );
+		if ( status == -1 && token != 0 && PULSEID( ts ) == PULSEID_INVALID )
+			nQueued++;
+
+		epicsMutexLock( test.lock );
+		test.token[iFrame]			= token;
+		test.pulseIdEvent[iFrame]	= s_simRestamp.FidPulseId( iFidEvent );
+		test.pulseIdRestamp[iFrame]	= PULSEID_INVALID;
+		test.nFrames++;
+		epicsMutexUnlock( test.lock );
+	}
+	testOk( nQueued == TEST_N_RESTAMP, "%u of %u late frames queued w/ a provisional timestamp",
+			nQueued, TEST_N_RESTAMP );
+
+	// Give the restamp thread a few sweeps
+	epicsThreadSleep( 0.5 );
+
+	unsigned int	nResolved	= 0;
+	epicsMutexLock( test.lock );
+	for ( unsigned int i = 0; i < test.nFrames; i++ )
+	{
+		if ( test.pulseIdRestamp[i] == test.pulseIdEvent[i] )
+			nResolved++;
+	}
+	unsigned int	nCallbacks	= test.nCallbacks;
+	epicsMutexUnlock( test.lock );
+	testOk( nCallbacks == TEST_N_RESTAMP && nResolved == TEST_N_RESTAMP,
+			"%u callbacks, %u tokens resolved to the frame's pulse id", nCallbacks, nResolved );
+
+	TSFifo::Destroy( pTSFifo );
+	epicsMutexDestroy( test.lock );
+}
+
+
+/// EngineRun:  Two ports w/ the same sim, event code and delay share an
+/// engine, and the second port to stamp each frame reuses the first's match.
+/// A port on another sim gets its own engine.
+static void EngineRun( )
+{
+	const double	delay			= 7e-3;
+	double			delayTolSave	= TS_FIFO_ENGINE_DELAY_TOL;
+	TSFifoSim		simOther		= s_sim;
+	TS_FIFO_ENGINE_DELAY_TOL		= 1e-3;
+
+	TSFifo	*	pTSFifo[3];
+	pTSFifo[0]	= TSFifo::Create( "SimEngineA", NULL, TSFifo::TS_SYNCED );
+	pTSFifo[1]	= TSFifo::Create( "SimEngineB", NULL, TSFifo::TS_SYNCED );
+	pTSFifo[2]	= TSFifo::Create( "SimEngineC", NULL, TSFifo::TS_SYNCED );
+	for ( unsigned int i = 0; i < 3; i++ )
+	{
+		if ( pTSFifo[i] == NULL )
+			continue;
+		pTSFifo[i]->SetSim( i < 2 ? &s_sim : &simOther );
+		pTSFifo[i]->SetTimingCriteria( TEST_EVENT_CODE, 0, delay );
+		pTSFifo[i]->UpdateEngine( );
+	}
+	bool	fCreated	= ( pTSFifo[0] != NULL && pTSFifo[1] != NULL && pTSFifo[2] != NULL );
+	testOk(	fCreated
+			&&	pTSFifo[0]->GetEngine() != NULL
+			&&	pTSFifo[0]->GetEngine() == pTSFifo[1]->GetEngine()
+			&&	pTSFifo[2]->GetEngine() != NULL
+			&&	pTSFifo[2]->GetEngine() != pTSFifo[0]->GetEngine(),
+			"Ports on the same sim share an engine, a port on another sim doesn't" );
+
+	double			ticksPerSec	= 1.0 / HiResTicksToSeconds( 1LL );
+	unsigned int	fidStep		= s_sim.GetFidStep( TEST_EVENT_CODE );
+	int64_t			iFidEvent	= ( s_sim.FidIndex( GetHiResTicks() ) / fidStep ) * fidStep;
+	unsigned int	nMatch		= 0;
+	unsigned int	nWrong		= 0;
+	for ( unsigned int iFrame = 0; fCreated && iFrame < TEST_N_ENGINE; iFrame++ )
+	{
+		iFidEvent	+= fidStep;
+		t_HiResTime	tscFrame	= s_sim.FidTsc( iFidEvent )
+								+ static_cast<t_HiResTime>( delay * ticksPerSec );
+		while ( GetHiResTicks() < tscFrame )
+			epicsThreadSleep( 1e-3 );
+
+		// Both ports stamp the same frame back to back
+		epicsUInt32		pulseIdEvent	= s_sim.FidPulseId( iFidEvent );
+		for ( unsigned int i = 0; i < 2; i++ )
+		{
+			epicsTimeStamp	ts;
+			if ( pTSFifo[i]->GetTimeStamp( &ts ) != 0 || PULSEID( ts ) == PULSEID_INVALID )
+				continue;
+			if ( PULSEID( ts ) == pulseIdEvent )
+				nMatch++;
+			else
+				nWrong++;
+		}
+	}
+	testOk( fCreated && nWrong == 0 && nMatch >= TEST_MATCH_MIN * 2 * TEST_N_ENGINE,
+			"Ports sharing an engine: %u wrong, %u of %u matched", nWrong, nMatch, 2 * TEST_N_ENGINE );
+	epicsUInt32		nShared	= fCreated ? pTSFifo[0]->GetEngine()->GetSharedCount() : 0;
+	testOk( nShared >= TEST_MATCH_MIN * TEST_N_ENGINE,
+			"%u of %u frames reused the other port's match", nShared, TEST_N_ENGINE );
+
+	for ( unsigned int i = 0; i < 3; i++ )
+		TSFifo::Destroy( pTSFifo[i] );
+	TS_FIFO_ENGINE_DELAY_TOL	= delayTolSave;
+}
+
+
+MAIN(tsFifoSimTest)
+{
+	testPlan( 16 + TEST_N_RANDOM + 3 + 3 );
+
+	TSFifoSimScenario	scenario;
+	TSFifoSimResult		result;
+	TSFifoSimInitScenario( scenario, TEST_EVENT_CODE, 10, 7e-3 );
+
+	testDiag( "Sim not started" );
+	testOk( TSFifoSimRun( "SimTest0", s_sim, scenario, result ) == -1,
+			"TSFifoSimRun fails w/o a simulation" );
+
+	s_sim.Start( 0 );
+	testOk( s_sim.SetEvent( TEST_EVENT_CODE, TEST_RATE_HZ ) == 0, "Simulate EC %d at %.0fHz",
+			TEST_EVENT_CODE, TEST_RATE_HZ );
+	s_sim.SetEvent( TEST_EVENT_CODE_60, 60.0 );
+	scenario.eventCode	= TEST_EVENT_CODE + 1;
+	testOk( TSFifoSimRun( "SimTest0", s_sim, scenario, result ) == -1,
+			"TSFifoSimRun fails for an event code that isn't simulated" );
+
+	TSFifoSimInitScenario( scenario, TEST_EVENT_CODE, 120, 7e-3 );
+	scenario.jitter		= 0.5e-3;
+	RunOk( "SimTest1", scenario, TEST_MATCH_MIN, "Steady delay w/ jitter" );
+
+	scenario.drift		= 10e-6;
+	RunOk( "SimTest2", scenario, TEST_MATCH_MIN, "Drifting delay" );
+
+	scenario.drift		= 0;
+	scenario.dropEvery	= 7;
+	scenario.genEvery	= 25;
+	RunOk( "SimTest3", scenario, TEST_MATCH_MIN_DROPS, "Dropped triggers and generation changes" );
+
+	scenario.genEvery	= 0;
+	scenario.nCallers	= 4;
+	RunOk( "SimTest4", scenario, TEST_MATCH_MIN_DROPS, "Concurrent callers w/ dropped triggers" );
+
+	// Start just before the wrap so the run crosses it
+	s_sim.Start( FID_MAX - 60 );
+	TSFifoSimInitScenario( scenario, TEST_EVENT_CODE, 60, 7e-3 );
+	scenario.jitter		= 0.5e-3;
+	scenario.nCallers	= 2;
+	RunOk( "SimTest5", scenario, TEST_MATCH_MIN, "Fiducial wraparound" );
+	s_sim.Start( 0 );
+
+	// After each gap the port's next FIFO entry is well over 60ms old,
+	// so it must be rejected and the port reset to the newest entry
+	TSFifoSimInitScenario( scenario, TEST_EVENT_CODE, 60, 7e-3 );
+	scenario.gap		= 0.2;
+	scenario.gapEvery	= 10;
+	int		status	= TSFifoSimRun( "SimTest6", s_sim, scenario, result );
+	testOk( status == 0 && result.nWrong == 0, "Stale FIFO entries: %u wrong pulse ids", result.nWrong );
+	testOk( status == 0 && result.nGaps > 0 && result.nStaleResets == result.nGaps,
+			"Stale FIFO entries: %u of %u gaps reset to the newest entry",
+			result.nStaleResets, result.nGaps );
+	testOk( status == 0 && TSFifoSimMatchFraction( result ) >= TEST_MATCH_MIN,
+			"Stale FIFO entries: %.1f%% matched", 100 * TSFifoSimMatchFraction( result ) );
+
+	RandomRuns( );
+
+	testDiag( "Restamp late frames from a sim backed index" );
+	RestampRun( );
+
+	testDiag( "Ports sharing an engine" );
+	EngineRun( );
+
+	s_sim.Stop( );
+	return testDone();
+}
@@ -0,0 +1,229 @@
+#include <math.h>
+
+#include "tsFifoStats.h"
+
+
+void TSFifoP2::Reset( )
+{
+	m_count			= 0;
+	for ( unsigned int i = 0; i < 5; i++ )
+	{
+		m_height[i]		= 0.0;
+		m_pos[i]		= i + 1;
+	}
+	m_desired[0]	= 1.0;
+	m_desired[1]	= 1.0 + 2.0 * m_quantile;
+	m_desired[2]	= 1.0 + 4.0 * m_quantile;
+	m_desired[3]	= 3.0 + 2.0 * m_quantile;
+	m_desired[4]	= 5.0;
+	m_incr[0]		= 0.0;
+	m_incr[1]		= m_quantile / 2.0;
+	m_incr[2]		= m_quantile;
+	m_incr[3]		= ( 1.0 + m_quantile ) / 2.0;
+	m_incr[4]		= 1.0;
+}
+
+
+void TSFifoP2::Add( double x )
+{
+	if ( m_count < 5 )
+	{
+		// Insertion sort the first 5 samples into the marker heights
+		unsigned int	i	= m_count++;
+		for ( ; i > 0 && m_height[i - 1] > x; i-- )
+			m_height[i]	= m_height[i - 1];
+		m_height[i]	= x;
+		return;
+	}
+	m_count++;
+
+	// Find the cell k w/ m_height[k] <= x < m_height[k+1], extending the ends
+	unsigned int	k;
+	if ( x < m_height[0] )
+	{
+		m_height[0]	= x;
+		k	= 0;
+	}
+	else if ( x >= m_height[4] )
+	{
+		m_height[4]	= x;
+		k	= 3;
+	}
+	else
+	{
+		k	= 0;
+		while ( x >= m_height[k + 1] )
+			k++;
+	}
+
+	for ( unsigned int i = k + 1; i < 5; i++ )
+		m_pos[i]	+= 1.0;
+	for ( unsigned int i = 0; i < 5; i++ )
+		m_desired[i]	+= m_incr[i];
+
+	// Adjust the middle markers if they're off their desired positions
+	for ( unsigned int i = 1; i < 4; i++ )
+	{
+		double	d	= m_desired[i] - m_pos[i];
+		if (	( d >=  1.0 && m_pos[i + 1] - m_pos[i] >  1.0 )
+			||	( d <= -1.0 && m_pos[i - 1] - m_pos[i] < -1.0 ) )
+		{
+			int		ds		= ( d >= 0 ? 1 : -1 );
+
+			// Try the piecewise parabolic prediction first
+			double	height	= m_height[i] + ds / ( m_pos[i + 1] - m_pos[i - 1] )
+							* (	( m_pos[i] - m_pos[i - 1] + ds ) * ( m_height[i + 1] - m_height[i] )
+								/ ( m_pos[i + 1] - m_pos[i] )
+							+	( m_pos[i + 1] - m_pos[i] - ds ) * ( m_height[i] - m_height[i - 1] )
+								/ ( m_pos[i] - m_pos[i - 1] ) );
+			if ( m_height[i - 1] < height && height < m_height[i + 1] )
+				m_height[i]	= height;
+			else
+			{
+				// Fall back to linear
+				m_height[i]	+= ds * ( m_height[i + ds] - m_height[i] ) / ( m_pos[i + ds] - m_pos[i] );
+			}
+			m_pos[i]	+= ds;
+		}
+	}
+}
+
+
+void TSFifoP2::Seed(
+	unsigned int		count,
+	const double	*	pQuantiles,
+	const double	*	pHeights,
+	unsigned int		nKnots	)
+{
+	Reset( );
+	if ( count < 5 || nKnots < 2 )
+		return;
+
+	// Each marker sits at its desired position for count samples
+	m_count	= count;
+	for ( unsigned int i = 0; i < 5; i++ )
+	{
+		double	quantile	= ( m_desired[i] - 1.0 ) / 4.0;
+		m_desired[i]	= 1.0 + ( count - 1 ) * quantile;
+
+		// Positions must increase, w/ room for the markers above
+		m_pos[i]		= floor( m_desired[i] + 0.5 );
+		if ( i > 0 && m_pos[i] <= m_pos[i - 1] )
+			m_pos[i]	= m_pos[i - 1] + 1;
+		if ( m_pos[i] > count - ( 4 - i ) )
+			m_pos[i]	= count - ( 4 - i );
+
+		unsigned int	k	= 1;
+		while ( k < nKnots - 1 && pQuantiles[k] < quantile )
+			k++;
+		double	span	= pQuantiles[k] - pQuantiles[k - 1];
+		double	frac	= ( span > 0.0 ? ( quantile - pQuantiles[k - 1] ) / span : 1.0 );
+		m_height[i]		= pHeights[k - 1] + frac * ( pHeights[k] - pHeights[k - 1] );
+		if ( i > 0 && m_height[i] < m_height[i - 1] )
+			m_height[i]	= m_height[i - 1];
+	}
+}
+
+
+double TSFifoP2::Get( ) const
+{
+	if ( m_count == 0 )
+		return 0.0;
+	if ( m_count < 5 )
+	{
+		// Too few samples for the markers, use the sorted samples
+		unsigned int	i	= static_cast<unsigned int>( m_quantile * ( m_count - 1 ) + 0.5 );
+		return m_height[i];
+	}
+	return m_height[2];
+}
+
+
+void TSFifoStats::Reset( )
+{
+	m_count			= 0;
+	m_mean			= 0.0;
+	m_m2			= 0.0;
+	m_nDrift		= 0;
+	m_meanDrift		= 0.0;
+	m_tsc0			= 0LL;
+	m_meanTime		= 0.0;
+	m_m2Time		= 0.0;
+	m_coTimeDelay	= 0.0;
+	m_p50.Reset( );
+	m_p95.Reset( );
+	m_p99.Reset( );
+}
+
+
+void TSFifoStats::Add(
+	double			delay,
+	t_HiResTime		tsc		)
+{
+	if ( m_nDrift == 0 )
+		m_tsc0	= tsc;
+	m_count++;
+	m_nDrift++;
+
+	// Welford's update for the delay and the sample time, plus the
+	// co-deviation of the two for the least squares drift slope.
+	// Seeded samples have no times, so the drift has its own delay mean.
+	double	time		= HiResTicksToSeconds( tsc - m_tsc0 );
+	double	dTime		= time  - m_meanTime;
+	double	dDelay		= delay - m_mean;
+	m_meanTime			+= dTime  / m_nDrift;
+	m_mean				+= dDelay / m_count;
+	m_meanDrift			+= ( delay - m_meanDrift ) / m_nDrift;
+	m_m2Time			+= dTime  * ( time  - m_meanTime );
+	m_m2				+= dDelay * ( delay - m_mean );
+	m_coTimeDelay		+= dTime  * ( delay - m_meanDrift );
+
+	m_p50.Add( delay );
+	m_p95.Add( delay );
+	m_p99.Add( delay );
+}
+
+
+void TSFifoStats::Seed(
+	unsigned int	count,
+	double			mean,
+	double			stdDev,
+	double			p50,
+	double			p95,
+	double			p99	)
+{
+	Reset( );
+	if ( count == 0 )
+		return;
+	m_count	= count;
+	m_mean	= mean;
+	m_m2	= stdDev * stdDev * ( count - 1 );
+
+	// The quantile markers interpolate between the saved quantiles,
+	// w/ the tails 3 std devs out
+	const double	quantiles[5]	= { 0.0, 0.50, 0.95, 0.99, 1.0 };
+	double			heights[5]		= { mean - 3 * stdDev, p50, p95, p99, mean + 3 * stdDev };
+	if ( heights[0] > p50 )
+		heights[0]	= p50;
+	if ( heights[4] < p99 )
+		heights[4]	= p99;
+	m_p50.Seed( count, quantiles, heights, 5 );
+	m_p95.Seed( count, quantiles, heights, 5 );
+	m_p99.Seed( count, quantiles, heights, 5 );
+}
+
+
+double TSFifoStats::GetStdDev( ) const
+{
+	if ( m_count < 2 )
+		return 0.0;
+	return sqrt( m_m2 / ( m_count - 1 ) );
+}
+
+
+double TSFifoStats::GetDrift( ) const
+{
+	if ( m_nDrift < 2 || m_m2Time <= 0.0 )
+		return 0.0;
+	return m_coTimeDelay / m_m2Time;
+}
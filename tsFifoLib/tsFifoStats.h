@@ -0,0 +1,133 @@
+#ifndef TSFIFO_STATS_H
+#define TSFIFO_STATS_H
+
+#include "HiResTime.h"
+
+///
+/// Header file for incremental TSFifo delay statistics
+///
+/// All statistics are updated in O(1) time and fixed memory per sample,
+/// so they can be kept current from GetTimeStamp on every synced frame.
+///
+
+///
+/// TSFifoP2 is a streaming quantile estimator using the P-square
+/// algorithm of Jain and Chlamtac, which tracks a quantile w/ 5 markers
+/// instead of storing the samples.
+///
+class	TSFifoP2
+{
+public:
+	TSFifoP2( double quantile = 0.5 )
+		:	m_quantile(	quantile	)
+	{
+		Reset( );
+	}
+
+	void	Reset( );
+
+	void	Add( double x );
+
+	/// Seed()
+	/// Restart as if count samples had been added, w/ each marker at the
+	/// height interpolated from nKnots known quantiles of the distribution.
+	/// pQuantiles must increase from 0 to 1.  Fewer than 5 samples can't
+	/// place the markers, so they just Reset.
+	void	Seed(	unsigned int		count,
+					const double	*	pQuantiles,
+					const double	*	pHeights,
+					unsigned int		nKnots	);
+
+	/// Returns the current quantile estimate, or 0 if there are no samples
+	double	Get( ) const;
+
+private:
+	double			m_quantile;
+	unsigned int	m_count;
+	double			m_height[5];	/// Marker heights
+	double			m_pos[5];		/// Marker positions
+	double			m_desired[5];	/// Desired marker positions
+	double			m_incr[5];		/// Desired position increments
+};
+
+///
+/// TSFifoStats tracks the distribution and drift of a delay
+///   Mean and stddev use Welford's algorithm
+///   p50, p95 and p99 use TSFifoP2
+///   Drift is the least squares slope of the delay vs time since Reset,
+///   or since Seed, over the samples added since
+///
+class	TSFifoStats
+{
+public:
+	TSFifoStats( )
+		:	m_p50(	0.50	),
+			m_p95(	0.95	),
+			m_p99(	0.99	)
+	{
+		Reset( );
+	}
+
+	void	Reset( );
+
+	/// Add a delay sample taken at tsc
+	void	Add(	double			delay,
+					t_HiResTime		tsc		);
+
+	/// Seed()
+	/// Restart from a saved distribution of count samples, i.e. from a
+	/// warm start file, as if they'd been added
+	void	Seed(	unsigned int	count,
+					double			mean,
+					double			stdDev,
+					double			p50,
+					double			p95,
+					double			p99	);
+
+	unsigned int	GetCount( ) const
+	{
+		return m_count;
+	}
+
+	double	GetMean( ) const
+	{
+		return m_mean;
+	}
+
+	/// Sample standard deviation
+	double	GetStdDev( ) const;
+
+	double	GetP50( ) const
+	{
+		return m_p50.Get( );
+	}
+
+	double	GetP95( ) const
+	{
+		return m_p95.Get( );
+	}
+
+	double	GetP99( ) const
+	{
+		return m_p99.Get( );
+	}
+
+	/// Drift of the delay per second of elapsed time
+	double	GetDrift( ) const;
+
+private:
+	unsigned int	m_count;
+	double			m_mean;
+	double			m_m2;			/// Sum of squared deviations from the mean
+	unsigned int	m_nDrift;		/// Samples added since Reset or Seed
+	double			m_meanDrift;	/// Mean delay of those samples
+	t_HiResTime		m_tsc0;			/// TSC of the first of them
+	double			m_meanTime;		/// Mean sample time in sec since m_tsc0
+	double			m_m2Time;		/// Sum of squared deviations of sample times
+	double			m_coTimeDelay;	/// Sum of co-deviations of sample times and delays
+	TSFifoP2		m_p50;
+	TSFifoP2		m_p95;
+	TSFifoP2		m_p99;
+};
+
+#endif  //  TSFIFO_STATS_H